@@ -0,0 +1,66 @@
+# Checks the responses to the requests bench/app.psgi answers over FastCGI,
+# including kept-alive connections and request bodies the application
+# doesn't read.  Prints "ALL OK" if everything passed, e.g.
+#
+#   bladepsgi bench/app.psgi 2 /tmp/bench.sock /tmp/bench-stats.sock
+#   python3 bench/fastcgi_suite.py /tmp/bench.sock
+
+import os
+import sys
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, BENCH_DIR)
+import fcgi_client
+
+address = sys.argv[1] if len(sys.argv) > 1 else '/tmp/bench.sock'
+failures = 0
+
+
+def response(uri, stdin=b''):
+    """Returns the headers and the body of the response to uri."""
+    stdout, _, _ = fcgi_client.simple(address, uri, stdin)
+    return stdout.split(b'\r\n\r\n', 1)
+
+
+def check(name, ok):
+    global failures
+    print(('PASS ' if ok else 'FAIL ') + name)
+    if not ok:
+        failures += 1
+
+
+with open(os.path.join(BENCH_DIR, 'app.psgi'), 'rb') as f:
+    app_source = f.read()
+big_body = bytes(range(256)) * 20000
+
+check('small', response('/small')[1] == b'{"ok":1}')
+check('chunks', response('/chunks')[1] == b''.join(b'{"row":%d}\n' % i for i in range(1, 11)))
+check('big', response('/big')[1] == b'x' * 200000)
+check('echo', response('/echo', b'q' * 100000)[1] == b'len=100000 ' + b'q' * 100000)
+check('seek small', response('/seek', b'hello world')[1] == b'11 same world')
+check('seek big', response('/seek', big_body)[1] == b'5120000 same ' + big_body[-5:])
+check('stream', response('/stream')[1] == b'a1\na2\na3\n')
+check('delayed', response('/delayed')[1] == b'delayed\n')
+check('file', response('/file')[1] == app_source)
+check('file offset', response('/file-offset')[1] == app_source[10:])
+check('pipe', response('/pipe')[1] == b''.join(b'%d\n' % i for i in range(1, 30001)))
+check('headers', response('/headers')[0].startswith(b'Status: 599 \r\nX-A: 1\r\nX-B: two\r\nSet-Cookie: a=b'))
+check('bad header', response('/bad-header')[0].startswith(b'Status: 500'))
+check('die', response('/die')[0].startswith(b'Status: 500'))
+
+s = fcgi_client.connect(address)
+for i in range(3):
+    stdout, _, _ = fcgi_client.request(s, {'PATH_INFO': '/chunks', 'REQUEST_METHOD': 'GET'},
+                                       keep=True, request_id=i + 1)
+    check('keepalive %d' % i, stdout.endswith(b'{"row":10}\n'))
+s.close()
+
+s = fcgi_client.connect(address)
+fcgi_client.request(s, {'PATH_INFO': '/nope', 'CONTENT_LENGTH': str(len(big_body))},
+                    big_body, keep=True, request_id=1)
+stdout, _, _ = fcgi_client.request(s, {'PATH_INFO': '/small'}, keep=True, request_id=2)
+check('keepalive after unread body', stdout.endswith(b'{"ok":1}'))
+s.close()
+
+print('ALL OK' if failures == 0 else '%d FAILURES' % failures)
+sys.exit(1 if failures else 0)
@@ -0,0 +1,93 @@
+# A minimal FastCGI client for the scripts in this directory.
+
+import socket
+import struct
+import sys
+
+
+def record(rtype, request_id, content=b''):
+    return struct.pack('>BBHHBB', 1, rtype, request_id, len(content), 0, 0) + content
+
+
+def name_value(name, value):
+    name = name.encode() if isinstance(name, str) else name
+    value = value.encode() if isinstance(value, str) else value
+
+    def length(n):
+        return bytes([n]) if n < 128 else struct.pack('>I', n | 0x80000000)
+    return length(len(name)) + length(len(value)) + name + value
+
+
+def connect(address):
+    """Connects to a UNIX socket path, or to HOST:PORT."""
+    if ':' in address and not address.startswith('/'):
+        host, port = address.rsplit(':', 1)
+        return socket.create_connection((host.strip('[]'), int(port)))
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(address)
+    return s
+
+
+def recv_exactly(s, n):
+    data = b''
+    while len(data) < n:
+        chunk = s.recv(n - len(data))
+        if not chunk:
+            raise EOFError('connection closed by the server')
+        data += chunk
+    return data
+
+
+def request(s, params, stdin=b'', keep=False, request_id=1):
+    """Sends one request on s; returns the FCGI_STDOUT data, the
+    (appStatus, protocolStatus) of FCGI_END_REQUEST, and the number of
+    records received."""
+    encoded = b''.join(name_value(k, v) for k, v in params.items())
+    out = record(1, request_id, struct.pack('>HB5x', 1, 1 if keep else 0))
+    for i in range(0, len(encoded), 65535):
+        out += record(4, request_id, encoded[i:i + 65535])
+    out += record(4, request_id)
+    for i in range(0, len(stdin), 65535):
+        out += record(5, request_id, stdin[i:i + 65535])
+    out += record(5, request_id)
+    s.sendall(out)
+
+    stdout = b''
+    nrecords = 0
+    while True:
+        _, rtype, _, clen, plen, _ = struct.unpack('>BBHHBB', recv_exactly(s, 8))
+        content = recv_exactly(s, clen + plen)[:clen]
+        nrecords += 1
+        if rtype == 6:
+            stdout += content
+        elif rtype == 3:
+            return stdout, struct.unpack('>IB3x', content), nrecords
+
+
+def simple(address, uri, stdin=b'', extra={}):
+    """Sends one request for uri on a connection of its own."""
+    s = connect(address)
+    params = {
+        'REQUEST_METHOD': 'POST' if stdin else 'GET',
+        'PATH_INFO': uri,
+        'REQUEST_URI': uri,
+        'QUERY_STRING': '',
+        'SERVER_NAME': 'localhost',
+        'SERVER_PORT': '80',
+        'SERVER_PROTOCOL': 'HTTP/1.1',
+        'CONTENT_LENGTH': str(len(stdin)),
+    }
+    params.update(extra)
+    try:
+        return request(s, params, stdin)
+    finally:
+        s.close()
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3:
+        sys.exit('usage: %s ADDRESS URI [BODY]' % sys.argv[0])
+    body = sys.argv[3].encode() if len(sys.argv) > 3 else b''
+    stdout, end, nrecords = simple(sys.argv[1], sys.argv[2], body)
+    sys.stdout.write(stdout.decode('latin1'))
+    print('\n-- end of request %r, %d records' % (end, nrecords))
@@ -0,0 +1,158 @@
+/*
+ * Measures how long the worker takes to read a request off a connection:
+ * ReadRequest plus one FindParam, for the same browser-like request encoded
+ * as FastCGI and as uwsgi.  The request is handed to the connection through
+ * Adopt, the way the dispatcher passes on what it has read, so no system
+ * calls are timed.  Prints the best average of five rounds for each protocol.
+ *
+ * Usage: parse_cost [REQUESTS_PER_ROUND]  (default 200000)
+ */
+#include "bladepsgi.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+#include <sys/socket.h>
+
+static const std::vector<std::pair<std::string, std::string>> bench_env = {
+	{ "REQUEST_METHOD", "GET" },
+	{ "REQUEST_URI", "/api/v1/items?page=2&sort=name" },
+	{ "SCRIPT_NAME", "" },
+	{ "PATH_INFO", "/api/v1/items" },
+	{ "QUERY_STRING", "page=2&sort=name" },
+	{ "SERVER_PROTOCOL", "HTTP/1.1" },
+	{ "SERVER_NAME", "example.com" },
+	{ "SERVER_PORT", "443" },
+	{ "REMOTE_ADDR", "203.0.113.9" },
+	{ "REMOTE_PORT", "51234" },
+	{ "CONTENT_TYPE", "" },
+	{ "CONTENT_LENGTH", "" },
+	{ "HTTPS", "on" },
+	{ "DOCUMENT_ROOT", "/srv/www" },
+	{ "HTTP_HOST", "example.com" },
+	{ "HTTP_USER_AGENT", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36" },
+	{ "HTTP_ACCEPT", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8" },
+	{ "HTTP_ACCEPT_LANGUAGE", "en-US,en;q=0.5" },
+	{ "HTTP_ACCEPT_ENCODING", "gzip, deflate, br" },
+	{ "HTTP_COOKIE", "session=0123456789abcdef0123456789abcdef; theme=dark; lang=en" },
+	{ "HTTP_REFERER", "https://example.com/api/v1/items?page=1" },
+	{ "HTTP_X_FORWARDED_FOR", "198.51.100.7" },
+};
+
+static void
+fastcgi_append_length(std::string &out, size_t len)
+{
+	if (len < 128)
+		out.push_back((char) len);
+	else
+	{
+		out.push_back((char) (0x80 | (len >> 24)));
+		out.push_back((char) (len >> 16));
+		out.push_back((char) (len >> 8));
+		out.push_back((char) len);
+	}
+}
+
+static void
+fastcgi_append_record(std::string &out, int type, const std::string &content)
+{
+	char hdr[8] = { 1, (char) type, 0, 1, (char) (content.size() >> 8), (char) content.size(), 0, 0 };
+
+	out.append(hdr, sizeof(hdr));
+	out += content;
+}
+
+static std::string
+fastcgi_encode(void)
+{
+	std::string out;
+	std::string params;
+
+	/* FCGI_BEGIN_REQUEST for FCGI_RESPONDER, then FCGI_PARAMS and FCGI_STDIN */
+	fastcgi_append_record(out, 1, std::string("\0\1\0\0\0\0\0\0", 8));
+	for (auto && kv : bench_env)
+	{
+		fastcgi_append_length(params, kv.first.size());
+		fastcgi_append_length(params, kv.second.size());
+		params += kv.first + kv.second;
+	}
+	fastcgi_append_record(out, 4, params);
+	fastcgi_append_record(out, 4, "");
+	fastcgi_append_record(out, 5, "");
+	return out;
+}
+
+static std::string
+uwsgi_encode(void)
+{
+	std::string out;
+	std::string vars;
+
+	for (auto && kv : bench_env)
+	{
+		vars.push_back((char) kv.first.size());
+		vars.push_back(0);
+		vars += kv.first;
+		vars.push_back((char) kv.second.size());
+		vars.push_back(0);
+		vars += kv.second;
+	}
+	out.push_back(0);
+	out.push_back((char) (vars.size() & 0xff));
+	out.push_back((char) (vars.size() >> 8));
+	out.push_back(0);
+	return out + vars;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nrequests = argc > 1 ? atoi(argv[1]) : 200000;
+	int sv[2];
+
+	if (nrequests <= 0)
+	{
+		fprintf(stderr, "usage: %s [REQUESTS_PER_ROUND]\n", argv[0]);
+		return 1;
+	}
+	/* Adopt wants a socket it can close; nothing is ever read from it */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+	{
+		perror("socketpair");
+		return 1;
+	}
+
+	for (BPSGIProtocol protocol : { PROTOCOL_FASTCGI, PROTOCOL_UWSGI })
+	{
+		BPSGIConnection conn(protocol, 65536, false, 0, 0, NULL);
+		BPSGIRequest request(&conn, 1024 * 1024, 0);
+		std::string wire = protocol == PROTOCOL_FASTCGI ? fastcgi_encode() : uwsgi_encode();
+		double best = 0.0;
+
+		for (int round = 0; round < 5; round++)
+		{
+			double total = 0.0;
+
+			for (int i = 0; i < nrequests; i++)
+			{
+				size_t len;
+
+				conn.Adopt(dup(sv[0]), wire.data(), wire.size());
+				auto start = std::chrono::steady_clock::now();
+				if (!conn.ReadRequest(request) || request.FindParam("HTTP_COOKIE", &len) == NULL)
+				{
+					fprintf(stderr, "could not read the request\n");
+					return 1;
+				}
+				auto end = std::chrono::steady_clock::now();
+				total += std::chrono::duration<double, std::nano>(end - start).count();
+				conn.Close();
+			}
+			if (round == 0 || total / nrequests < best)
+				best = total / nrequests;
+		}
+		printf("%-8s %4zu bytes  %6.1f ns/request\n",
+			   protocol == PROTOCOL_FASTCGI ? "fastcgi" : "uwsgi", wire.size(), best);
+	}
+	return 0;
+}
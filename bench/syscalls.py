@@ -0,0 +1,45 @@
+# Counts the read and write system calls the workers make per request, from
+# /proc/PID/io, by sending each URI 200 times over fresh connections.  Run
+# with a single worker to keep other processes' noise out, e.g.
+#
+#   bladepsgi bench/app.psgi 1 /tmp/bench.sock /tmp/bench-stats.sock
+#   python3 bench/syscalls.py /tmp/bench.sock /small /chunks /big
+
+import os
+import subprocess
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import fcgi_client
+
+REQUESTS = 200
+
+
+def worker_pids():
+    out = subprocess.check_output(['ps', '-eo', 'pid,args']).decode()
+    return [int(line.split()[0]) for line in out.splitlines() if ': worker' in line]
+
+
+def syscall_counts(pid):
+    with open('/proc/%d/io' % pid) as f:
+        fields = dict(line.split(': ') for line in f.read().splitlines())
+    return int(fields['syscr']), int(fields['syscw'])
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit('usage: %s ADDRESS URI...' % sys.argv[0])
+    address = sys.argv[1]
+    for uri in sys.argv[2:]:
+        pids = worker_pids()
+        before = {pid: syscall_counts(pid) for pid in pids}
+        for _ in range(REQUESTS):
+            fcgi_client.simple(address, uri)
+        after = {pid: syscall_counts(pid) for pid in pids}
+        reads = sum(after[pid][0] - before[pid][0] for pid in pids) / REQUESTS
+        writes = sum(after[pid][1] - before[pid][1] for pid in pids) / REQUESTS
+        print('%-10s reads/request %5.2f  writes/request %5.2f' % (uri, reads, writes))
+
+
+if __name__ == '__main__':
+    main()
@@ -7,9 +7,13 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netdb.h>
 #include <sys/stat.h>
 #include <ctime>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <dirent.h>
 
 #ifdef __linux__
 #include <sys/prctl.h>
@@ -25,6 +29,10 @@ static sig_atomic_t _mainapp_fast_shutdown = 0;
 static sig_atomic_t _mainapp_smart_shutdown = 0;
 /* 1 if the next smart shutdown should be a fast one instead, 0 otherwise */
 static sig_atomic_t _mainapp_force_fast_shutdown = 0;
+/* 1 if we should read --pool-file again, 0 otherwise */
+static sig_atomic_t _mainapp_reload_pool = 0;
+/* 1 if we should load a new generation of the application, 0 otherwise */
+static sig_atomic_t _mainapp_reload_app = 0;
 
 /* self-pipe for waking the main loop up from the signal handler */
 static int _overseer_self_pipe[2] = { -1, -1 };
@@ -64,6 +72,10 @@ BPSGIMainApplication::HandleParentSignal(int sig)
 	{
 		/* only wake the select() up */
 	}
+	else if (sig == SIGHUP)
+		_mainapp_reload_pool = 1;
+	else if (sig == SIGUSR2)
+		_mainapp_reload_app = 1;
 	else
 	{
 		/* shouldn't happen */
@@ -85,6 +97,32 @@ BPSGIMainApplication::HandleParentSignal(int sig)
 	errno = save_errno;
 }
 
+BPSGIOptions::BPSGIOptions()
+	: keepalive_timeout(60),
+	  output_buffer_size(65536),
+	  input_spool_threshold(1024 * 1024),
+	  stream_flush_interval(0),
+	  reuseport(false),
+	  dispatcher(false),
+	  offload_senders(0),
+	  offload_spool_limit(256),
+	  offload_memory_limit(1024),
+	  shed_queue_depth(0),
+	  shed_queue_age(0),
+	  shed_busy_ratio(0),
+	  shed_retry_after(1),
+	  queue_deadline(0),
+	  min_workers(-1),
+	  max_workers(65536),
+	  spare_workers(1),
+	  max_requests(0),
+	  max_requests_jitter(-1),
+	  max_rss(0),
+	  max_private_dirty(0),
+	  smaps_interval(100)
+{
+}
+
 BPSGIMainApplication::BPSGIMainApplication(
 	int argc,
 	char **argv,
@@ -93,23 +131,62 @@ BPSGIMainApplication::BPSGIMainApplication(
 	const char *application_loader,
 	const char *fastcgi_socket_path,
 	const char *stats_socket_path,
-	const char *opt_process_title_prefix
+	const char *opt_process_title_prefix,
+	const BPSGIOptions &options
 )
 	: argc_(argc),
 	  argv_(argv),
 	  psgi_application_path_(psgi_application_path),
-	  nworkers_(nworkers),
+	  nworkers_(0),
 	  application_loader_(application_loader),
-	  fastcgi_socket_path_(fastcgi_socket_path),
 	  stats_socket_path_(stats_socket_path),
 	  process_title_prefix_(opt_process_title_prefix),
+	  options_(options),
 	  runner_pid_(-1),
 	  monitoring_process_pid_(-1),
-	  fastcgi_sockfd_(-1),
-	  stats_sockfd_(-1)
+	  dispatcher_process_pid_(-1),
+	  zygote_process_pid_(-1),
+	  stats_sockfd_(-1),
+	  autoscaling_(options.min_workers >= 0 || !options.pool_file.empty()),
+	  pool_min_workers_(std::max(options.min_workers, 1)),
+	  pool_max_workers_(options.max_workers),
+	  pool_spare_workers_(options.spare_workers),
+	  pool_last_scaled_at_(0),
+	  zygote_channel_(-1),
+	  generation_(1),
+	  loading_zygote_pid_(-1),
+	  loading_zygote_channel_(-1),
+	  reloading_(false)
 {
 	runner_pid_ = getpid();
 	signal_mask_stack_.reserve(2);
+
+	BPSGILane main_lane;
+	main_lane.name = "main";
+	main_lane.socket_path = fastcgi_socket_path;
+	main_lane.nworkers = nworkers;
+	lanes_.push_back(main_lane);
+	lanes_.insert(lanes_.end(), options_.lanes.begin(), options_.lanes.end());
+
+	for (auto && lane : lanes_)
+	{
+		lane.first_worker = nworkers_;
+		lane.is_tcp = false;
+		lane.protocol = PROTOCOL_FASTCGI;
+		if (lane.socket_path.compare(0, 5, "http:") == 0)
+		{
+			lane.protocol = PROTOCOL_HTTP;
+			lane.socket_path.erase(0, 5);
+		}
+		else if (lane.socket_path.compare(0, 6, "uwsgi:") == 0)
+		{
+			lane.protocol = PROTOCOL_UWSGI;
+			lane.socket_path.erase(0, 6);
+		}
+		else if (lane.socket_path.compare(0, 8, "fastcgi:") == 0)
+			lane.socket_path.erase(0, 8);
+		nworkers_ += lane.nworkers;
+	}
 }
 
 void
@@ -117,10 +194,33 @@ BPSGIMainApplication::KillProcessGroup(int sig)
 {
 	Assert(sig == SIGQUIT || sig == SIGTERM);
 	for (auto pid : worker_pids_)
-		(void) kill(pid, sig);
+	{
+		if (pid != -1)
+			(void) kill(pid, sig);
+	}
 
 	if (monitoring_process_pid_ != -1)
 		(void) kill(monitoring_process_pid_, sig);
+	if (dispatcher_process_pid_ != -1)
+		(void) kill(dispatcher_process_pid_, sig);
+	if (zygote_process_pid_ != -1)
+		(void) kill(zygote_process_pid_, sig);
+	if (loading_zygote_pid_ != -1)
+		(void) kill(loading_zygote_pid_, sig);
+
+	/*
+	 * Senders might still be sending responses the workers finished just
+	 * now; they're only asked to exit once the workers are gone.  See
+	 * TerminateSenderProcesses.
+	 */
+	if (sig == SIGQUIT)
+	{
+		for (auto pid : sender_pids_)
+		{
+			if (pid != -1)
+				(void) kill(pid, sig);
+		}
+	}
 }
 
 bool
@@ -208,16 +308,18 @@ static bool _has_perl_interpreter = false;
 
 /*
  * InitializePerlInterpreter initializes a Perl interpreter for the current
- * subprocess.  It should only be called once per subprocess.
+ * subprocess.  It's only called more than once in a zygote loading a new
+ * generation of the application, which already has the interpreter it
+ * inherited from the overseer.
  */
 unique_ptr<BPSGIPerlInterpreter>
 BPSGIMainApplication::InitializePerlInterpreter()
 {
-	if (_has_perl_interpreter)
-		throw std::logic_error("InitializePerlInterpreter called but _has_perl_interpreter is already set");
-
-	_has_perl_interpreter = true;
-	BPSGIPerlInterpreter::PerProcessInit();
+	if (!_has_perl_interpreter)
+	{
+		_has_perl_interpreter = true;
+		BPSGIPerlInterpreter::PerProcessInit();
+	}
 	return make_unique<BPSGIPerlInterpreter>(this);
 }
 
@@ -373,25 +475,161 @@ BPSGIMainApplication::InitializeSharedMemory()
 {
 	Assert(shmem_ == NULL);
 
-	const size_t shmem_size = 4096;
+	const size_t shmem_size = BPSGISharedMemory::RequiredSize(nworkers_);
 
 	void *mem = mmap(NULL, shmem_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-	if (mem == NULL)
+	if (mem == MAP_FAILED)
 		throw SyscallException("mmap", errno);
-	shmem_ = make_unique<BPSGISharedMemory>(mem, shmem_size);
+	shmem_ = make_unique<BPSGISharedMemory>(mem, shmem_size, nworkers_);
+}
+
+/*
+ * Splits a TCP listen address of the form HOST:PORT, [IPV6ADDRESS]:PORT or
+ * *:PORT into its parts.  Returns false if the address should be treated as a
+ * UNIX socket path instead.  An empty host means the wildcard address.
+ */
+static bool
+parse_tcp_address(const char *address, std::string *host, std::string *port)
+{
+	if (address[0] == '/' || address[0] == '.')
+		return false;
+
+	const char *colon = strrchr(address, ':');
+	if (colon == NULL || colon[1] == '\0' ||
+		strspn(colon + 1, "0123456789") != strlen(colon + 1))
+		return false;
+
+	if (address[0] == '[')
+	{
+		if (colon == address || colon[-1] != ']')
+			return false;
+		host->assign(address + 1, (size_t) (colon - address - 2));
+	}
+	else
+	{
+		host->assign(address, (size_t) (colon - address));
+		if (host->find(':') != std::string::npos || host->find('/') != std::string::npos)
+			return false;
+		if (*host == "*")
+			host->clear();
+	}
+	port->assign(colon + 1);
+	return true;
 }
 
 /*
- * InitializeMainFastCGISocket initializes a socket for serving FastCGI
- * requests.  It should only be called once for the entire program, in the
- * runner process.
+ * InitializeFastCGISockets initializes the sockets for serving FastCGI
+ * requests on every lane.  It should only be called once for the entire
+ * program, in the runner process.
  */
 void
-BPSGIMainApplication::InitializeMainFastCGISocket()
+BPSGIMainApplication::InitializeFastCGISockets()
 {
 	const int listen_backlog_size_ = 16384;
 
-	fastcgi_sockfd_ = InitializeUNIXSocket(fastcgi_socket_path_, listen_backlog_size_);
+	for (auto && lane : lanes_)
+	{
+		std::string host, port;
+
+		lane.is_tcp = parse_tcp_address(lane.socket_path.c_str(), &host, &port);
+		if (!lane.is_tcp)
+		{
+			if (options_.reuseport)
+				throw RuntimeException("--reuseport requires a TCP listen address (lane %s)", lane.name.c_str());
+			lane.sockfds.push_back(InitializeUNIXSocket(lane.socket_path.c_str(), listen_backlog_size_));
+			continue;
+		}
+
+		if (!options_.reuseport)
+		{
+			lane.sockfds.push_back(InitializeTCPSocket(host, port, listen_backlog_size_, false));
+			continue;
+		}
+
+		/*
+		 * Every worker gets a socket of its own, and the kernel spreads the
+		 * incoming connections across them.  The sockets are created here and
+		 * kept open in the overseer, so that connections queued for a worker
+		 * aren't lost if the worker has to be replaced.
+		 */
+		lane.sockfds.reserve(lane.nworkers);
+		for (int i = 0; i < lane.nworkers; i++)
+			lane.sockfds.push_back(InitializeTCPSocket(host, port, listen_backlog_size_, true));
+	}
+}
+
+size_t
+BPSGIMainApplication::worker_lane_index(WorkerNo workerno) const
+{
+	Assert(workerno >= 0 && workerno < nworkers_);
+	for (size_t i = 0; i < lanes_.size(); i++)
+	{
+		if (workerno < lanes_[i].first_worker + lanes_[i].nworkers)
+			return i;
+	}
+	abort();
+}
+
+int
+BPSGIMainApplication::worker_fastcgi_sockfd(WorkerNo workerno) const
+{
+	auto &lane = worker_lane(workerno);
+	if (lane.sockfds.size() == 1)
+		return lane.sockfds[0];
+	return lane.sockfds[(size_t) (workerno - lane.first_worker)];
+}
+
+/*
+ * Returns the end of the channel between the dispatcher and worker workerno
+ * which belongs to the worker, or to the dispatcher.  Both ends stay open in
+ * the overseer so that replacement workers can pick up where the previous one
+ * left off.
+ */
+int
+BPSGIMainApplication::dispatcher_channel(WorkerNo workerno, bool worker_end) const
+{
+	return dispatcher_channels_[(size_t) workerno][worker_end ? 1 : 0];
+}
+
+int
+BPSGIMainApplication::sender_channel(int senderno, bool worker_end) const
+{
+	return sender_channels_[(size_t) senderno][worker_end ? 1 : 0];
+}
+
+void
+BPSGIMainApplication::InitializeDispatcherChannels()
+{
+	if (!options_.dispatcher)
+		return;
+
+	dispatcher_channels_.reserve(nworkers_);
+	for (WorkerNo workerno = 0; workerno < nworkers_; workerno++)
+	{
+		int sv[2];
+
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+			throw SyscallException("socketpair", errno);
+		dispatcher_channels_.push_back({{sv[0], sv[1]}});
+	}
+}
+
+/*
+ * All workers send their responses to a sender over the same socket; since
+ * it's SOCK_SEQPACKET, messages from different workers can't get mixed up.
+ */
+void
+BPSGIMainApplication::InitializeSenderChannels()
+{
+	sender_channels_.reserve(options_.offload_senders);
+	for (int senderno = 0; senderno < options_.offload_senders; senderno++)
+	{
+		int sv[2];
+
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+			throw SyscallException("socketpair", errno);
+		sender_channels_.push_back({{sv[0], sv[1]}});
+	}
 }
 
 void
@@ -402,6 +640,69 @@ BPSGIMainApplication::InitializeStatsSocket()
 	stats_sockfd_ = InitializeUNIXSocket(stats_socket_path_, listen_backlog_size_);
 }
 
+int
+BPSGIMainApplication::InitializeTCPSocket(const std::string &host, const std::string &port, const int listen_backlog_size_, bool reuseport)
+{
+	struct addrinfo hints;
+	struct addrinfo *addrs;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+	int ret = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &addrs);
+	if (ret != 0)
+		throw RuntimeException("could not resolve listen address %s:%s: %s", host.c_str(), port.c_str(), gai_strerror(ret));
+
+	/*
+	 * For the wildcard address, prefer an IPv6 socket which also accepts IPv4
+	 * connections.
+	 */
+	struct addrinfo *ai = addrs;
+	if (host.empty())
+	{
+		for (struct addrinfo *p = addrs; p != NULL; p = p->ai_next)
+		{
+			if (p->ai_family == AF_INET6)
+			{
+				ai = p;
+				break;
+			}
+		}
+	}
+
+	int sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (sockfd == -1)
+	{
+		freeaddrinfo(addrs);
+		throw SyscallException("socket", errno);
+	}
+
+	int on = 1;
+	int off = 0;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+		(reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) ||
+		(ai->ai_family == AF_INET6 && host.empty() &&
+		 setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) == -1))
+	{
+		freeaddrinfo(addrs);
+		throw SyscallException("setsockopt", errno);
+	}
+
+	if (bind(sockfd, ai->ai_addr, ai->ai_addrlen) == -1)
+	{
+		freeaddrinfo(addrs);
+		throw SyscallException("bind", errno);
+	}
+	freeaddrinfo(addrs);
+
+	if (listen(sockfd, listen_backlog_size_) == -1)
+		throw SyscallException("listen", errno);
+
+	return sockfd;
+}
+
 int
 BPSGIMainApplication::InitializeUNIXSocket(const char *path, const int listen_backlog_size_)
 {
@@ -469,131 +770,985 @@ BPSGIMainApplication::RunWorker(WorkerNo workerno, unique_ptr<BPSGIPerlInterpret
 	_exit(ret);
 }
 
-// fastcgi_wrapper_loader.cpp
-extern const char *fastcgi_wrapper_loader;
+/*
+ * Returns the number of threads in this process, or -1 if /proc can't tell.
+ */
+static int
+count_threads()
+{
+	DIR *dir = opendir("/proc/self/task");
+	if (dir == NULL)
+		return -1;
+
+	int nthreads = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_name[0] != '.')
+			nthreads++;
+	}
+	(void) closedir(dir);
+	return nthreads;
+}
 
+/*
+ * The zygote is a copy of the overseer made once the application has been
+ * loaded, and forks every worker on the overseer's behalf.  Keeping it around
+ * means a worker which dies can be replaced by one just as warm, without
+ * forking the overseer, whose job is to notice such things.
+ *
+ * Workers are forked with CLONE_PARENT, which makes them children of the
+ * overseer instead of the zygote, so the overseer can wait for them and
+ * their parent death signal is tied to the overseer.
+ */
 void
-BPSGIMainApplication::SpawnWorkersAndAuxiliaryProcesses()
+BPSGIMainApplication::SpawnZygoteProcess(bool new_generation)
 {
-	unique_ptr<BPSGIPerlInterpreter> interpreter;
-	unique_ptr<BPSGIPerlCallbackFunction> wrapper_loader_callback;
-	unique_ptr<BPSGIPerlCallbackFunction> auxiliary_loader_callback;
-	unique_ptr<BPSGIPerlCallbackFunction> main_callback;
+	int sv[2];
 
-	try {
-		interpreter = InitializePerlInterpreter();
-	} catch (const PerlInterpreterException &ex) {
-		Log(LS_ERROR, "Could not initialize Perl interpreter: %s", ex.strerror());
-		_exit(1);
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+		throw SyscallException("socketpair", errno);
+
+	pid_t pid = fork();
+	if (pid == -1)
+		throw SyscallException("fork", errno);
+	else if (pid == 0)
+	{
+		(void) close(sv[0]);
+		if (new_generation)
+		{
+			(void) close(zygote_channel_);
+			generation_++;
+		}
+		zygote_channel_ = sv[1];
+		RunZygoteProcess(new_generation);
+		abort();
 	}
-	try {
-		wrapper_loader_callback = interpreter->LoadCallbackFromCString(fastcgi_wrapper_loader);
-	} catch (const PerlInterpreterException &ex) {
-		/* TODO: ??? */
-		Log(LS_ERROR, "Could not initialize PSGI application: %s", ex.strerror());
-		_exit(1);
+	else if (pid > 0)
+	{
+		(void) close(sv[1]);
+		if (new_generation)
+		{
+			loading_zygote_channel_ = sv[0];
+			loading_zygote_pid_ = pid;
+		}
+		else
+		{
+			zygote_channel_ = sv[0];
+			zygote_process_pid_ = pid;
+		}
 	}
+	else
+		throw SyscallException("fork", "unexpected return value %ld", (long) pid);
+}
 
-	try {
-		main_callback = wrapper_loader_callback->CallAndReceiveCallback();
-	} catch (const PerlInterpreterException &ex) {
-		Log(LS_ERROR, "Could not initialize PSGI loader or callback: %s", ex.strerror());
-		_exit(1);
-	}
+void
+BPSGIMainApplication::RunZygoteProcess(bool new_generation)
+{
+	std::string title = "zygote";
+	if (generation_ > 1)
+		title += " (generation " + std::to_string(generation_) + ")";
+
+	SubprocessInit(title.c_str(), SUBP_DEFAULT_FLAGS);
+	SetSignalHandler(SIGCHLD, SIG_DFL);
+	SetSignalHandler(SIGINT, SIG_IGN);
+	SetSignalHandler(SIGHUP, SIG_IGN);
+	SetSignalHandler(SIGTERM, SIG_DFL);
+	SetSignalHandler(SIGQUIT, SIG_DFL);
+	SetSignalHandler(SIGUSR2, SIG_IGN);
+	UnblockSignals();
 
-	shmem_->LockAllocations();
+	if (new_generation)
+	{
+		/*
+		 * The interpreter inherited from the overseer has the previous
+		 * generation loaded.  It's abandoned rather than destroyed, since
+		 * destroying it would run the application's END blocks.
+		 */
+		(void) main_callback_.release();
+		(void) interpreter_.release();
+		LoadApplication();
 
-	for (auto && process : auxiliary_processes_)
-		SpawnAuxiliaryProcess(*process);
+		/* see ForkWorker */
+		if (count_threads() > 1)
+		{
+			Log(LS_ERROR, "the application started threads while loading, so workers can't be forked from it");
+			_exit(1);
+		}
 
-	worker_pids_.reserve(nworkers_);
+		/* tell the overseer we're ready to fork workers */
+		int32_t ready = (int32_t) generation_;
+		ssize_t ret;
+		while ((ret = send(zygote_channel_, &ready, sizeof(ready), 0)) == -1 && errno == EINTR)
+			;
+		if (ret != (ssize_t) sizeof(ready))
+			_exit(1);
+	}
 
-	for (WorkerNo workerno = 0; workerno < nworkers_; ++workerno)
+	for (;;)
 	{
-		pid_t pid = fork();
-		if (pid == -1)
-			throw SyscallException("fork", errno);
-		else if (pid == 0)
+		int32_t workerno;
+
+		ssize_t ret = recv(zygote_channel_, &workerno, sizeof(workerno), 0);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		else if (ret == 0)
 		{
-			RunWorker(workerno, std::move(interpreter), std::move(main_callback));
-			abort();
+			/* the overseer is gone */
+			_exit(1);
 		}
-		else if (pid > 0)
+		else if (ret != (ssize_t) sizeof(workerno) || workerno < 0 || workerno >= nworkers_)
 		{
-			worker_pids_.push_back(pid);
-			Assert(worker_pids_[(int) workerno] == pid);
+			if (SetShouldExitImmediately())
+				Log(LS_PANIC, "zygote could not read a request from the overseer");
+			_exit(1);
 		}
-		else
-			throw SyscallException("fork", "unexpected return value %ld", (long) pid);
-	}
 
-	main_callback.release();
-	interpreter->Destroy();
-}
+		int32_t reply[2];
+		BlockSignals();
+		reply[0] = (int32_t) ForkWorker((WorkerNo) workerno);
+		reply[1] = errno;
+		UnblockSignals();
 
+		while ((ret = send(zygote_channel_, reply, sizeof(reply), 0)) == -1 && errno == EINTR)
+			;
+		if (ret != (ssize_t) sizeof(reply))
+			_exit(1);
+	}
+}
 
-void
-BPSGIMainApplication::RequestAuxiliaryProcess(std::string name, unique_ptr<BPSGIPerlCallbackFunction> callback)
+/*
+ * Forks a new worker process for the slot workerno in the zygote.  Returns
+ * the process ID of the worker, or -1 with errno set.
+ *
+ * CLONE_PARENT isn't available through fork(), so this uses the raw system
+ * call, which skips what glibc does around a fork: the pthread_atfork
+ * handlers (Perl registers some with ithreads), resetting its internal locks,
+ * and updating the thread ID cached in the thread control block.  That's safe
+ * only because the zygote is single-threaded: with no other thread around,
+ * none of those locks can be held at the time of the fork, so there's nothing
+ * for the atfork handlers or glibc to release in the child.  The stale
+ * thread ID would only matter to robust or priority-inheriting mutexes, which
+ * neither we nor Perl use; getpid() has not been cached since glibc 2.25, and
+ * raise() asks the kernel for the thread ID.  The zygote forked at startup is
+ * single-threaded because fork() only copies the calling thread; one loading
+ * a new generation checks that the application didn't start any threads.
+ */
+pid_t
+BPSGIMainApplication::ForkWorker(WorkerNo workerno)
 {
-	auxiliary_processes_.push_back(make_unique<BPSGIAuxiliaryProcess>(this, name, std::move(callback)));
+	pid_t pid = (pid_t) syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+	if (pid == 0)
+	{
+		(void) close(zygote_channel_);
+		RunWorker(workerno, std::move(interpreter_), std::move(main_callback_));
+		abort();
+	}
+	return pid;
 }
 
+/*
+ * Has the zygote fork a new worker process into the slot workerno.  Must be
+ * called with signals blocked, so that the new worker can't be waited for
+ * before we know its process ID.
+ */
 void
-BPSGIMainApplication::SpawnMonitoringProcess()
+BPSGIMainApplication::SpawnWorker(WorkerNo workerno)
 {
-	pid_t pid = fork();
-	if (pid == -1)
-		throw SyscallException("fork", errno);
-	else if (pid == 0)
-		RunMonitoringProcess();
-	else if (pid > 0)
-		monitoring_process_pid_ = pid;
-	else
-		throw SyscallException("fork", "unexpected return value %ld", (long) pid);
+	Assert(worker_pids_[(int) workerno] == -1);
 
-	close(stats_sockfd_);
+	int32_t request = (int32_t) workerno;
+	ssize_t ret;
+	while ((ret = send(zygote_channel_, &request, sizeof(request), 0)) == -1 && errno == EINTR)
+		;
+	if (ret == -1)
+		throw SyscallException("send", errno);
+
+	int32_t reply[2];
+	while ((ret = recv(zygote_channel_, reply, sizeof(reply), 0)) == -1 && errno == EINTR)
+		;
+	if (ret == -1)
+		throw SyscallException("recv", errno);
+	else if (ret != (ssize_t) sizeof(reply))
+		throw RuntimeException("zygote process went away");
+	else if (reply[0] == -1)
+		throw SyscallException("clone", reply[1]);
+
+	worker_pids_[(int) workerno] = (pid_t) reply[0];
+	worker_retiring_[(int) workerno] = false;
+	worker_started_at_[(int) workerno] = BPSGIMonotonicTimeUsec();
+	worker_generation_[(int) workerno] = generation_;
+	std::atomic_store(&shmem_->WorkerStats(workerno)->generation, (int64_t) generation_);
+}
+
+/*
+ * A worker which crashes is replaced right away the first time, but if its
+ * replacement crashes too before it has lived for WORKER_STABLE_USEC, the
+ * delay before the next one starts at WORKER_RESPAWN_MIN_DELAY_USEC and
+ * doubles every time, up to WORKER_RESPAWN_MAX_DELAY_USEC.  That keeps an
+ * application which can't serve anything from fork bombing the machine.
+ *
+ * With --reuseport, the kernel keeps queueing connections on the listen
+ * socket of an empty slot, and no other worker can accept them, so the delay
+ * never grows past WORKER_RESPAWN_MIN_DELAY_USEC there.
+ */
+#define WORKER_STABLE_USEC				(10 * 1000000)
+#define WORKER_RESPAWN_MIN_DELAY_USEC	100000
+#define WORKER_RESPAWN_MAX_DELAY_USEC	(30 * 1000000)
+
+/*
+ * Decides when to replace the worker in slot workerno, which has just gone
+ * away or couldn't be forked, and returns the delay.
+ */
+int64_t
+BPSGIMainApplication::DelayWorkerRespawn(WorkerNo workerno)
+{
+	int w = (int) workerno;
+	int64_t now = BPSGIMonotonicTimeUsec();
+
+	if (now - worker_started_at_[w] >= WORKER_STABLE_USEC)
+		worker_crashes_[w] = 0;
+	int64_t delay = 0;
+	if (worker_crashes_[w] > 0)
+		delay = std::min((int64_t) WORKER_RESPAWN_MIN_DELAY_USEC << std::min(worker_crashes_[w] - 1, 16),
+						 (int64_t) (options_.reuseport ? WORKER_RESPAWN_MIN_DELAY_USEC : WORKER_RESPAWN_MAX_DELAY_USEC));
+	worker_crashes_[w]++;
+	worker_respawn_at_[w] = now + delay;
+
+	SetWorkerStatus(workerno, WORKER_STATUS_NO_PROCESS);
+	return delay;
 }
 
 void
-BPSGIMainApplication::RunMonitoringProcess()
+BPSGIMainApplication::ScheduleWorkerRespawn(WorkerNo workerno, pid_t pid, int status)
 {
-	BPSGIMonitoring monitoring(this);
+	int w = (int) workerno;
+	int64_t delay = DelayWorkerRespawn(workerno);
 
-	int ret;
-	try {
-		ret = monitoring.Run();
-	} catch (const std::exception &ex) {
-		if (mainapp->SetShouldExitImmediately())
-			mainapp->Log(LS_FATAL, "monitoring process crashed: %s", ex.what());
-		KillProcessGroup(SIGQUIT);
-		_exit(1);
-	}
-	_exit(ret);
+	shmem_->PoolStats()->crashes++;
+
+	if (WIFSIGNALED(status))
+		Log(LS_WARNING, "worker process %d (pid %ld) died to signal %d; replacing it in %d ms",
+			w, (long) pid, WTERMSIG(status), (int) (delay / 1000));
+	else
+		Log(LS_WARNING, "worker process %d (pid %ld) exited with code %d; replacing it in %d ms",
+			w, (long) pid, WEXITSTATUS(status), (int) (delay / 1000));
 }
 
-void
-BPSGIMainApplication::HandleUnexpectedChildProcessDeath(const std::string process, pid_t pid, int status)
+/*
+ * Has the zygote fork a new worker into the slot workerno, like SpawnWorker.
+ * If the fork fails, e.g. because memory is short, the slot is tried again
+ * later with the same backoff as a crashed worker's, and false is returned;
+ * losing one worker for a while beats taking the whole server down.
+ */
+bool
+BPSGIMainApplication::RespawnWorker(WorkerNo workerno)
 {
-	if (shmem()->SetShouldExitImmediately())
-	{
-		if (WIFSIGNALED(status))
-			Log(LS_PANIC, "%s (pid %ld) died to signal %d", process.c_str(), (long) pid, WTERMSIG(status));
-		else
-			Log(LS_PANIC, "%s (pid %ld) exited with code %d", process.c_str(), (long) pid, WEXITSTATUS(status));
+	BlockSignals();
+	try {
+		SpawnWorker(workerno);
+	} catch (const SyscallException &ex) {
+		UnblockSignals();
+		/* anything else means the zygote is in trouble */
+		if (strcmp(ex.syscall(), "clone") != 0)
+			throw;
+
+		/* count it like a crash of a worker which didn't live long */
+		int w = (int) workerno;
+		worker_started_at_[w] = BPSGIMonotonicTimeUsec();
+		worker_crashes_[w] = std::max(worker_crashes_[w], 1);
+		int64_t delay = DelayWorkerRespawn(workerno);
+		Log(LS_WARNING, "could not fork worker process %d: %s; retrying in %d ms",
+			w, ex.strerror(), (int) (delay / 1000));
+		return false;
 	}
-	KillProcessGroup(SIGQUIT);
-	_exit(1);
+	UnblockSignals();
+	return true;
 }
 
-void
-BPSGIMainApplication::HandleChildProcessDeath(pid_t pid, int status)
+/*
+ * Replaces the crashed workers whose time has come.  Returns when the next
+ * one is due, or -1 if there are none left.
+ */
+int64_t
+BPSGIMainApplication::RespawnCrashedWorkers()
 {
-	auto witer = std::find(worker_pids_.begin(), worker_pids_.end(), pid);
-	if (witer != worker_pids_.end())
+	int64_t now = BPSGIMonotonicTimeUsec();
+	int64_t next = -1;
+
+	for (WorkerNo workerno = 0; workerno < nworkers_; workerno++)
 	{
-		if (_mainapp_shutdown == 0)
-			HandleUnexpectedChildProcessDeath("worker process", pid, status);
-		worker_pids_.erase(witer);
+		int64_t at = worker_respawn_at_[(int) workerno];
+		if (at == -1)
+			continue;
+		else if (at > now)
+		{
+			if (next == -1 || at < next)
+				next = at;
+			continue;
+		}
+
+		worker_respawn_at_[(int) workerno] = -1;
+		SetWorkerStatus(workerno, '_');
+		if (!RespawnWorker(workerno))
+		{
+			at = worker_respawn_at_[(int) workerno];
+			if (next == -1 || at < next)
+				next = at;
+		}
+	}
+	return next;
+}
+
+/*
+ * Asks the worker in slot workerno to exit once it's done with its current
+ * request.  The slot is left empty when it does, unless the worker is from a
+ * previous generation, in which case it's replaced by one from the current
+ * one.
+ */
+void
+BPSGIMainApplication::RetireWorker(WorkerNo workerno)
+{
+	Assert(worker_pids_[(int) workerno] != -1);
+	Assert(!worker_retiring_[(int) workerno]);
+
+	if (kill(worker_pids_[(int) workerno], SIGUSR1) == -1)
+		throw SyscallException("kill", errno);
+	worker_retiring_[(int) workerno] = true;
+}
+
+/*
+ * SIGUSR2 loads a new generation of the application without restarting.  A
+ * new zygote is forked from the overseer, and it loads the application into
+ * a fresh interpreter, using the same listen sockets and shared memory as the
+ * generation already running.  Once it's ready it takes over forking workers
+ * and the workers of the previous generation are replaced a few at a time;
+ * see ContinueReload.  If the application can't be loaded, the new zygote
+ * exits and the previous generation keeps running.
+ */
+void
+BPSGIMainApplication::StartReload()
+{
+	if (!BPSGIPerlInterpreter::SupportsMultipleInterpreters())
+	{
+		Log(LS_ERROR, "received SIGUSR2, but reloading requires a Perl built with usemultiplicity");
+		return;
+	}
+	if (loading_zygote_pid_ != -1 || reloading_)
+	{
+		Log(LS_WARNING, "received SIGUSR2, but a reload is already in progress");
+		return;
+	}
+
+	Log(LS_LOG, "loading generation %d of the application", generation_ + 1);
+	BlockSignals();
+	SpawnZygoteProcess(true);
+	UnblockSignals();
+}
+
+/*
+ * Called when the channel of the zygote loading a new generation becomes
+ * readable, which means it's either ready or gone.
+ */
+void
+BPSGIMainApplication::HandleZygoteReady()
+{
+	int32_t ready;
+	ssize_t ret = recv(loading_zygote_channel_, &ready, sizeof(ready), MSG_DONTWAIT);
+	if (ret == -1 && (errno == EINTR || errno == EAGAIN))
+		return;
+	else if (ret != (ssize_t) sizeof(ready))
+	{
+		/* it exited; HandleChildProcessDeath will notice */
+		(void) close(loading_zygote_channel_);
+		loading_zygote_channel_ = -1;
+		return;
+	}
+
+	/* workers already forked by the old zygote don't need it anymore */
+	if (zygote_process_pid_ != -1)
+	{
+		(void) kill(zygote_process_pid_, SIGTERM);
+		old_zygote_pids_.push_back(zygote_process_pid_);
+	}
+	(void) close(zygote_channel_);
+
+	zygote_process_pid_ = loading_zygote_pid_;
+	zygote_channel_ = loading_zygote_channel_;
+	loading_zygote_pid_ = -1;
+	loading_zygote_channel_ = -1;
+	generation_++;
+	std::atomic_store(&shmem_->PoolStats()->generation, (int64_t) generation_);
+
+	Log(LS_LOG, "generation %d of the application loaded; replacing workers", generation_);
+	reloading_ = true;
+	ContinueReload();
+}
+
+/*
+ * Retires workers of previous generations, idle ones first, keeping at most a
+ * quarter of the running workers retiring at any one time so that the pool
+ * never runs out of capacity.  Each of them is replaced by a worker of the
+ * current generation once it has finished its request and exited.
+ */
+#define RELOAD_BATCH_DIVISOR	4
+
+void
+BPSGIMainApplication::ContinueReload()
+{
+	int running = 0;
+	int old_workers = 0;
+	int retiring = 0;
+
+	for (int w = 0; w < nworkers_; w++)
+	{
+		if (worker_pids_[w] == -1)
+			continue;
+		running++;
+		if (worker_generation_[w] == generation_)
+			continue;
+		old_workers++;
+		if (worker_retiring_[w])
+			retiring++;
+	}
+	if (old_workers == 0)
+	{
+		Log(LS_LOG, "all workers are now running generation %d", generation_);
+		reloading_ = false;
+		return;
+	}
+
+	std::vector<char> statuses(nworkers_);
+	shmem_->GetAllWorkerStatuses(nworkers_, statuses.data());
+
+	int batch = std::max(running / RELOAD_BATCH_DIVISOR, 1);
+	for (int pass = 0; pass < 2 && retiring < batch; pass++)
+	{
+		for (int w = 0; w < nworkers_ && retiring < batch; w++)
+		{
+			if (worker_pids_[w] == -1 || worker_retiring_[w] ||
+				worker_generation_[w] == generation_ ||
+				(pass == 0 && statuses[w] != '_'))
+				continue;
+			RetireWorker((WorkerNo) w);
+			retiring++;
+		}
+	}
+}
+
+/*
+ * Reads the pool bounds from --pool-file.  The file has one "NAME VALUE" pair
+ * per line, NAME being one of min_workers, max_workers and spare_workers; the
+ * values not mentioned in the file are left alone.  Lines starting with # are
+ * ignored.  On error, none of the bounds are changed.
+ */
+void
+BPSGIMainApplication::ReadPoolFile()
+{
+	const char *path = options_.pool_file.c_str();
+	int min_workers = pool_min_workers_;
+	int max_workers = pool_max_workers_;
+	int spare_workers = pool_spare_workers_;
+
+	FILE *fh = fopen(path, "r");
+	if (fh == NULL)
+		throw RuntimeException("could not open pool file \"%s\": %s", path, strerror(errno));
+
+	char line[256];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), fh) != NULL)
+	{
+		char name[64];
+		char rest[2];
+		long value;
+
+		lineno++;
+		int n = sscanf(line, " %63[a-z_] %ld %1s", name, &value, rest);
+		if (n == EOF || line[strspn(line, " \t")] == '#')
+			continue;
+		else if (n != 2 || value < 0 || value > 65536)
+		{
+			fclose(fh);
+			throw RuntimeException("invalid line %d in pool file \"%s\"", lineno, path);
+		}
+
+		if (strcmp(name, "min_workers") == 0)
+			min_workers = (int) value;
+		else if (strcmp(name, "max_workers") == 0)
+			max_workers = (int) value;
+		else if (strcmp(name, "spare_workers") == 0)
+			spare_workers = (int) value;
+		else
+		{
+			fclose(fh);
+			throw RuntimeException("unrecognized setting \"%s\" on line %d in pool file \"%s\"", name, lineno, path);
+		}
+	}
+	bool failed = ferror(fh);
+	fclose(fh);
+	if (failed)
+		throw RuntimeException("could not read pool file \"%s\"", path);
+
+	if (min_workers < 1)
+		throw RuntimeException("min_workers in pool file \"%s\" must be at least 1", path);
+	else if (max_workers < min_workers)
+		throw RuntimeException("max_workers in pool file \"%s\" must not be smaller than min_workers", path);
+
+	pool_min_workers_ = min_workers;
+	pool_max_workers_ = max_workers;
+	pool_spare_workers_ = spare_workers;
+}
+
+/*
+ * Grows or shrinks the worker pool of every lane, based on how many of its
+ * workers are idle.  Called about once a second by the overseer.
+ *
+ * Workers are spawned as soon as fewer than spare_workers of them are idle,
+ * and while that lasts, the number spawned per sample doubles, up to
+ * POOL_MAX_SPAWN_BATCH, like Apache's prefork MPM does.  They're only
+ * retired after there have been more than twice as many idle workers for
+ * POOL_RETIRE_SAMPLES samples in a row, so that a pool sized right for a
+ * bursty load doesn't keep changing size.  New workers go into the
+ * lowest-numbered empty slots, and the highest-numbered idle workers are
+ * retired first.  The dispatcher prefers the lowest-numbered idle workers,
+ * so the workers at the top are the ones it needs the least.
+ */
+#define POOL_RETIRE_SAMPLES		10
+#define POOL_MAX_SPAWN_BATCH	32
+
+void
+BPSGIMainApplication::ScaleWorkerPool()
+{
+	std::vector<char> statuses(nworkers_);
+	shmem_->GetAllWorkerStatuses(nworkers_, statuses.data());
+
+	auto pool_stats = shmem_->PoolStats();
+	int64_t total_workers = 0;
+
+	for (size_t i = 0; i < lanes_.size(); i++)
+	{
+		const auto &lane = lanes_[i];
+		int max_workers = std::min(pool_max_workers_, lane.nworkers);
+		int min_workers = std::min(pool_min_workers_, max_workers);
+		int running = 0;
+		int idle = 0;
+		/* empty slots; a retiring worker keeps its slot until it exits */
+		int free_slots = 0;
+
+		for (int w = lane.first_worker; w < lane.first_worker + lane.nworkers; w++)
+		{
+			/* a crashed worker waiting to be replaced still counts */
+			if (worker_respawn_at_[w] != -1)
+			{
+				running++;
+				continue;
+			}
+			if (worker_pids_[w] == -1)
+				free_slots++;
+			if (worker_pids_[w] == -1 || worker_retiring_[w])
+				continue;
+			running++;
+			if (statuses[w] == '_')
+				idle++;
+		}
+
+		int wanted = running;
+		if (running < min_workers)
+			wanted = min_workers;
+		if (idle < pool_spare_workers_)
+		{
+			int nspawn = std::max(pool_spare_workers_ - idle, lane_spawn_batch_[i]);
+			wanted = std::max(wanted, std::min(running + nspawn, max_workers));
+		}
+		if (running > max_workers)
+			wanted = max_workers;
+		else if (wanted > running + free_slots)
+			wanted = running + free_slots;
+
+		if (wanted == running && running > min_workers && idle > 2 * pool_spare_workers_)
+		{
+			if (++lane_surplus_samples_[i] >= POOL_RETIRE_SAMPLES)
+				wanted = running - 1;
+		}
+		else
+			lane_surplus_samples_[i] = 0;
+
+		if (wanted > running)
+			lane_spawn_batch_[i] = std::min(lane_spawn_batch_[i] * 2, POOL_MAX_SPAWN_BATCH);
+		else
+			lane_spawn_batch_[i] = 1;
+
+		if (wanted > running)
+		{
+			for (int w = lane.first_worker; w < lane.first_worker + lane.nworkers && running < wanted; w++)
+			{
+				if (worker_pids_[w] != -1 || worker_respawn_at_[w] != -1)
+					continue;
+				SetWorkerStatus((WorkerNo) w, '_');
+				/* a slot which couldn't be forked into still counts as running */
+				running++;
+				if (RespawnWorker((WorkerNo) w))
+					pool_stats->spawns++;
+			}
+		}
+		else if (wanted < running)
+		{
+			/* idle workers go first, then busy ones if we're above max_workers */
+			for (int pass = 0; pass < 2 && running > wanted; pass++)
+			{
+				for (int w = lane.first_worker + lane.nworkers - 1; w >= lane.first_worker && running > wanted; w--)
+				{
+					if (worker_pids_[w] == -1 || worker_retiring_[w] ||
+						(pass == 0 && statuses[w] != '_'))
+						continue;
+					RetireWorker((WorkerNo) w);
+					running--;
+					pool_stats->retirements++;
+				}
+			}
+		}
+		total_workers += running;
+	}
+
+	pool_stats->workers = total_workers;
+	pool_stats->min_workers = pool_min_workers_;
+	pool_stats->max_workers = pool_max_workers_;
+	pool_stats->spare_workers = pool_spare_workers_;
+}
+
+// fastcgi_wrapper_loader.cpp
+extern const char *fastcgi_wrapper_loader;
+
+/*
+ * Loads the PSGI application into a new Perl interpreter.  Exits the process
+ * on failure.
+ */
+void
+BPSGIMainApplication::LoadApplication()
+{
+	unique_ptr<BPSGIPerlCallbackFunction> wrapper_loader_callback;
+	unique_ptr<BPSGIPerlCallbackFunction> auxiliary_loader_callback;
+
+	try {
+		interpreter_ = InitializePerlInterpreter();
+	} catch (const PerlInterpreterException &ex) {
+		Log(LS_ERROR, "Could not initialize Perl interpreter: %s", ex.strerror());
+		_exit(1);
+	}
+	try {
+		wrapper_loader_callback = interpreter_->LoadCallbackFromCString(fastcgi_wrapper_loader);
+	} catch (const PerlInterpreterException &ex) {
+		/* TODO: ??? */
+		Log(LS_ERROR, "Could not initialize PSGI application: %s", ex.strerror());
+		_exit(1);
+	}
+
+	try {
+		main_callback_ = wrapper_loader_callback->CallAndReceiveCallback();
+	} catch (const PerlInterpreterException &ex) {
+		Log(LS_ERROR, "Could not initialize PSGI loader or callback: %s", ex.strerror());
+		_exit(1);
+	}
+}
+
+void
+BPSGIMainApplication::SpawnWorkersAndAuxiliaryProcesses()
+{
+	LoadApplication();
+
+	shmem_->LockAllocations();
+
+	for (auto && process : auxiliary_processes_)
+		SpawnAuxiliaryProcess(*process);
+
+	SpawnZygoteProcess(false);
+
+	worker_pids_.assign(nworkers_, -1);
+	worker_retiring_.assign(nworkers_, false);
+	worker_started_at_.assign(nworkers_, 0);
+	worker_crashes_.assign(nworkers_, 0);
+	worker_respawn_at_.assign(nworkers_, -1);
+	worker_generation_.assign(nworkers_, generation_);
+	std::atomic_store(&shmem_->PoolStats()->generation, (int64_t) generation_);
+
+	if (autoscaling_)
+	{
+		/*
+		 * Start with min_workers on every lane; the first ScaleWorkerPool call
+		 * adds the spare workers.
+		 */
+		for (auto && lane : lanes_)
+		{
+			int nstart = std::min(std::min(pool_min_workers_, pool_max_workers_), lane.nworkers);
+			for (int w = lane.first_worker; w < lane.first_worker + lane.nworkers; w++)
+			{
+				if (w < lane.first_worker + nstart)
+					SpawnWorker((WorkerNo) w);
+				else
+					SetWorkerStatus((WorkerNo) w, WORKER_STATUS_NO_PROCESS);
+			}
+		}
+		lane_surplus_samples_.assign(lanes_.size(), 0);
+		lane_spawn_batch_.assign(lanes_.size(), 1);
+		return;
+	}
+
+	for (WorkerNo workerno = 0; workerno < nworkers_; ++workerno)
+		SpawnWorker(workerno);
+
+	/*
+	 * The overseer's copy of the interpreter is only kept around so that END
+	 * blocks run once at shutdown; workers are forked from the zygote's.
+	 */
+}
+
+void
+BPSGIMainApplication::DestroyPerlInterpreter()
+{
+	if (interpreter_.get() == nullptr)
+		return;
+
+	main_callback_.release();
+	try {
+		interpreter_->Destroy();
+	} catch (const PerlInterpreterException &ex) {
+		Log(LS_WARNING, "could not destroy Perl interpreter: %s", ex.strerror());
+	}
+}
+
+void
+BPSGIMainApplication::RequestAuxiliaryProcess(std::string name, unique_ptr<BPSGIPerlCallbackFunction> callback)
+{
+	/* the auxiliary processes of the first generation keep running */
+	if (generation_ > 1)
+	{
+		Log(LS_WARNING, "auxiliary process \"%s\" requested by generation %d not started; auxiliary processes aren't restarted on reload",
+			name.c_str(), generation_);
+		return;
+	}
+
+	auxiliary_processes_.push_back(make_unique<BPSGIAuxiliaryProcess>(this, name, std::move(callback)));
+}
+
+void
+BPSGIMainApplication::SpawnMonitoringProcess()
+{
+	pid_t pid = fork();
+	if (pid == -1)
+		throw SyscallException("fork", errno);
+	else if (pid == 0)
+		RunMonitoringProcess();
+	else if (pid > 0)
+		monitoring_process_pid_ = pid;
+	else
+		throw SyscallException("fork", "unexpected return value %ld", (long) pid);
+
+	close(stats_sockfd_);
+}
+
+void
+BPSGIMainApplication::RunMonitoringProcess()
+{
+	BPSGIMonitoring monitoring(this);
+
+	int ret;
+	try {
+		ret = monitoring.Run();
+	} catch (const std::exception &ex) {
+		if (mainapp->SetShouldExitImmediately())
+			mainapp->Log(LS_FATAL, "monitoring process crashed: %s", ex.what());
+		KillProcessGroup(SIGQUIT);
+		_exit(1);
+	}
+	_exit(ret);
+}
+
+void
+BPSGIMainApplication::SpawnDispatcherProcess()
+{
+	if (!options_.dispatcher)
+		return;
+
+	pid_t pid = fork();
+	if (pid == -1)
+		throw SyscallException("fork", errno);
+	else if (pid == 0)
+		RunDispatcherProcess();
+	else if (pid > 0)
+		dispatcher_process_pid_ = pid;
+	else
+		throw SyscallException("fork", "unexpected return value %ld", (long) pid);
+}
+
+static void
+dispatcher_sigquit_handler(int _unused)
+{
+	/* behave like worker_sigquit_handler */
+	(void) _unused;
+	_exit(2);
+}
+
+void
+BPSGIMainApplication::RunDispatcherProcess()
+{
+	SubprocessInit("dispatcher", SUBP_NO_DEATHSIG);
+	SetSignalHandler(SIGINT, SIG_IGN);
+	SetSignalHandler(SIGTERM, SIG_DFL);
+	SetSignalHandler(SIGQUIT, dispatcher_sigquit_handler);
+	SetSignalHandler(SIGPIPE, SIG_IGN);
+	UnblockSignals();
+
+	int ret;
+	try {
+		BPSGIDispatcher dispatcher(this);
+		ret = dispatcher.Run();
+	} catch (const SyscallException &ex) {
+		if (SetShouldExitImmediately())
+			Log(LS_FATAL, "dispatcher process crashed: system call %s failed: %s", ex.syscall(), ex.strerror());
+		KillProcessGroup(SIGQUIT);
+		_exit(1);
+	} catch (const RuntimeException &ex) {
+		if (SetShouldExitImmediately())
+			Log(LS_FATAL, "dispatcher process crashed: %s", ex.error());
+		KillProcessGroup(SIGQUIT);
+		_exit(1);
+	}
+	_exit(ret);
+}
+
+void
+BPSGIMainApplication::SpawnSenderProcesses()
+{
+	sender_pids_.assign(options_.offload_senders, -1);
+	for (int senderno = 0; senderno < options_.offload_senders; senderno++)
+	{
+		pid_t pid = fork();
+		if (pid == -1)
+			throw SyscallException("fork", errno);
+		else if (pid == 0)
+			RunSenderProcess(senderno);
+		else if (pid > 0)
+			sender_pids_[senderno] = pid;
+		else
+			throw SyscallException("fork", "unexpected return value %ld", (long) pid);
+	}
+}
+
+void
+BPSGIMainApplication::RunSenderProcess(int senderno)
+{
+	int ret;
+	try {
+		BPSGIResponseSender sender(this, senderno);
+		ret = sender.Run();
+	} catch (const SyscallException &ex) {
+		if (SetShouldExitImmediately())
+			Log(LS_FATAL, "sender process crashed: system call %s failed: %s", ex.syscall(), ex.strerror());
+		KillProcessGroup(SIGQUIT);
+		_exit(1);
+	} catch (const RuntimeException &ex) {
+		if (SetShouldExitImmediately())
+			Log(LS_FATAL, "sender process crashed: %s", ex.error());
+		KillProcessGroup(SIGQUIT);
+		_exit(1);
+	}
+	_exit(ret);
+}
+
+/*
+ * Asks the senders to exit once they're done with the responses they have.
+ * Called during smart shutdown once the last worker has exited.
+ */
+void
+BPSGIMainApplication::TerminateSenderProcesses()
+{
+	for (auto pid : sender_pids_)
+	{
+		if (pid != -1)
+			(void) kill(pid, SIGTERM);
+	}
+}
+
+void
+BPSGIMainApplication::HandleUnexpectedChildProcessDeath(const std::string process, pid_t pid, int status)
+{
+	if (shmem()->SetShouldExitImmediately())
+	{
+		if (WIFSIGNALED(status))
+			Log(LS_PANIC, "%s (pid %ld) died to signal %d", process.c_str(), (long) pid, WTERMSIG(status));
+		else
+			Log(LS_PANIC, "%s (pid %ld) exited with code %d", process.c_str(), (long) pid, WEXITSTATUS(status));
+	}
+	KillProcessGroup(SIGQUIT);
+	_exit(1);
+}
+
+void
+BPSGIMainApplication::HandleChildProcessDeath(pid_t pid, int status)
+{
+	auto witer = std::find(worker_pids_.begin(), worker_pids_.end(), pid);
+	if (witer != worker_pids_.end())
+	{
+		WorkerNo workerno = (WorkerNo) (witer - worker_pids_.begin());
+
+		*witer = -1;
+		if (_mainapp_shutdown == 0)
+		{
+			if (worker_retiring_[(int) workerno] && WIFEXITED(status) &&
+				(WEXITSTATUS(status) == 0 ||
+				 WEXITSTATUS(status) == BPSGIWorker::harakiri_exit_code ||
+				 WEXITSTATUS(status) == BPSGIWorker::memory_limit_exit_code))
+			{
+				worker_retiring_[(int) workerno] = false;
+				if (worker_generation_[(int) workerno] == generation_)
+				{
+					/* retired by ScaleWorkerPool; leave the slot empty */
+					SetWorkerStatus(workerno, WORKER_STATUS_NO_PROCESS);
+					return;
+				}
+
+				/* retired by ContinueReload; replace it and retire the next one */
+				(void) RespawnWorker(workerno);
+				ContinueReload();
+				return;
+			}
+			else if (shmem()->ShouldExitImmediately())
+			{
+				/* the worker exited because something else went wrong */
+				HandleUnexpectedChildProcessDeath("worker process", pid, status);
+			}
+			else if (WIFEXITED(status) && WEXITSTATUS(status) == BPSGIWorker::memory_limit_exit_code)
+			{
+				/*
+				 * The limit is lower than what a fresh worker takes, so replacing
+				 * it right away would only fork a new worker for every request.
+				 */
+				int w = (int) workerno;
+				worker_crashes_[w] = std::max(worker_crashes_[w], 1);
+				int64_t delay = DelayWorkerRespawn(workerno);
+				Log(LS_WARNING, "worker process %d was over its memory limit from the start; replacing it in %d ms",
+					w, (int) (delay / 1000));
+				return;
+			}
+			else if (!WIFEXITED(status) || WEXITSTATUS(status) != BPSGIWorker::harakiri_exit_code)
+			{
+				ScheduleWorkerRespawn(workerno, pid, status);
+				return;
+			}
+
+			(void) RespawnWorker(workerno);
+		}
+		else if (std::count(worker_pids_.begin(), worker_pids_.end(), -1) == (ptrdiff_t) worker_pids_.size())
+			TerminateSenderProcesses();
+		return;
+	}
+
+	auto senditer = std::find(sender_pids_.begin(), sender_pids_.end(), pid);
+	if (senditer != sender_pids_.end())
+	{
+		if (_mainapp_shutdown == 0)
+			HandleUnexpectedChildProcessDeath("sender process", pid, status);
+		*senditer = -1;
 		return;
 	}
 
@@ -631,6 +1786,50 @@ BPSGIMainApplication::HandleChildProcessDeath(pid_t pid, int status)
 		return;
 	}
 
+	if (pid == zygote_process_pid_)
+	{
+		if (_mainapp_shutdown == 0)
+			HandleUnexpectedChildProcessDeath("zygote process", pid, status);
+		zygote_process_pid_ = -1;
+		return;
+	}
+
+	if (pid == loading_zygote_pid_)
+	{
+		if (_mainapp_shutdown == 0)
+		{
+			if (WIFSIGNALED(status))
+				Log(LS_WARNING, "could not load generation %d of the application: zygote died to signal %d; keeping generation %d",
+					generation_ + 1, WTERMSIG(status), generation_);
+			else
+				Log(LS_WARNING, "could not load generation %d of the application: zygote exited with code %d; keeping generation %d",
+					generation_ + 1, WEXITSTATUS(status), generation_);
+		}
+		if (loading_zygote_channel_ != -1)
+		{
+			(void) close(loading_zygote_channel_);
+			loading_zygote_channel_ = -1;
+		}
+		loading_zygote_pid_ = -1;
+		return;
+	}
+
+	auto oziter = std::find(old_zygote_pids_.begin(), old_zygote_pids_.end(), pid);
+	if (oziter != old_zygote_pids_.end())
+	{
+		/* asked to exit by HandleZygoteReady */
+		old_zygote_pids_.erase(oziter);
+		return;
+	}
+
+	if (pid == dispatcher_process_pid_)
+	{
+		if (_mainapp_shutdown == 0)
+			HandleUnexpectedChildProcessDeath("dispatcher process", pid, status);
+		dispatcher_process_pid_ = -1;
+		return;
+	}
+
 	(void) shmem()->SetShouldExitImmediately();
 	Log(LS_FATAL, "unknown child process %ld exited with code %d", (long) pid, WEXITSTATUS(status));
 	_exit(1);
@@ -645,23 +1844,34 @@ BPSGIMainApplication::Run()
 
 	InitializeSelfPipe();
 	InitializeSharedMemory();
-	InitializeMainFastCGISocket();
+	InitializeFastCGISockets();
 	InitializeStatsSocket();
+	InitializeDispatcherChannels();
+	InitializeSenderChannels();
+
+	if (!options_.pool_file.empty())
+		ReadPoolFile();
 
 	Log(LS_LOG, "starting up worker processes");
 
 	SpawnWorkersAndAuxiliaryProcesses();
 	SpawnMonitoringProcess();
+	SpawnDispatcherProcess();
+	SpawnSenderProcesses();
 	SetSignalHandler(SIGCHLD, overseer_signal_handler);
 	SetSignalHandler(SIGINT, overseer_signal_handler);
 	SetSignalHandler(SIGTERM, overseer_signal_handler);
 	SetSignalHandler(SIGQUIT, overseer_signal_handler);
+	SetSignalHandler(SIGUSR2, overseer_signal_handler);
+	if (autoscaling_)
+		SetSignalHandler(SIGHUP, overseer_signal_handler);
 	UnblockSignals();
 
 	SetProcessTitle("overseer");
 
 	Log(LS_LOG, "BladePSGI startup complete");
 
+	int64_t next_respawn_at = -1;
 	for (;;)
 	{
 		struct timeval tv;
@@ -669,13 +1879,27 @@ BPSGIMainApplication::Run()
 		int nfds;
 
 		memset(&tv, 0, sizeof(tv));
-		tv.tv_sec = 3;
+		tv.tv_sec = autoscaling_ ? 1 : 3;
 		tv.tv_usec = 0;
+		if (next_respawn_at != -1)
+		{
+			int64_t wait = std::max(next_respawn_at - BPSGIMonotonicTimeUsec(), (int64_t) 0);
+			if (wait < tv.tv_sec * 1000000)
+			{
+				tv.tv_sec = (time_t) (wait / 1000000);
+				tv.tv_usec = (suseconds_t) (wait % 1000000);
+			}
+		}
 
 		FD_ZERO(&fds);
 		FD_SET(_overseer_self_pipe[0], &fds);
 
 		nfds = _overseer_self_pipe[0] + 1;
+		if (loading_zygote_channel_ != -1)
+		{
+			FD_SET(loading_zygote_channel_, &fds);
+			nfds = std::max(nfds, loading_zygote_channel_ + 1);
+		}
 
 		errno = 0;
 		int ret = select(nfds, &fds, NULL, NULL, &tv);
@@ -688,13 +1912,17 @@ BPSGIMainApplication::Run()
 			if (errno != EINTR)
 				throw SyscallException("select", errno);
 		}
-		else if (ret == 1)
+		else if (ret > 0)
 		{
 			/*
-			 * We got woken up because the self-pipe had data in it.  Drain it
-			 * and continue downwards to see whether any child processes died.
+			 * We got woken up because the self-pipe had data in it, or because
+			 * a new generation finished loading.  Drain the pipe and continue
+			 * downwards to see whether any child processes died.
 			 */
-			DrainSelfPipe();
+			if (FD_ISSET(_overseer_self_pipe[0], &fds))
+				DrainSelfPipe();
+			if (loading_zygote_channel_ != -1 && FD_ISSET(loading_zygote_channel_, &fds))
+				HandleZygoteReady();
 		}
 		else
 			throw SyscallException("select", "unexpected return value %d", ret);
@@ -723,6 +1951,45 @@ BPSGIMainApplication::Run()
 			}
 		}
 
+		if (_mainapp_reload_pool == 1)
+		{
+			_mainapp_reload_pool = 0;
+			if (options_.pool_file.empty())
+				Log(LS_WARNING, "received SIGHUP, but --pool-file was not given");
+			else
+			{
+				try {
+					ReadPoolFile();
+					Log(LS_LOG, "pool bounds changed to min_workers %d, max_workers %d, spare_workers %d",
+						pool_min_workers_, pool_max_workers_, pool_spare_workers_);
+					/* apply the new bounds right away */
+					pool_last_scaled_at_ = 0;
+				} catch (const RuntimeException &ex) {
+					Log(LS_WARNING, "%s; keeping the old pool bounds", ex.error());
+				}
+			}
+		}
+
+		if (_mainapp_reload_app == 1)
+		{
+			_mainapp_reload_app = 0;
+			if (_mainapp_shutdown == 0)
+				StartReload();
+		}
+
+		if (reloading_ && _mainapp_shutdown == 0)
+			ContinueReload();
+
+		if (autoscaling_ && _mainapp_shutdown == 0)
+		{
+			int64_t now = BPSGIMonotonicTimeUsec();
+			if (now - pool_last_scaled_at_ >= 1000000)
+			{
+				pool_last_scaled_at_ = now;
+				ScaleWorkerPool();
+			}
+		}
+
 		int status;
 waitagain:
 		pid_t child = waitpid((pid_t) -1, &status, WNOHANG);
@@ -734,6 +2001,7 @@ waitagain:
 				 * All child processes have died.  We're finally free.
 				 */
 				Log(LS_LOG, "BladePSGI shutting down");
+				DestroyPerlInterpreter();
 				exit(0);
 			}
 			else if (errno != EINTR)
@@ -743,6 +2011,10 @@ waitagain:
 		}
 		else if (child == 0)
 		{
+			/* including the workers we've just found dead */
+			next_respawn_at = -1;
+			if (_mainapp_shutdown == 0)
+				next_respawn_at = RespawnCrashedWorkers();
 			continue;
 		}
 		else
@@ -778,16 +2050,177 @@ print_usage(FILE *fh, const char *argv0)
 	fprintf(fh, "Arguments:\n");
 	fprintf(fh, "  APPLICATION_PATH             filesystem path to the PSGI application\n");
 	fprintf(fh, "  NUM_WORKERS                  the number of workers processes to spawn\n");
-	fprintf(fh, "  FASTCGI_SOCKET_PATH          the file system path at which to create the FastCGI socket\n");
+	fprintf(fh, "  FASTCGI_SOCKET_PATH          the file system path at which to create the FastCGI socket, or\n");
+	fprintf(fh, "                               HOST:PORT, [IPV6ADDRESS]:PORT or *:PORT to listen on TCP;\n");
+	fprintf(fh, "                               prefixed with http: or uwsgi: to speak HTTP/1.1 or the uwsgi\n");
+	fprintf(fh, "                               protocol instead of FastCGI\n");
 	fprintf(fh, "  STATS_SOCKET_PATH            the file system path at which to create the statistics socket\n");
 	fprintf(fh, "\n");
 	fprintf(fh, "Options\n");
+	fprintf(fh, "  --dispatcher                 accepts connections in a dispatcher process, which hands\n");
+	fprintf(fh, "                               complete requests to idle workers\n");
+	fprintf(fh, "  --input-spool-threshold=BYTES\n");
+	fprintf(fh, "                               spools request bodies larger than BYTES into an anonymous\n");
+	fprintf(fh, "                               memory file instead of the worker's heap (default 1048576)\n");
+	fprintf(fh, "  --keepalive-timeout=SECS     closes idle FastCGI keep-alive connections after SECS seconds\n");
+	fprintf(fh, "                               (default 60, 0 disables keep-alive); an idle connection is\n");
+	fprintf(fh, "                               closed early if a new one is waiting for the worker, which\n");
+	fprintf(fh, "                               costs the frontend a reconnect\n");
+	fprintf(fh, "  --lane=NAME:NUM_WORKERS:FASTCGI_SOCKET_PATH\n");
+	fprintf(fh, "                               serves FASTCGI_SOCKET_PATH with NUM_WORKERS workers of its own;\n");
+	fprintf(fh, "                               can be given more than once\n");
 	fprintf(fh, "  --loader=LOADER              uses the Perl module LOADER as a loader\n");
+	fprintf(fh, "  --max-requests=N             replaces every worker after it has served N requests plus\n");
+	fprintf(fh, "                               a random part of --max-requests-jitter (default 0, never)\n");
+	fprintf(fh, "  --max-requests-jitter=N      adds up to N to every worker's --max-requests (default N/10)\n");
+	fprintf(fh, "  --max-private-dirty=MB       replaces a worker once its private dirty memory goes over MB\n");
+	fprintf(fh, "                               megabytes, checked every --smaps-interval requests\n");
+	fprintf(fh, "  --max-rss=MB                 replaces a worker once its RSS goes over MB megabytes, checked\n");
+	fprintf(fh, "                               after every request; counts pages shared with the zygote\n");
+	fprintf(fh, "  --max-workers=N              with autoscaling, runs at most N workers per lane, up to its\n");
+	fprintf(fh, "                               NUM_WORKERS (default NUM_WORKERS)\n");
+	fprintf(fh, "  --min-workers=N              scales the workers of every lane between N and NUM_WORKERS\n");
+	fprintf(fh, "                               based on how many of them are idle\n");
+	fprintf(fh, "  --offload-memory-limit=MB    stops offloading responses while the senders hold MB megabytes\n");
+	fprintf(fh, "                               of them (default 1024)\n");
+	fprintf(fh, "  --offload-senders=N          starts N processes which finish sending responses the frontend\n");
+	fprintf(fh, "                               isn't reading fast enough, freeing the worker (default 0)\n");
+	fprintf(fh, "  --offload-spool-limit=MB     writes a response out in the worker once MB megabytes of it\n");
+	fprintf(fh, "                               have been collected for offloading (default 256)\n");
+	fprintf(fh, "  --pool-file=PATH             reads min_workers, max_workers and spare_workers from PATH at\n");
+	fprintf(fh, "                               startup and on SIGHUP; enables autoscaling\n");
+	fprintf(fh, "  --output-buffer-size=BYTES   collects up to BYTES of response output before writing it\n");
+	fprintf(fh, "                               out (default 65536, 0 disables buffering)\n");
 	fprintf(fh, "  --proctitle-prefix=PREFIX    sets the prefix used for process titles\n");
+	fprintf(fh, "  --queue-deadline=MS          answers requests which reach a worker more than MS milliseconds\n");
+	fprintf(fh, "                               after the time in --queue-time-header with 503\n");
+	fprintf(fh, "  --queue-time-header=HEADER   reads the time the frontend received the request from HEADER,\n");
+	fprintf(fh, "                               e.g. X-Request-Start, and records how long requests queued\n");
+	fprintf(fh, "  --reuseport                  gives every worker its own SO_REUSEPORT listen socket (TCP only)\n");
+	fprintf(fh, "  --shed-busy-ratio=PERCENT    with --dispatcher, answers new requests with 503 while at least\n");
+	fprintf(fh, "                               PERCENT%% of the workers are busy\n");
+	fprintf(fh, "  --shed-queue-age=MS          with --dispatcher, answers requests which have waited for a worker\n");
+	fprintf(fh, "                               for more than MS milliseconds with 503\n");
+	fprintf(fh, "  --shed-queue-depth=N         with --dispatcher, answers new requests with 503 while N requests\n");
+	fprintf(fh, "                               are already waiting for a worker\n");
+	fprintf(fh, "  --shed-retry-after=SECS      sets the Retry-After header of those responses (default 1)\n");
+	fprintf(fh, "  --smaps-interval=N           checks --max-private-dirty every N requests (default 100)\n");
+	fprintf(fh, "  --spare-workers=N            with autoscaling, keeps N workers of every lane idle (default 1)\n");
+	fprintf(fh, "  --static=PREFIX:DIRECTORY    serves requests for files under the URL path PREFIX from\n");
+	fprintf(fh, "                               DIRECTORY without calling the application; can be given more\n");
+	fprintf(fh, "                               than once\n");
+	fprintf(fh, "  --stream-flush-interval=MS   lets streamed response output wait in the output buffer for up\n");
+	fprintf(fh, "                               to MS milliseconds, only checked on the next write (default 0,\n");
+	fprintf(fh, "                               flush on every write)\n");
 	fprintf(fh, "  --help                       displays this help and exits\n");
 	fprintf(fh, "\n");
 }
 
+static int
+parse_int_option(const char *name, const char *value, long min, long max)
+{
+	char *endptr;
+	long result = strtol(value, &endptr, 10);
+	if (*value == '\0' || *endptr != '\0')
+	{
+		fprintf(stderr, "%s value \"%s\" is not a valid integer\n", name, value);
+		exit(1);
+	}
+	else if (result < min || result > max)
+	{
+		fprintf(stderr, "%s must be between %ld and %ld\n", name, min, max);
+		exit(1);
+	}
+	return (int) result;
+}
+
+/*
+ * Turns an HTTP header name such as X-Request-Start into the name of the
+ * request parameter it arrives in, HTTP_X_REQUEST_START.  Names which already
+ * look like a parameter name are taken as they are.
+ */
+static std::string
+header_name_to_param(const char *value)
+{
+	std::string param;
+
+	if (*value == '\0' || strspn(value, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != strlen(value))
+	{
+		fprintf(stderr, "--queue-time-header value \"%s\" is not a valid header name\n", value);
+		exit(1);
+	}
+	if (strncmp(value, "HTTP_", 5) != 0)
+		param = "HTTP_";
+	for (const char *p = value; *p != '\0'; p++)
+		param.push_back(*p == '-' ? '_' : (char) toupper((unsigned char) *p));
+	return param;
+}
+
+/*
+ * Parses the value of --static, PREFIX:DIRECTORY.  The directory is resolved
+ * here, so that it doesn't matter if the application changes the working
+ * directory.
+ */
+static BPSGIStaticMapping
+parse_static_option(const char *value)
+{
+	const char *colon = strchr(value, ':');
+	if (colon == NULL || value[0] != '/' || colon[1] == '\0')
+	{
+		fprintf(stderr, "--static value \"%s\" is not of the form PREFIX:DIRECTORY, with PREFIX starting with a slash\n", value);
+		exit(1);
+	}
+
+	BPSGIStaticMapping mapping;
+	mapping.prefix.assign(value, (size_t) (colon - value));
+	while (!mapping.prefix.empty() && mapping.prefix.back() == '/')
+		mapping.prefix.pop_back();
+
+	char *directory = realpath(colon + 1, NULL);
+	struct stat st;
+	if (directory == NULL || stat(directory, &st) == -1 || !S_ISDIR(st.st_mode))
+	{
+		fprintf(stderr, "--static directory \"%s\" is not a directory\n", colon + 1);
+		exit(1);
+	}
+	mapping.directory = directory;
+	free(directory);
+	return mapping;
+}
+
+/*
+ * Parses the value of --lane, NAME:NUM_WORKERS:FASTCGI_SOCKET_PATH.  The
+ * socket path is everything after the second colon, so TCP addresses work as
+ * they do for the positional argument.
+ */
+static BPSGILane
+parse_lane_option(const char *value)
+{
+	const char *colon1 = strchr(value, ':');
+	const char *colon2 = colon1 == NULL ? NULL : strchr(colon1 + 1, ':');
+	if (colon2 == NULL || colon2[1] == '\0')
+	{
+		fprintf(stderr, "--lane value \"%s\" is not of the form NAME:NUM_WORKERS:FASTCGI_SOCKET_PATH\n", value);
+		exit(1);
+	}
+
+	BPSGILane lane;
+	lane.name.assign(value, (size_t) (colon1 - value));
+	if (lane.name.empty() ||
+		lane.name.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != std::string::npos)
+	{
+		fprintf(stderr, "lane name \"%s\" must consist of letters, digits, underscores and dashes\n", lane.name.c_str());
+		exit(1);
+	}
+	std::string nworkers(colon1 + 1, (size_t) (colon2 - colon1 - 1));
+	lane.nworkers = parse_int_option("--lane NUM_WORKERS", nworkers.c_str(), 1, 65536);
+	lane.socket_path.assign(colon2 + 1);
+	lane.first_worker = -1;
+	lane.is_tcp = false;
+	lane.protocol = PROTOCOL_FASTCGI;
+	return lane;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -796,6 +2229,32 @@ main(int argc, char *argv[])
 		{"version", no_argument, NULL, 'v'},
 		{"loader", required_argument, NULL, 'l'},
 		{"proctitle-prefix", required_argument, NULL, 'p'},
+		{"keepalive-timeout", required_argument, NULL, 'k'},
+		{"output-buffer-size", required_argument, NULL, 'o'},
+		{"input-spool-threshold", required_argument, NULL, 'i'},
+		{"stream-flush-interval", required_argument, NULL, 'f'},
+		{"reuseport", no_argument, NULL, 'r'},
+		{"dispatcher", no_argument, NULL, 'd'},
+		{"offload-senders", required_argument, NULL, 's'},
+		{"offload-spool-limit", required_argument, NULL, 'O'},
+		{"offload-memory-limit", required_argument, NULL, 'T'},
+		{"shed-queue-depth", required_argument, NULL, 'q'},
+		{"shed-queue-age", required_argument, NULL, 'a'},
+		{"shed-busy-ratio", required_argument, NULL, 'b'},
+		{"shed-retry-after", required_argument, NULL, 'y'},
+		{"lane", required_argument, NULL, 'L'},
+		{"queue-time-header", required_argument, NULL, 't'},
+		{"queue-deadline", required_argument, NULL, 'D'},
+		{"static", required_argument, NULL, 'S'},
+		{"min-workers", required_argument, NULL, 'm'},
+		{"max-workers", required_argument, NULL, 'M'},
+		{"spare-workers", required_argument, NULL, 'w'},
+		{"pool-file", required_argument, NULL, 'P'},
+		{"max-requests", required_argument, NULL, 'R'},
+		{"max-requests-jitter", required_argument, NULL, 'J'},
+		{"max-rss", required_argument, NULL, 'X'},
+		{"max-private-dirty", required_argument, NULL, 'Y'},
+		{"smaps-interval", required_argument, NULL, 'Z'},
 		{NULL, 0, NULL, 0}
 	};
 
@@ -818,9 +2277,10 @@ main(int argc, char *argv[])
 
 	const char *opt_application_loader = NULL;
 	const char *opt_process_title_prefix = "Blade";
+	BPSGIOptions options;
 
 	int c, option_index;
-	while ((c = getopt_long(argc, argv, "l:p:hv",
+	while ((c = getopt_long(argc, argv, "l:p:k:o:i:f:rds:O:T:q:a:b:y:L:t:D:S:m:M:w:P:R:J:X:Y:Z:hv",
 							long_options, &option_index)) != -1)
 	{
 		switch (c)
@@ -834,6 +2294,84 @@ main(int argc, char *argv[])
 			case 'p':
 				opt_process_title_prefix = strdup(optarg);
 				break;
+			case 'k':
+				options.keepalive_timeout = parse_int_option("--keepalive-timeout", optarg, 0, 86400);
+				break;
+			case 'o':
+				options.output_buffer_size = parse_int_option("--output-buffer-size", optarg, 0, 16 * 1024 * 1024);
+				break;
+			case 'i':
+				options.input_spool_threshold = parse_int_option("--input-spool-threshold", optarg, 0, 1024 * 1024 * 1024);
+				break;
+			case 'f':
+				options.stream_flush_interval = parse_int_option("--stream-flush-interval", optarg, 0, 60000);
+				break;
+			case 'r':
+				options.reuseport = true;
+				break;
+			case 'd':
+				options.dispatcher = true;
+				break;
+			case 's':
+				options.offload_senders = parse_int_option("--offload-senders", optarg, 0, BPSGIResponseSender::max_senders);
+				break;
+			case 'O':
+				options.offload_spool_limit = parse_int_option("--offload-spool-limit", optarg, 1, 1024 * 1024);
+				break;
+			case 'T':
+				options.offload_memory_limit = parse_int_option("--offload-memory-limit", optarg, 1, 1024 * 1024);
+				break;
+			case 'q':
+				options.shed_queue_depth = parse_int_option("--shed-queue-depth", optarg, 0, 1000000);
+				break;
+			case 'a':
+				options.shed_queue_age = parse_int_option("--shed-queue-age", optarg, 0, 3600 * 1000);
+				break;
+			case 'b':
+				options.shed_busy_ratio = parse_int_option("--shed-busy-ratio", optarg, 0, 100);
+				break;
+			case 'y':
+				options.shed_retry_after = parse_int_option("--shed-retry-after", optarg, 0, 86400);
+				break;
+			case 'L':
+				options.lanes.push_back(parse_lane_option(optarg));
+				break;
+			case 't':
+				options.queue_time_param = header_name_to_param(optarg);
+				break;
+			case 'D':
+				options.queue_deadline = parse_int_option("--queue-deadline", optarg, 0, 3600 * 1000);
+				break;
+			case 'S':
+				options.static_mappings.push_back(parse_static_option(optarg));
+				break;
+			case 'm':
+				options.min_workers = parse_int_option("--min-workers", optarg, 1, 65536);
+				break;
+			case 'M':
+				options.max_workers = parse_int_option("--max-workers", optarg, 1, 65536);
+				break;
+			case 'w':
+				options.spare_workers = parse_int_option("--spare-workers", optarg, 0, 65536);
+				break;
+			case 'P':
+				options.pool_file = optarg;
+				break;
+			case 'R':
+				options.max_requests = parse_int_option("--max-requests", optarg, 0, 1000000000);
+				break;
+			case 'J':
+				options.max_requests_jitter = parse_int_option("--max-requests-jitter", optarg, 0, 1000000000);
+				break;
+			case 'X':
+				options.max_rss = parse_int_option("--max-rss", optarg, 0, 1024 * 1024);
+				break;
+			case 'Y':
+				options.max_private_dirty = parse_int_option("--max-private-dirty", optarg, 0, 1024 * 1024);
+				break;
+			case 'Z':
+				options.smaps_interval = parse_int_option("--smaps-interval", optarg, 1, 1000000);
+				break;
 			default:
 				/*
 				 * getopt_long already printed an error
@@ -843,13 +2381,49 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (!options.dispatcher &&
+		(options.shed_queue_depth > 0 || options.shed_queue_age > 0 || options.shed_busy_ratio > 0))
+	{
+		fprintf(stderr, "load shedding requires --dispatcher\n");
+		exit(1);
+	}
+
+	if (options.queue_deadline > 0 && options.queue_time_param.empty())
+	{
+		fprintf(stderr, "--queue-deadline requires --queue-time-header\n");
+		exit(1);
+	}
+
+	if (options.max_requests_jitter == -1)
+		options.max_requests_jitter = options.max_requests / 10;
+
+	if (options.max_private_dirty > 0 && access("/proc/self/smaps_rollup", R_OK) != 0)
+	{
+		fprintf(stderr, "--max-private-dirty requires /proc/self/smaps_rollup (Linux 4.14 or later)\n");
+		exit(1);
+	}
+
+	if (options.max_workers < options.min_workers)
+	{
+		fprintf(stderr, "--max-workers must not be smaller than --min-workers\n");
+		exit(1);
+	}
+
+	if (options.reuseport && (options.min_workers >= 0 || !options.pool_file.empty()))
+	{
+		/* connections queued on the socket of an empty slot would never be accepted */
+		fprintf(stderr, "autoscaling can't be used with --reuseport\n");
+		exit(1);
+	}
+
 	if (optind != argc - 4)
 	{
 		print_usage(stderr, argv[0]);
 		exit(1);
 	}
 
-	auto psgi_application_path = argv[argc - 4];
+	/* argv is overwritten by the process title, and reloading needs this */
+	auto psgi_application_path = strdup(argv[argc - 4]);
 	auto nworkers_str = argv[argc - 3];
 	char *endptr;
 	long nworkers = strtol(nworkers_str, &endptr, 10);
@@ -865,6 +2439,31 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 	auto fastcgi_socket_path = argv[argc - 2];
+
+	long total_workers = nworkers;
+	for (size_t i = 0; i < options.lanes.size(); i++)
+	{
+		auto &lane = options.lanes[i];
+		if (lane.name == "main")
+		{
+			fprintf(stderr, "lane name \"main\" is reserved for FASTCGI_SOCKET_PATH\n");
+			exit(1);
+		}
+		for (size_t j = 0; j < i; j++)
+		{
+			if (options.lanes[j].name == lane.name)
+			{
+				fprintf(stderr, "lane \"%s\" given more than once\n", lane.name.c_str());
+				exit(1);
+			}
+		}
+		total_workers += lane.nworkers;
+	}
+	if (total_workers > 65536)
+	{
+		fprintf(stderr, "the total number of workers must not exceed 65536\n");
+		exit(1);
+	}
 	auto stats_socket_path = argv[argc - 1];
 
 	mainapp = make_unique<BPSGIMainApplication>(
@@ -875,7 +2474,8 @@ main(int argc, char *argv[])
 		opt_application_loader,
 		fastcgi_socket_path,
 		stats_socket_path,
-		opt_process_title_prefix
+		opt_process_title_prefix,
+		options
 	);
 
 	try
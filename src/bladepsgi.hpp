@@ -12,19 +12,24 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <fcntl.h>
+#include <list>
 #include <memory>
 #include <stdexcept>
 #include <vector>
 #include <signal.h>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <semaphore.h>
 #include <sys/errno.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/shm.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -86,18 +91,127 @@ public:
 	int64_t Read();
 
 	std::string name() const { return name_; }
+	std::atomic<int64_t> *ptr() const { return ptr_; }
 
 private:
 	std::atomic<int64_t> *ptr_;
 	std::string name_;
 };
 
+/* worker status of a slot which has no process, with autoscaling */
+#define WORKER_STATUS_NO_PROCESS	'.'
+
+/*
+ * Queue wait times are counted in buckets with these upper bounds, in
+ * milliseconds; the last bucket has no upper bound.
+ */
+#define QUEUE_WAIT_HISTOGRAM_BUCKETS	14
+static const int64_t queue_wait_histogram_bounds_ms[QUEUE_WAIT_HISTOGRAM_BUCKETS - 1] = {
+	1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+/*
+ * Per-worker statistics kept in shared memory.  Only the worker itself ever
+ * writes to its own slot.
+ */
+struct BPSGIWorkerStats {
+	std::atomic<int64_t> connections;
+	std::atomic<int64_t> requests;
+	/* requests served on a connection which had already served a request */
+	std::atomic<int64_t> keepalive_requests;
+	/* requests served on the current connection, or 0 if idle */
+	std::atomic<int64_t> connection_requests;
+	/* idle kept-alive connections closed to accept a waiting connection */
+	std::atomic<int64_t> keepalive_drops;
+	/* microseconds requests spent waiting in the dispatcher for this worker */
+	std::atomic<int64_t> dispatch_wait_usec;
+	/* responses handed to a sender process because the frontend was slow */
+	std::atomic<int64_t> offloaded_responses;
+	/*
+	 * With --queue-time-header, the time requests spent between the frontend
+	 * and the worker, and how many were answered with 503 for exceeding
+	 * --queue-deadline.  Requests without a usable header aren't counted in
+	 * the histogram.
+	 */
+	std::atomic<int64_t> queue_wait_histogram[QUEUE_WAIT_HISTOGRAM_BUCKETS];
+	std::atomic<int64_t> queue_wait_usec;
+	std::atomic<int64_t> queue_wait_missing;
+	std::atomic<int64_t> queue_deadline_drops;
+	/* requests answered from a --static directory, including 304s */
+	std::atomic<int64_t> static_responses;
+	/* workers in this slot which exited after --max-requests requests */
+	std::atomic<int64_t> recycles;
+	/*
+	 * With --max-rss or --max-private-dirty, the memory use of the current
+	 * worker as of its last request, the largest RSS it has had, and how many
+	 * workers in this slot exited for going over either limit.
+	 */
+	std::atomic<int64_t> rss_bytes;
+	std::atomic<int64_t> rss_peak_bytes;
+	std::atomic<int64_t> private_dirty_bytes;
+	std::atomic<int64_t> memory_recycles;
+	/* the generation of the application the current worker was forked from */
+	std::atomic<int64_t> generation;
+};
+
+/*
+ * Statistics of the dispatcher process, kept in shared memory after the
+ * per-worker statistics.
+ */
+struct BPSGIDispatcherStats {
+	std::atomic<int64_t> connections;
+	std::atomic<int64_t> requests;
+	/* connections currently held by the dispatcher */
+	std::atomic<int64_t> open_connections;
+	/* complete requests waiting for an idle worker */
+	std::atomic<int64_t> queued_requests;
+	/* requests answered with 503, by the limit which was exceeded */
+	std::atomic<int64_t> shed_queue_depth;
+	std::atomic<int64_t> shed_queue_age;
+	std::atomic<int64_t> shed_busy_ratio;
+};
+
+/*
+ * Statistics of a response sender process, kept in shared memory after the
+ * dispatcher's.
+ */
+struct BPSGISenderStats {
+	std::atomic<int64_t> responses;
+	/* responses which couldn't be sent completely */
+	std::atomic<int64_t> failed_responses;
+	std::atomic<int64_t> bytes_sent;
+	/* responses currently being sent */
+	std::atomic<int64_t> queued_responses;
+	/* bytes of those responses which haven't been sent yet */
+	std::atomic<int64_t> bytes_in_flight;
+};
+
+/*
+ * The size and bounds of the worker pool with autoscaling, and how often its
+ * workers have crashed, kept in shared memory after the senders' statistics.
+ */
+struct BPSGIPoolStats {
+	/* worker processes running, not counting ones being retired */
+	std::atomic<int64_t> workers;
+	std::atomic<int64_t> min_workers;
+	std::atomic<int64_t> max_workers;
+	std::atomic<int64_t> spare_workers;
+	std::atomic<int64_t> spawns;
+	std::atomic<int64_t> retirements;
+	/* workers which died unexpectedly and were replaced */
+	std::atomic<int64_t> crashes;
+	/* the generation of the application new workers are forked from */
+	std::atomic<int64_t> generation;
+};
+
 class BPSGISharedMemory {
 	friend class BPSGIMainApplication;
 	friend class BPSGIMonitoring;
 
 public:
-	BPSGISharedMemory(void *shared_memory_segment, size_t shmem_size);
+	static size_t RequiredSize(int nworkers);
+
+	BPSGISharedMemory(void *shared_memory_segment, size_t shmem_size, int nworkers);
 
 	void *AllocateUserShmem(size_t size);
 	BPSGISemaphore *NewSemaphore(std::string name, int64_t value);
@@ -106,6 +220,11 @@ public:
 	std::atomic<int_fast8_t> *WorkerArraySegment() const;
 	int_fast8_t GetWorkerStatus(WorkerNo workerno) const;
 	void GetAllWorkerStatuses(int nworkers, char *out) const;
+	BPSGIWorkerStats *WorkerStats(WorkerNo workerno) const;
+	BPSGIDispatcherStats *DispatcherStats() const;
+	BPSGISenderStats *SenderStats(int senderno) const;
+	int64_t OffloadedBytesInFlight() const;
+	BPSGIPoolStats *PoolStats() const;
 
 	int_fast64_t IncreaseRequestCounter();
 	int_fast64_t ReadRequestCounter();
@@ -120,6 +239,7 @@ protected:
 private:
 	char   *shared_memory_segment_;
 	size_t	shmem_size_;
+	int		nworkers_;
 	bool	locked_;
 	size_t	next_user_available_offset_;
 };
@@ -145,12 +265,17 @@ private:
 
 struct bladepsgi_perl_callback_t;
 
+class BPSGIRequest;
+
 class BPSGIPerlCallbackFunction {
 public:
 	BPSGIPerlCallbackFunction(struct bladepsgi_perl_callback_t *p);
 
 	void Call();
 	unique_ptr<BPSGIPerlCallbackFunction> CallAndReceiveCallback();
+	bool CallPSGIApplication(BPSGIRequest *request);
+	bool HasCleanupHandlers();
+	void RunCleanupHandlers(bool *harakiri);
 
 private:
 	struct bladepsgi_perl_callback_t *p_;
@@ -163,6 +288,7 @@ class BPSGIAuxiliaryProcess;
 class BPSGIPerlInterpreter {
 public:
 	static void PerProcessInit();
+	static bool SupportsMultipleInterpreters();
 
 	BPSGIPerlInterpreter(BPSGIMainApplication *mainapp);
 	~BPSGIPerlInterpreter();
@@ -180,6 +306,123 @@ private:
 	void *ctx_;
 };
 
+/*
+ * The protocol spoken on a listen socket.  Listen addresses prefixed with
+ * "http:" accept plain HTTP/1.1 instead of FastCGI, and those prefixed with
+ * "uwsgi:" the uwsgi protocol.
+ */
+enum BPSGIProtocol {
+	PROTOCOL_FASTCGI,
+	PROTOCOL_HTTP,
+	PROTOCOL_UWSGI,
+};
+
+/*
+ * A lane is a FastCGI listen address served by a group of workers of its own.
+ * The positional NUM_WORKERS and FASTCGI_SOCKET_PATH make up the lane "main",
+ * and every --lane adds another one.  Workers are numbered consecutively
+ * across lanes, in the order the lanes were given.
+ */
+struct BPSGILane {
+	std::string name;
+	std::string socket_path;
+	int nworkers;
+
+	/* the rest is filled in by BPSGIMainApplication */
+	BPSGIProtocol protocol;
+	WorkerNo first_worker;
+	bool is_tcp;
+	/* the listen socket, or with --reuseport one for each worker of the lane */
+	std::vector<int> sockfds;
+};
+
+/*
+ * A URL path prefix whose files are served from a directory by the workers
+ * themselves, given with --static.  The prefix has no trailing slash.
+ */
+struct BPSGIStaticMapping {
+	std::string prefix;
+	std::string directory;
+};
+
+/*
+ * Tunables which can be set from the command line.  The constructor sets the
+ * defaults.
+ */
+struct BPSGIOptions {
+	BPSGIOptions();
+
+	/* seconds to wait for the next request on a FastCGI connection, 0 = off */
+	int keepalive_timeout;
+	/* bytes of response output to collect before writing it out */
+	int output_buffer_size;
+	/* request bodies larger than this are spooled into a memfd */
+	int input_spool_threshold;
+	/* milliseconds streamed response output may wait in the buffer */
+	int stream_flush_interval;
+	/* give every worker its own SO_REUSEPORT listen socket (TCP only) */
+	bool reuseport;
+	/* accept connections in a dispatcher process instead of the workers */
+	bool dispatcher;
+	/* number of processes sending out responses for slow frontends, or 0 */
+	int offload_senders;
+	/*
+	 * Megabytes of response output one worker may spool for offloading, and
+	 * all of the senders may hold together before workers stop spooling.
+	 */
+	int offload_spool_limit;
+	int offload_memory_limit;
+	/*
+	 * With --dispatcher, requests are answered with a 503 instead of being
+	 * queued once this many are already waiting, once they've waited for
+	 * this many milliseconds, or while this percentage of workers is busy.
+	 * 0 disables each limit.
+	 */
+	int shed_queue_depth;
+	int shed_queue_age;
+	int shed_busy_ratio;
+	/* Retry-After sent with those 503 responses, in seconds */
+	int shed_retry_after;
+	/* lanes given with --lane, in addition to the main one */
+	std::vector<BPSGILane> lanes;
+	/*
+	 * The request parameter carrying the time the frontend received the
+	 * request (e.g. HTTP_X_REQUEST_START), or empty.  Requests which have
+	 * waited for longer than queue_deadline milliseconds since then are
+	 * answered with a 503 without running the application; 0 = no deadline.
+	 */
+	std::string queue_time_param;
+	int queue_deadline;
+	/* directories served without involving the application */
+	std::vector<BPSGIStaticMapping> static_mappings;
+	/*
+	 * Autoscaling: each lane runs between min_workers and max_workers workers
+	 * (capped by its NUM_WORKERS), keeping spare_workers of them idle.
+	 * min_workers is -1 if autoscaling is off.  pool_file, if set, overrides
+	 * these, and is read again on SIGHUP.
+	 */
+	int min_workers;
+	int max_workers;
+	int spare_workers;
+	std::string pool_file;
+	/*
+	 * Workers exit after serving between max_requests and max_requests +
+	 * max_requests_jitter requests, the number being picked at random by
+	 * every worker.  0 means never.
+	 */
+	int max_requests;
+	int max_requests_jitter;
+	/*
+	 * Workers exit once their RSS goes over max_rss megabytes, checked after
+	 * every request, or their private dirty memory goes over
+	 * max_private_dirty megabytes, checked every smaps_interval requests.
+	 * 0 means no limit.
+	 */
+	int max_rss;
+	int max_private_dirty;
+	int smaps_interval;
+};
+
 enum BPSGISubprocessInitFlags {
 	SUBP_DEFAULT_FLAGS		= 0,
 	SUBP_NO_DEATHSIG		= 1,
@@ -197,7 +440,8 @@ public:
 		const char *application_loader,
 		const char *fastcgi_socket_path,
 		const char *stats_socket_path,
-		const char *process_title_prefix
+		const char *process_title_prefix,
+		const BPSGIOptions &options
 	);
 
 	int Run();
@@ -209,8 +453,17 @@ public:
 	int nworkers() const { return nworkers_; }
 	pid_t runner_pid() const { return runner_pid_; }
 	BPSGISharedMemory * shmem() const { return shmem_.get(); }
-	int fastcgi_sockfd() const { return fastcgi_sockfd_; }
+	int fastcgi_sockfd() const { return lanes_[0].sockfds[0]; }
+	const std::vector<BPSGILane> &lanes() const { return lanes_; }
+	size_t worker_lane_index(WorkerNo workerno) const;
+	const BPSGILane &worker_lane(WorkerNo workerno) const { return lanes_[worker_lane_index(workerno)]; }
+	int worker_fastcgi_sockfd(WorkerNo workerno) const;
+	int dispatcher_channel(WorkerNo workerno, bool worker_end) const;
+	int sender_channel(int senderno, bool worker_end) const;
 	int stats_sockfd() const { return stats_sockfd_; }
+	const BPSGIOptions &options() const { return options_; }
+	bool autoscaling() const { return autoscaling_; }
+	int generation() const { return generation_; }
 
 	const char *psgi_application_path() const { return psgi_application_path_; }
 	const char *psgi_application_loader() const { return application_loader_; }
@@ -241,21 +494,49 @@ protected:
 	void DrainSelfPipe();
 
 	void InitializeSharedMemory();
-	void InitializeMainFastCGISocket();
+	void InitializeFastCGISockets();
 	void InitializeStatsSocket();
 
 	int InitializeUNIXSocket(const char *path, const int listen_backlog_size_);
+	int InitializeTCPSocket(const std::string &host, const std::string &port, const int listen_backlog_size_, bool reuseport);
 
+	void LoadApplication();
 	void SpawnWorkersAndAuxiliaryProcesses();
+	void SpawnZygoteProcess(bool new_generation);
+	void RunZygoteProcess(bool new_generation);
+	pid_t ForkWorker(WorkerNo workerno);
+	void SpawnWorker(WorkerNo workerno);
+	bool RespawnWorker(WorkerNo workerno);
+	int64_t DelayWorkerRespawn(WorkerNo workerno);
+	void ScheduleWorkerRespawn(WorkerNo workerno, pid_t pid, int status);
+	int64_t RespawnCrashedWorkers();
+	void DestroyPerlInterpreter();
 	void SpawnAuxiliaryProcess(BPSGIAuxiliaryProcess &process);
 	void RunWorker(WorkerNo workerno, unique_ptr<BPSGIPerlInterpreter> interpreter, unique_ptr<BPSGIPerlCallbackFunction> main_callback);
 
 	void SpawnMonitoringProcess();
 	void RunMonitoringProcess();
 
+	void InitializeDispatcherChannels();
+	void SpawnDispatcherProcess();
+	void RunDispatcherProcess();
+
+	void InitializeSenderChannels();
+	void SpawnSenderProcesses();
+	void RunSenderProcess(int senderno);
+	void TerminateSenderProcesses();
+
 	void HandleUnexpectedChildProcessDeath(const std::string process, pid_t pid, int status);
 	void HandleChildProcessDeath(pid_t pid, int status);
 
+	void ReadPoolFile();
+	void ScaleWorkerPool();
+	void RetireWorker(WorkerNo workerno);
+
+	void StartReload();
+	void HandleZygoteReady();
+	void ContinueReload();
+
 private:
 	std::vector<sigset_t>	signal_mask_stack_;
 
@@ -265,20 +546,64 @@ private:
 	const char *psgi_application_path_;
 	int			nworkers_;
 	const char *application_loader_;
-	const char *fastcgi_socket_path_;
 	const char *stats_socket_path_;
 	const char *process_title_prefix_;
+	BPSGIOptions options_;
 
 	pid_t	runner_pid_;
 	pid_t	monitoring_process_pid_;
+	pid_t	dispatcher_process_pid_;
+	pid_t	zygote_process_pid_;
+	std::vector<pid_t> sender_pids_;
 	std::vector<pid_t> worker_pids_;
 	std::vector<pid_t> auxiliary_pids_;
 
 	std::vector<unique_ptr<BPSGIAuxiliaryProcess>> auxiliary_processes_;
 
+	/* kept alive in the overseer for forking replacement workers */
+	unique_ptr<BPSGIPerlInterpreter> interpreter_;
+	unique_ptr<BPSGIPerlCallbackFunction> main_callback_;
+
 	unique_ptr<BPSGISharedMemory> shmem_;
-	int fastcgi_sockfd_;
+	std::vector<BPSGILane> lanes_;
+	/* with --dispatcher, a socketpair between the dispatcher and each worker */
+	std::vector<std::array<int, 2>> dispatcher_channels_;
+	/* with --offload-senders, a socketpair shared by all workers for each sender */
+	std::vector<std::array<int, 2>> sender_channels_;
 	int stats_sockfd_;
+
+	/* the current bounds of the worker pool; see BPSGIOptions */
+	bool autoscaling_;
+	int pool_min_workers_;
+	int pool_max_workers_;
+	int pool_spare_workers_;
+	int64_t pool_last_scaled_at_;
+	/* workers which have been asked to exit, and aren't to be replaced */
+	std::vector<bool> worker_retiring_;
+	/* for how many samples in a row each lane has had too many idle workers */
+	std::vector<int> lane_surplus_samples_;
+	/* how many workers each lane spawns the next time it's short of idle ones */
+	std::vector<int> lane_spawn_batch_;
+
+	/* SOCK_SEQPACKET socket between the overseer and the zygote */
+	int zygote_channel_;
+	/* when each worker was forked, and how often in a row it has crashed */
+	std::vector<int64_t> worker_started_at_;
+	std::vector<int> worker_crashes_;
+	/* when to replace each crashed worker, or -1 */
+	std::vector<int64_t> worker_respawn_at_;
+
+	/* the generation of the application new workers are forked from */
+	int generation_;
+	/* the generation each worker was forked from */
+	std::vector<int> worker_generation_;
+	/* a zygote loading the next generation, and its channel, or -1 */
+	pid_t loading_zygote_pid_;
+	int loading_zygote_channel_;
+	/* zygotes of previous generations which have been asked to exit */
+	std::vector<pid_t> old_zygote_pids_;
+	/* whether workers of a previous generation are still being replaced */
+	bool reloading_;
 };
 
 class BPSGIMonitoring {
@@ -288,13 +613,540 @@ public:
 
 protected:
 	void HandleClient(int listensockfd, int64_t bladepsgi_start_time, std::vector<char> worker_status_array);
+	void SampleBacklog();
 
 private:
 	BPSGIMainApplication *mainapp_;
+
+	/* accept queue of the FastCGI socket(s) as of the last sample */
+	bool backlog_available_;
+	int64_t backlog_;
+	int64_t backlog_limit_;
+	/* the longest accept queue seen since startup */
+	int64_t backlog_peak_;
+	/* the same for each lane */
+	std::vector<int64_t> lane_backlog_;
+	std::vector<int64_t> lane_backlog_peak_;
+};
+
+/*
+ * Header of the messages sent over the socketpairs between the dispatcher and
+ * the workers.  The dispatcher hands a worker a connection along with what it
+ * has already read of the request, either inline after the header or in a
+ * memfd.  A worker tells the dispatcher when it's ready for a new request, and
+ * hands kept-alive connections back.
+ */
+struct BPSGIDispatchMessage {
+	uint32_t flags;
+	uint32_t preread_len;
+	/* requests served on the connection so far */
+	int64_t connection_requests;
+	/* CLOCK_MONOTONIC time in microseconds at which the request was complete */
+	int64_t ready_at;
+};
+
+#define DISPATCH_WORKER_READY		0x01
+#define DISPATCH_CONNECTION			0x02
+#define DISPATCH_PREREAD_MEMFD		0x04
+/* a connection along with a memfd holding the rest of its response */
+#define DISPATCH_RESPONSE_MEMFD		0x08
+/*
+ * A worker being retired asks the dispatcher to stop handing it connections;
+ * the dispatcher confirms with the same flag.
+ */
+#define DISPATCH_WORKER_RETIRING	0x10
+
+/* read-ahead data larger than this is passed in a memfd */
+#define DISPATCH_INLINE_PREREAD_MAX	65536
+
+/*
+ * Tracks how far the dispatcher has read into a request, without decoding
+ * anything.  The request is complete once the end of FCGI_STDIN has been seen,
+ * or a record the worker has to reply to right away.
+ */
+struct BPSGIRequestScanState {
+	size_t offset;
+	bool params_complete;
+	bool complete;
+	/* from FCGI_BEGIN_REQUEST, if seen */
+	uint16_t request_id;
+	bool keep_conn;
+	/* completed by something other than the end of FCGI_STDIN */
+	bool exceptional;
+	/* HTTP and uwsgi: where the request body ends, once the headers are complete */
+	size_t body_end;
+};
+
+class BPSGIDispatcher {
+public:
+	BPSGIDispatcher(BPSGIMainApplication *mainapp);
+	~BPSGIDispatcher();
+
+	int Run();
+
+protected:
+	struct Connection {
+		int sockfd;
+		/* index of the lane the connection came in on */
+		size_t lane;
+		std::string data;
+		BPSGIRequestScanState scan;
+		int64_t connection_requests;
+		/* when the request was complete, or the last time data arrived */
+		int64_t last_activity;
+		/* waiting in the lane's ready queue for a worker */
+		bool queued;
+	};
+
+	void WatchFd(int fd, uint64_t tag);
+	void AcceptConnections(int listen_sockfd);
+	void AddConnection(int sockfd, size_t lane, int64_t connection_requests);
+	void ReadFromConnection(Connection *conn);
+	void CloseConnection(Connection *conn);
+	void HandleWorkerMessage(WorkerNo workerno);
+	void QueueRequest(Connection *conn);
+	void ShedRequest(Connection *conn, std::atomic<int64_t> *counter);
+	void ShedExpiredRequests(int64_t now);
+	bool BusyRatioExceeded(const BPSGILane &lane);
+	void DispatchRequests();
+	bool DispatchRequest(Connection *conn, WorkerNo workerno);
+	void CloseIdleConnections(int64_t now);
+
+private:
+	BPSGIMainApplication *mainapp_;
+	BPSGIDispatcherStats *stats_;
+	int epollfd_;
+
+	size_t read_ahead_limit_;
+	int64_t idle_timeout_usec_;
+	int64_t shed_queue_age_usec_;
+	std::string shed_response_headers_;
+	std::string http_shed_response_headers_;
+	std::vector<char> worker_status_data_;
+
+	std::unordered_map<int, unique_ptr<Connection>> connections_;
+	/* the lane of each listen socket */
+	std::unordered_map<int, size_t> listen_lanes_;
+	/* requests waiting for a worker, for each lane */
+	std::vector<std::deque<Connection *>> ready_queues_;
+	std::vector<bool> worker_idle_;
+	std::vector<char> message_buffer_;
+};
+
+/*
+ * A response sender writes out responses which the frontend wasn't reading
+ * fast enough, so that the worker which generated them can move on.  Workers
+ * hand over the connection and a memfd with the rest of the response; the
+ * connection is closed once it's all been sent.
+ */
+class BPSGIResponseSender {
+public:
+	static const int max_senders = 64;
+
+public:
+	BPSGIResponseSender(BPSGIMainApplication *mainapp, int senderno);
+	~BPSGIResponseSender();
+
+	int Run();
+
+protected:
+	struct Response {
+		int sockfd;
+		int spoolfd;
+		off_t offset;
+		off_t size;
+		int64_t last_progress;
+	};
+
+	bool ReceiveResponse();
+	bool SendResponse(Response *response);
+	void FinishResponse(Response *response, bool ok);
+	void CloseStalledResponses(int64_t now);
+
+private:
+	BPSGIMainApplication *mainapp_;
+	int senderno_;
+	BPSGISenderStats *stats_;
+	int epollfd_;
+
+	std::unordered_map<int, unique_ptr<Response>> responses_;
+	std::vector<char> message_buffer_;
+};
+
+/* dispatcher.cpp */
+extern int64_t BPSGIMonotonicTimeUsec();
+extern void BPSGISendDispatchMessage(int sockfd, const BPSGIDispatchMessage &msg, const char *data, size_t datalen, const int *fds, int nfds);
+extern bool BPSGIReceiveDispatchMessage(int sockfd, BPSGIDispatchMessage *msg, std::vector<char> &data, int *fds, int *nfds);
+
+/* fastcgi.cpp */
+extern void BPSGIFastCGIScan(const char *data, size_t len, BPSGIRequestScanState *state);
+extern void BPSGIFastCGIBuildResponse(std::string &out, uint16_t request_id, const std::string &headers, const std::string &body);
+
+/* http.cpp */
+extern void BPSGIHTTPScan(const char *data, size_t len, BPSGIRequestScanState *state);
+extern void BPSGIHTTPBuildResponse(std::string &out, int status, const std::string &headers, const std::string &body, bool keep_conn);
+/* length of an HTTP date, "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define HTTP_DATE_LEN				29
+extern size_t BPSGIHTTPFormatDate(time_t t, char *buf);
+extern bool BPSGIHTTPParseDate(const char *value, size_t len, time_t *result);
+extern void BPSGIHTTPAppendDateHeader(std::string &out);
+
+/* uwsgi.cpp */
+extern void BPSGIUWSGIScan(const char *data, size_t len, BPSGIRequestScanState *state);
+
+/* http_status.cpp */
+extern const char *BPSGIStatusLine(int status, size_t *len);
+extern const char *BPSGIHTTPStatusLine(int status, size_t *len);
+extern const char *BPSGIReasonPhrase(int status);
+
+class BPSGIConnection;
+class BPSGIRequest;
+
+/*
+ * The request body of a FastCGI request, exposed to the PSGI application as
+ * psgi.input.  FCGI_STDIN records are only read from the connection when the
+ * application asks for the data.  Small bodies are kept in memory, but once a
+ * body grows past the spool threshold it's moved into an anonymous memfd so
+ * that the worker's memory usage stays bounded.
+ */
+class BPSGIInputStream {
+public:
+	BPSGIInputStream(BPSGIConnection *conn, BPSGIRequest *request, size_t spool_threshold);
+	~BPSGIInputStream();
+
+	void Start(int64_t content_length);
+	void Reset();
+
+	ssize_t Read(char *buf, size_t len);
+	bool Seek(int64_t offset, int whence);
+	int64_t Tell() const { return pos_; }
+	bool Drain();
+
+	bool complete() const { return complete_; }
+
+protected:
+	bool Fill(int64_t upto);
+	void Spool(const char *data, size_t len);
+	void SpillToMemfd();
+
+private:
+	BPSGIConnection *conn_;
+	BPSGIRequest *request_;
+	size_t spool_threshold_;
+
+	bool complete_;
+	bool failed_;
+	/* number of bytes received from the client so far */
+	int64_t spooled_;
+	int64_t pos_;
+
+	std::vector<char> data_;
+	/* created on first use and then kept around for later requests */
+	int memfd_;
+	bool in_memfd_;
+};
+
+/*
+ * BPSGIStreamWriter is the writer object handed to streaming PSGI responses.
+ * Writes are collected into the connection's output buffer and flushed once
+ * the oldest buffered data is older than the flush interval, without blocking
+ * if the frontend isn't reading.
+ */
+class BPSGIStreamWriter {
+public:
+	BPSGIStreamWriter(BPSGIConnection *conn, BPSGIRequest *request, int flush_interval_ms);
+
+	void Reset();
+
+	int Write(const char *data, size_t len);
+	bool Close();
+	bool WaitWritable();
+
+	bool closed() const { return closed_; }
+	int64_t written() const { return written_; }
+	bool polling() const { return polling_; }
+	void set_polling(bool polling) { polling_ = polling; }
+
+private:
+	BPSGIConnection *conn_;
+	BPSGIRequest *request_;
+	int64_t flush_interval_ms_;
+
+	bool closed_;
+	bool polling_;
+	int64_t written_;
+	/* monotonic time in ms at which data was first buffered, or -1 */
+	int64_t buffered_since_;
+};
+
+struct BPSGIRequestParam {
+	const char *name;
+	size_t namelen;
+	const char *value;
+	size_t valuelen;
+};
+
+class BPSGIRequest {
+	friend class BPSGIConnection;
+
+public:
+	BPSGIRequest(BPSGIConnection *conn, size_t input_spool_threshold, int stream_flush_interval_ms);
+
+	void Reset();
+
+	int num_params() const { return (int) params_.size(); }
+	const BPSGIRequestParam &param(int i) const { return params_[i]; }
+	const char *FindParam(const char *name, size_t *valuelen) const;
+
+	BPSGIInputStream *input() { return &input_; }
+	BPSGIStreamWriter *writer() { return &writer_; }
+	BPSGIStreamWriter *StartStreaming();
+
+	bool Write(const char *data, size_t len);
+	bool Flush();
+	int SendFile(int fd, int64_t offset);
+
+	void BeginResponseHeaders(int status);
+	bool AddResponseHeader(const char *name, size_t namelen, const char *value, size_t valuelen);
+	bool FinishResponseHeaders();
+
+	uint16_t request_id() const { return request_id_; }
+	bool keep_conn() const { return keep_conn_; }
+	void DisallowKeepConn() { keep_conn_ = false; }
+
+protected:
+	void DecodeParams();
+	void AddParam(const char *name, size_t namelen, const char *value, size_t valuelen);
+
+	void BeginHTTPResponseHeaders(int status);
+	void AddHTTPResponseHeader(const char *name, size_t namelen, const char *value, size_t valuelen);
+	bool FinishHTTPResponseHeaders();
+
+private:
+	BPSGIConnection *conn_;
+
+	uint16_t request_id_;
+	bool keep_conn_;
+	bool params_complete_;
+
+	/* HTTP only: 10 or 11 for HTTP/1.0 or HTTP/1.1, and whether it's HEAD */
+	int http_version_;
+	bool http_head_;
+	/* HTTP only: status and Content-Length of the response, or -1 */
+	int response_status_;
+	int64_t response_content_length_;
+
+	std::vector<char> params_data_;
+	std::vector<BPSGIRequestParam> params_;
+	BPSGIInputStream input_;
+	BPSGIStreamWriter writer_;
+
+	std::string header_buffer_;
+};
+
+/*
+ * A connection from the frontend, speaking FastCGI, HTTP/1.1 or uwsgi.  The
+ * FastCGI parts are in fastcgi.cpp and the HTTP parts in http.cpp.  With HTTP,
+ * the response body is either sent as is or with chunked transfer coding, and
+ * request bodies are read the same way.  uwsgi (uwsgi.cpp) only differs from
+ * HTTP in how the request head is encoded; its responses are HTTP responses,
+ * ended by closing the connection.
+ */
+class BPSGIConnection {
+	friend class BPSGIRequest;
+
+public:
+	BPSGIConnection(BPSGIProtocol protocol, size_t output_buffer_size, bool offload,
+					int64_t max_spool_size, int64_t max_spool_total, const BPSGISharedMemory *shmem);
+	~BPSGIConnection();
+
+	bool Accept(int listen_sockfd, bool tcp);
+	void Adopt(int sockfd, const char *preread, size_t preread_len);
+	BPSGIProtocol protocol() const { return protocol_; }
+	bool IsOpen() const { return sockfd_ != -1; }
+	bool IsBroken() const { return broken_; }
+	bool HasBufferedInput() const { return inbuf_end_ != inbuf_start_ || preread_pos_ < preread_.size(); }
+	int sockfd() const { return sockfd_; }
+	void Close();
+
+	bool ReadRequest(BPSGIRequest &request);
+	int ReadStdin(uint16_t request_id, const char **data, size_t *len);
+	bool WriteStdout(uint16_t request_id, const char *data, size_t len);
+	bool Flush();
+	int FlushNonBlocking();
+	bool HasBufferedOutput() const { return !outbuf_.empty(); }
+	int SendFile(uint16_t request_id, int fd, int64_t offset);
+	void FinishRequest(BPSGIRequest &request);
+
+	void DisallowOffload();
+	bool TakeSpooledResponse(int *sockfd, int *spoolfd);
+
+protected:
+	enum HTTPFraming {
+		/* the response body is sent as is */
+		HTTP_FRAMING_RAW,
+		HTTP_FRAMING_CHUNKED,
+		/* responses to HEAD, and 1xx, 204 and 304 responses have no body */
+		HTTP_FRAMING_NONE,
+	};
+
+	size_t FillFrameHeader(char *hdr, uint16_t request_id, size_t len) const;
+	size_t FrameHeaderLength() const;
+	size_t FrameTrailerLength() const;
+	int64_t MaxFrameLength() const;
+
+	bool ReadHTTPRequest(BPSGIRequest &request);
+	bool ParseHTTPRequestHead(BPSGIRequest &request);
+	int ReadHTTPBody(const char **data, size_t *len);
+	bool ReadHTTPLine(const char **line, size_t *len);
+	void FailHTTPRequest(int status);
+	bool WriteHTTPResponseHeaders(const std::string &headers, HTTPFraming framing, int64_t content_length);
+	void FinishHTTPResponse(BPSGIRequest &request);
+	void LookUpHTTPAddresses();
+
+	bool ReadUWSGIRequest(BPSGIRequest &request);
+
+	void BufferStdout(uint16_t request_id, const char *data, size_t len);
+	bool WriteStdoutDirect(uint16_t request_id, const char *data, size_t len);
+	void CloseOutputRecord();
+
+	int SendRegularFile(uint16_t request_id, int fd, int64_t offset, int64_t size);
+	int SpliceStream(uint16_t request_id, int fd);
+	void CloseSplicePipe();
+
+	void WaitForSocket(short events);
+	void HandleBlockedWrite();
+	bool SpoolFull() const;
+	void DrainSpool();
+	int OutputFd();
+	void OutputWritten(size_t len) { if (spool_fd_ != -1) spool_size_ += (int64_t) len; }
+
+	bool FillInputBuffer(size_t needed);
+	bool ReadRecord(uint8_t *type, uint16_t *request_id, const char **content, size_t *content_length);
+	bool WriteRecord(uint8_t type, uint16_t request_id, const char *data, size_t len);
+	bool WriteFully(struct iovec *iov, int iovcnt);
+	void HandleManagementRecord(uint8_t type, const char *content, size_t content_length);
+
+private:
+	BPSGIProtocol protocol_;
+	int sockfd_;
+	bool broken_;
+
+	/* HTTP only: framing of the current response, and how much of it was sent */
+	HTTPFraming http_framing_;
+	bool http_response_started_;
+	int64_t http_response_length_;
+	int64_t http_response_written_;
+
+	/*
+	 * HTTP only: the request body still to be read.  With chunked transfer
+	 * coding, http_body_remaining_ is what's left of the current chunk.
+	 */
+	bool http_body_chunked_;
+	bool http_body_done_;
+	int64_t http_body_remaining_;
+	bool http_chunk_crlf_pending_;
+	bool http_expect_continue_;
+
+	/* HTTP only: looked up once per connection for the PSGI environment */
+	bool http_addresses_known_;
+	std::string http_server_name_;
+	std::string http_server_port_;
+	std::string http_remote_addr_;
+	std::string http_remote_port_;
+
+	/* HTTP only: scratch space for the request headers */
+	std::vector<std::pair<std::string, std::string>> http_headers_;
+
+	/* intermediate pipe for splice(), created on first use */
+	int splice_pipe_[2];
+
+	/*
+	 * With response offloading, the socket is non-blocking.  Once the
+	 * frontend stops reading, the rest of the response goes into a memfd
+	 * which a sender process then drains, unless the response is being
+	 * streamed.
+	 */
+	bool offload_;
+	bool offload_allowed_;
+	int spool_fd_;
+	int64_t spool_size_;
+
+	/*
+	 * The response is written out by the worker itself once its spool
+	 * reaches max_spool_size_, or the spool and everything the senders still
+	 * hold reach max_spool_total_.
+	 */
+	int64_t max_spool_size_;
+	int64_t max_spool_total_;
+	const BPSGISharedMemory *shmem_;
+
+	std::vector<char> inbuf_;
+	size_t inbuf_start_;
+	size_t inbuf_end_;
+
+	/* data read from the connection by the dispatcher; see Adopt */
+	std::string preread_;
+	size_t preread_pos_;
+
+	/*
+	 * Output which hasn't been written to the socket yet.  The last
+	 * FCGI_STDOUT record in the buffer is left open for more data until the
+	 * buffer is flushed; its header starts at outbuf_record_start_.
+	 */
+	size_t output_buffer_size_;
+	std::string outbuf_;
+	size_t outbuf_record_start_;
+	uint16_t outbuf_record_request_id_;
+};
+
+/*
+ * Answers requests for files in the --static directories without calling the
+ * application, sending the files with sendfile().  Every worker keeps its own
+ * cache of open files, revalidated against the file system once a second.
+ */
+class BPSGIStaticFiles {
+public:
+	BPSGIStaticFiles(const std::vector<BPSGIStaticMapping> &mappings);
+	~BPSGIStaticFiles();
+
+	bool Serve(BPSGIRequest &request);
+
+private:
+	struct CachedFile {
+		/* -1 if the file doesn't exist or isn't a regular file */
+		int fd;
+		struct stat st;
+		int64_t checked_at;
+		/* the entry's position in lru_ */
+		std::list<std::string>::iterator lru;
+	};
+
+	bool MapPath(BPSGIRequest &request);
+	const CachedFile &LookUp(const std::string &path);
+	void ClearCache();
+
+private:
+	const std::vector<BPSGIStaticMapping> &mappings_;
+	/* open files, and their paths, most recently used first */
+	std::unordered_map<std::string, CachedFile> cache_;
+	std::list<std::string> lru_;
+	size_t max_open_files_;
+	/* when paths were last found not to be regular files */
+	std::unordered_map<std::string, int64_t> misses_;
+	/* what LookUp returns for those */
+	CachedFile no_file_;
+	/* the file system path of the requested file, while serving a request */
+	std::string path_;
+	std::string gzip_path_;
 };
 
 class BPSGIWorker {
 public:
+	/* exit code of a worker which retired itself through psgix.harakiri.commit */
+	static const int harakiri_exit_code = 98;
+	/* exit code of a worker which was over its memory limit from the start */
+	static const int memory_limit_exit_code = 97;
 
 public:
 	BPSGIWorker(BPSGIMainApplication *mainapp, WorkerNo workerno);
@@ -304,10 +1156,39 @@ public:
 
 private:
 	void MainLoopIteration(BPSGIPerlCallbackFunction &main_callback);
+	bool WaitForNextRequest();
+	bool ReceiveConnection();
+	void ReturnConnection();
+	void OffloadResponse();
+	bool CheckQueueDeadline();
+	void OpenMemoryFiles();
+	bool MemoryLimitExceeded(bool check_smaps);
 
 private:
 	BPSGIMainApplication *mainapp_;
 	WorkerNo workerno_;
+	BPSGIWorkerStats *stats_;
+
+	BPSGIConnection conn_;
+	BPSGIRequest request_;
+	BPSGIStaticFiles static_files_;
+
+	/* with --dispatcher, whether the dispatcher knows we're idle */
+	bool ready_sent_;
+	/* with --dispatcher, whether we've told the dispatcher we're retiring */
+	bool retiring_sent_;
+	std::vector<char> dispatch_buffer_;
+
+	/* requests served by this process, and how many it may serve, or 0 */
+	int64_t requests_served_;
+	int64_t max_requests_;
+
+	/* /proc/self/statm and /proc/self/smaps_rollup, if we have memory limits */
+	int statm_fd_;
+	int smaps_fd_;
+	int64_t page_size_;
+	/* whether we were over the memory limit before serving any requests */
+	bool over_limit_at_start_;
 };
 
 class BPSGIAuxiliaryProcess {
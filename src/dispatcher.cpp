@@ -0,0 +1,664 @@
+#include "bladepsgi.hpp"
+
+#include <algorithm>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+
+/*
+ * What an epoll event refers to is kept in the upper half of its data; the
+ * lower half is the file descriptor, or the worker number for channels.
+ */
+#define DISPATCHER_TAG_LISTEN		((uint64_t) 1 << 32)
+#define DISPATCHER_TAG_CHANNEL		((uint64_t) 2 << 32)
+#define DISPATCHER_TAG_CONNECTION	((uint64_t) 3 << 32)
+
+/* connections sending more than this without completing the parameters are dropped */
+#define DISPATCHER_MAX_HEADER_SIZE	(16 * 1024 * 1024)
+
+int64_t
+BPSGIMonotonicTimeUsec()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		throw SyscallException("clock_gettime", errno);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Sends a message over a dispatcher channel, passing the file descriptors in
+ * fds along with it.  The channels are SOCK_SEQPACKET, so the message either
+ * goes out as a whole or not at all.
+ */
+void
+BPSGISendDispatchMessage(int sockfd, const BPSGIDispatchMessage &msg, const char *data, size_t datalen, const int *fds, int nfds)
+{
+	struct iovec iov[2];
+	iov[0].iov_base = (void *) &msg;
+	iov[0].iov_len = sizeof(msg);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = datalen;
+
+	char control[CMSG_SPACE(sizeof(int) * 2)];
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = datalen > 0 ? 2 : 1;
+
+	Assert(nfds >= 0 && nfds <= 2);
+	if (nfds > 0)
+	{
+		memset(control, 0, sizeof(control));
+		mh.msg_control = control;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	for (;;)
+	{
+		ssize_t ret = sendmsg(sockfd, &mh, MSG_NOSIGNAL);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			throw SyscallException("sendmsg", errno);
+		}
+		return;
+	}
+}
+
+/*
+ * Receives a message from a dispatcher channel.  data must have room for the
+ * largest inline read-ahead, and fds for two file descriptors.  Returns false
+ * if the call was interrupted by a signal, or if the socket is non-blocking and
+ * there was nothing to receive.
+ */
+bool
+BPSGIReceiveDispatchMessage(int sockfd, BPSGIDispatchMessage *msg, std::vector<char> &data, int *fds, int *nfds)
+{
+	struct iovec iov[2];
+	iov[0].iov_base = (void *) msg;
+	iov[0].iov_len = sizeof(*msg);
+	iov[1].iov_base = data.data();
+	iov[1].iov_len = data.size();
+
+	char control[CMSG_SPACE(sizeof(int) * 2)];
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+
+	ssize_t ret = recvmsg(sockfd, &mh, MSG_CMSG_CLOEXEC);
+	if (ret == -1)
+	{
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+			return false;
+		throw SyscallException("recvmsg", errno);
+	}
+
+	*nfds = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int n = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		memcpy(fds + *nfds, CMSG_DATA(cmsg), sizeof(int) * n);
+		*nfds += n;
+	}
+
+	if ((size_t) ret < sizeof(*msg) || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0)
+	{
+		for (int i = 0; i < *nfds; i++)
+			(void) close(fds[i]);
+		throw RuntimeException("received a malformed message from the dispatcher channel");
+	}
+	if ((size_t) ret - sizeof(*msg) != ((msg->flags & DISPATCH_PREREAD_MEMFD) ? 0 : msg->preread_len))
+	{
+		for (int i = 0; i < *nfds; i++)
+			(void) close(fds[i]);
+		throw RuntimeException("unexpected message length %d from the dispatcher channel", (int) ret);
+	}
+	return true;
+}
+
+
+BPSGIDispatcher::BPSGIDispatcher(BPSGIMainApplication *mainapp)
+	: mainapp_(mainapp),
+	  stats_(mainapp->shmem()->DispatcherStats()),
+	  epollfd_(-1),
+	  read_ahead_limit_((size_t) mainapp->options().input_spool_threshold),
+	  idle_timeout_usec_((int64_t) (mainapp->options().keepalive_timeout > 0 ? mainapp->options().keepalive_timeout : 60) * 1000000),
+	  shed_queue_age_usec_((int64_t) mainapp->options().shed_queue_age * 1000),
+	  worker_status_data_(mainapp->nworkers()),
+	  ready_queues_(mainapp->lanes().size()),
+	  worker_idle_(mainapp->nworkers(), false),
+	  message_buffer_(DISPATCH_INLINE_PREREAD_MAX)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%d", mainapp->options().shed_retry_after);
+	shed_response_headers_ =
+		"Status: 503 Service Unavailable\r\n"
+		"Content-Type: text/plain\r\n"
+		"Retry-After: " + std::string(buf) + "\r\n";
+	http_shed_response_headers_ =
+		"Content-Type: text/plain\r\n"
+		"Retry-After: " + std::string(buf) + "\r\n";
+}
+
+BPSGIDispatcher::~BPSGIDispatcher()
+{
+	for (auto && entry : connections_)
+		(void) close(entry.first);
+	if (epollfd_ != -1)
+		(void) close(epollfd_);
+}
+
+void
+BPSGIDispatcher::WatchFd(int fd, uint64_t tag)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = tag;
+	if (epoll_ctl(epollfd_, EPOLL_CTL_ADD, fd, &ev) == -1)
+		throw SyscallException("epoll_ctl", errno);
+}
+
+void
+BPSGIDispatcher::AcceptConnections(int listen_sockfd)
+{
+	/* the listen sockets are non-blocking; take everything that's there */
+	for (;;)
+	{
+		int fd = accept4(listen_sockfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+				return;
+			else if (errno == EMFILE || errno == ENFILE)
+			{
+				mainapp_->Log(LS_WARNING, "dispatcher could not accept a connection: %s", strerror(errno));
+				return;
+			}
+			throw SyscallException("accept4", errno);
+		}
+
+		size_t lane = listen_lanes_[listen_sockfd];
+		if (mainapp_->lanes()[lane].is_tcp)
+		{
+			int on = 1;
+			(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		}
+		std::atomic_fetch_add(&stats_->connections, (int64_t) 1);
+		AddConnection(fd, lane, 0);
+	}
+}
+
+void
+BPSGIDispatcher::AddConnection(int sockfd, size_t lane, int64_t connection_requests)
+{
+	auto conn = make_unique<Connection>();
+	conn->sockfd = sockfd;
+	conn->lane = lane;
+	memset(&conn->scan, 0, sizeof(conn->scan));
+	conn->connection_requests = connection_requests;
+	conn->last_activity = BPSGIMonotonicTimeUsec();
+	conn->queued = false;
+
+	WatchFd(sockfd, DISPATCHER_TAG_CONNECTION | (uint32_t) sockfd);
+	connections_[sockfd] = std::move(conn);
+	std::atomic_fetch_add(&stats_->open_connections, (int64_t) 1);
+}
+
+void
+BPSGIDispatcher::CloseConnection(Connection *conn)
+{
+	int sockfd = conn->sockfd;
+
+	/* closing the socket takes it out of the epoll set as well */
+	(void) close(sockfd);
+	connections_.erase(sockfd);
+	std::atomic_fetch_sub(&stats_->open_connections, (int64_t) 1);
+}
+
+/*
+ * Reads whatever the frontend has sent on the connection, and queues the
+ * connection for a worker once enough of the request is here.  The socket is
+ * left in blocking mode for the worker's sake, so the reads here are done with
+ * MSG_DONTWAIT.
+ */
+void
+BPSGIDispatcher::ReadFromConnection(Connection *conn)
+{
+	char buf[65536];
+
+	for (;;)
+	{
+		ssize_t ret = recv(conn->sockfd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (ret == 0)
+		{
+			/* the frontend closed the connection between requests */
+			CloseConnection(conn);
+			return;
+		}
+		else if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			else if (errno == ECONNRESET)
+			{
+				CloseConnection(conn);
+				return;
+			}
+			throw SyscallException("recv", errno);
+		}
+
+		conn->data.append(buf, (size_t) ret);
+		if (mainapp_->lanes()[conn->lane].protocol == PROTOCOL_HTTP)
+			BPSGIHTTPScan(conn->data.data(), conn->data.size(), &conn->scan);
+		else if (mainapp_->lanes()[conn->lane].protocol == PROTOCOL_UWSGI)
+			BPSGIUWSGIScan(conn->data.data(), conn->data.size(), &conn->scan);
+		else
+			BPSGIFastCGIScan(conn->data.data(), conn->data.size(), &conn->scan);
+		if (conn->scan.complete ||
+			(conn->scan.params_complete && conn->data.size() >= read_ahead_limit_))
+			break;
+		if (conn->data.size() > DISPATCHER_MAX_HEADER_SIZE)
+		{
+			mainapp_->Log(LS_WARNING, "dispatcher closing a connection: request headers exceed %d bytes", DISPATCHER_MAX_HEADER_SIZE);
+			CloseConnection(conn);
+			return;
+		}
+	}
+
+	conn->last_activity = BPSGIMonotonicTimeUsec();
+
+	/*
+	 * Large request bodies aren't worth holding up the request for; the
+	 * worker reads the rest from the socket.
+	 */
+	if (conn->scan.complete ||
+		(conn->scan.params_complete && conn->data.size() >= read_ahead_limit_))
+	{
+		if (epoll_ctl(epollfd_, EPOLL_CTL_DEL, conn->sockfd, NULL) == -1)
+			throw SyscallException("epoll_ctl", errno);
+		QueueRequest(conn);
+	}
+}
+
+/*
+ * Puts a request which is ready for a worker into the queue of its lane,
+ * unless one of the load shedding limits says it should be turned away.  The
+ * limits apply to each lane separately.
+ */
+void
+BPSGIDispatcher::QueueRequest(Connection *conn)
+{
+	auto &options = mainapp_->options();
+	auto &ready_queue = ready_queues_[conn->lane];
+
+	if (!conn->scan.exceptional && conn->scan.request_id != 0)
+	{
+		if (options.shed_queue_depth > 0 && ready_queue.size() >= (size_t) options.shed_queue_depth)
+		{
+			ShedRequest(conn, &stats_->shed_queue_depth);
+			return;
+		}
+		else if (options.shed_busy_ratio > 0 && BusyRatioExceeded(mainapp_->lanes()[conn->lane]))
+		{
+			ShedRequest(conn, &stats_->shed_busy_ratio);
+			return;
+		}
+	}
+
+	conn->queued = true;
+	ready_queue.push_back(conn);
+	std::atomic_fetch_add(&stats_->queued_requests, (int64_t) 1);
+}
+
+/*
+ * Checks the statuses of the lane's workers against --shed-busy-ratio.
+ * Workers waiting for the dispatcher are idle; everything else counts as busy.
+ * With autoscaling, empty worker slots don't count at all.
+ */
+bool
+BPSGIDispatcher::BusyRatioExceeded(const BPSGILane &lane)
+{
+	int busy = 0;
+	int running = 0;
+
+	mainapp_->shmem()->GetAllWorkerStatuses(mainapp_->nworkers(), worker_status_data_.data());
+	for (int i = 0; i < lane.nworkers; i++)
+	{
+		char status = worker_status_data_[(size_t) (lane.first_worker + i)];
+		if (status == WORKER_STATUS_NO_PROCESS)
+			continue;
+		running++;
+		if (status != '_')
+			busy++;
+	}
+	return busy * 100 >= mainapp_->options().shed_busy_ratio * running;
+}
+
+/*
+ * Answers the request with a 503 without involving a worker.  If the whole
+ * request has been read and the frontend wants to keep the connection, we
+ * wait for the next request on it; otherwise the connection is closed.
+ */
+void
+BPSGIDispatcher::ShedRequest(Connection *conn, std::atomic<int64_t> *counter)
+{
+	std::string response;
+	bool keep_conn = conn->scan.keep_conn &&
+		conn->scan.complete &&
+		conn->scan.offset == conn->data.size();
+
+	if (mainapp_->lanes()[conn->lane].protocol != PROTOCOL_FASTCGI)
+		BPSGIHTTPBuildResponse(response, 503, http_shed_response_headers_, "Service Unavailable\n", keep_conn);
+	else
+		BPSGIFastCGIBuildResponse(response, conn->scan.request_id, shed_response_headers_, "Service Unavailable\n");
+	std::atomic_fetch_add(counter, (int64_t) 1);
+
+	ssize_t ret;
+	do {
+		ret = send(conn->sockfd, response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret != (ssize_t) response.size() || !keep_conn)
+	{
+		CloseConnection(conn);
+		return;
+	}
+
+	conn->data.clear();
+	memset(&conn->scan, 0, sizeof(conn->scan));
+	conn->connection_requests++;
+	conn->last_activity = BPSGIMonotonicTimeUsec();
+	WatchFd(conn->sockfd, DISPATCHER_TAG_CONNECTION | (uint32_t) conn->sockfd);
+}
+
+/*
+ * Turns away requests which have been waiting longer than --shed-queue-age.
+ * The queue is in the order the requests became ready, so only its head has
+ * to be looked at.
+ */
+void
+BPSGIDispatcher::ShedExpiredRequests(int64_t now)
+{
+	for (auto && ready_queue : ready_queues_)
+	{
+		while (!ready_queue.empty())
+		{
+			Connection *conn = ready_queue.front();
+			if (now - conn->last_activity < shed_queue_age_usec_)
+				break;
+			/* nothing sensible to answer; let a worker take care of it */
+			if (conn->scan.exceptional || conn->scan.request_id == 0)
+				break;
+
+			ready_queue.pop_front();
+			conn->queued = false;
+			std::atomic_fetch_sub(&stats_->queued_requests, (int64_t) 1);
+			ShedRequest(conn, &stats_->shed_queue_age);
+		}
+	}
+}
+
+void
+BPSGIDispatcher::HandleWorkerMessage(WorkerNo workerno)
+{
+	int channel = mainapp_->dispatcher_channel(workerno, false);
+	BPSGIDispatchMessage msg;
+	int fds[2];
+	int nfds;
+
+	if (!BPSGIReceiveDispatchMessage(channel, &msg, message_buffer_, fds, &nfds))
+		return;
+
+	if (msg.flags & DISPATCH_WORKER_READY)
+		worker_idle_[(size_t) workerno] = true;
+	else if (msg.flags & DISPATCH_WORKER_RETIRING)
+	{
+		BPSGIDispatchMessage ack;
+
+		/* the worker exits once it sees this */
+		worker_idle_[(size_t) workerno] = false;
+		memset(&ack, 0, sizeof(ack));
+		ack.flags = DISPATCH_WORKER_RETIRING;
+		BPSGISendDispatchMessage(channel, ack, NULL, 0, NULL, 0);
+	}
+
+	if (msg.flags & DISPATCH_CONNECTION)
+	{
+		if (nfds != 1)
+		{
+			for (int i = 0; i < nfds; i++)
+				(void) close(fds[i]);
+			throw RuntimeException("worker %d returned a connection without a file descriptor", (int) workerno);
+		}
+		AddConnection(fds[0], mainapp_->worker_lane_index(workerno), msg.connection_requests);
+	}
+	else
+	{
+		for (int i = 0; i < nfds; i++)
+			(void) close(fds[i]);
+	}
+}
+
+/*
+ * Hands a complete request to a worker.  Returns false if the worker couldn't
+ * take it, in which case the request stays in the queue.
+ */
+bool
+BPSGIDispatcher::DispatchRequest(Connection *conn, WorkerNo workerno)
+{
+	BPSGIDispatchMessage msg;
+	int fds[2];
+	int nfds = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.flags = DISPATCH_CONNECTION;
+	msg.preread_len = (uint32_t) conn->data.size();
+	msg.connection_requests = conn->connection_requests;
+	msg.ready_at = conn->last_activity;
+
+	fds[nfds++] = conn->sockfd;
+
+	const char *inline_data = conn->data.data();
+	size_t inline_len = conn->data.size();
+	if (inline_len > DISPATCH_INLINE_PREREAD_MAX)
+	{
+		int memfd = memfd_create("bladepsgi-preread", MFD_CLOEXEC);
+		if (memfd == -1)
+			throw SyscallException("memfd_create", errno);
+
+		const char *p = inline_data;
+		size_t left = inline_len;
+		while (left > 0)
+		{
+			ssize_t ret = write(memfd, p, left);
+			if (ret == -1)
+			{
+				if (errno == EINTR)
+					continue;
+				(void) close(memfd);
+				throw SyscallException("write", errno);
+			}
+			p += ret;
+			left -= (size_t) ret;
+		}
+		msg.flags |= DISPATCH_PREREAD_MEMFD;
+		fds[nfds++] = memfd;
+		inline_data = NULL;
+		inline_len = 0;
+	}
+
+	bool sent = true;
+	try {
+		BPSGISendDispatchMessage(mainapp_->dispatcher_channel(workerno, false), msg, inline_data, inline_len, fds, nfds);
+	} catch (const SyscallException &ex) {
+		mainapp_->Log(LS_WARNING, "could not dispatch a request to worker %d: system call %s failed: %s", (int) workerno, ex.syscall(), ex.strerror());
+		sent = false;
+	}
+	if (nfds == 2)
+		(void) close(fds[1]);
+	worker_idle_[(size_t) workerno] = false;
+	if (!sent)
+		return false;
+
+	/* the worker has its own copy of the socket now */
+	CloseConnection(conn);
+	return true;
+}
+
+void
+BPSGIDispatcher::DispatchRequests()
+{
+	auto &lanes = mainapp_->lanes();
+
+	for (size_t i = 0; i < lanes.size(); i++)
+	{
+		auto &ready_queue = ready_queues_[i];
+		WorkerNo workerno = lanes[i].first_worker;
+		WorkerNo end = lanes[i].first_worker + lanes[i].nworkers;
+
+		while (!ready_queue.empty())
+		{
+			/*
+			 * Always prefer the lowest-numbered idle worker of the lane;
+			 * that keeps the set of busy workers, and their memory, as small
+			 * as possible.
+			 */
+			while (workerno < end && !worker_idle_[(size_t) workerno])
+				workerno++;
+			if (workerno == end)
+				break;
+
+			Connection *conn = ready_queue.front();
+			if (!DispatchRequest(conn, workerno))
+				continue;
+			ready_queue.pop_front();
+			std::atomic_fetch_sub(&stats_->queued_requests, (int64_t) 1);
+			std::atomic_fetch_add(&stats_->requests, (int64_t) 1);
+		}
+	}
+}
+
+/*
+ * Closes connections on which the frontend hasn't sent anything in a while.
+ * Connections waiting in the queue are left alone.
+ */
+void
+BPSGIDispatcher::CloseIdleConnections(int64_t now)
+{
+	std::vector<Connection *> expired;
+
+	for (auto && entry : connections_)
+	{
+		Connection *conn = entry.second.get();
+		if (!conn->queued && now - conn->last_activity >= idle_timeout_usec_)
+			expired.push_back(conn);
+	}
+	for (auto conn : expired)
+		CloseConnection(conn);
+}
+
+int
+BPSGIDispatcher::Run()
+{
+	epollfd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd_ == -1)
+		throw SyscallException("epoll_create1", errno);
+
+	auto &lanes = mainapp_->lanes();
+	for (size_t i = 0; i < lanes.size(); i++)
+	{
+		for (int sockfd : lanes[i].sockfds)
+		{
+			int flags = fcntl(sockfd, F_GETFL);
+			if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1)
+				throw SyscallException("fcntl", errno);
+			listen_lanes_[sockfd] = i;
+			WatchFd(sockfd, DISPATCHER_TAG_LISTEN | (uint32_t) sockfd);
+		}
+	}
+	for (WorkerNo workerno = 0; workerno < mainapp_->nworkers(); workerno++)
+		WatchFd(mainapp_->dispatcher_channel(workerno, false), DISPATCHER_TAG_CHANNEL | (uint32_t) workerno);
+
+	int64_t last_idle_check = BPSGIMonotonicTimeUsec();
+	struct epoll_event events[64];
+
+	for (;;)
+	{
+		if (mainapp_->RunnerDied())
+		{
+			if (mainapp_->shmem()->SetShouldExitImmediately())
+				mainapp_->Log(LS_FATAL, "dispatcher process noticed that the parent process has died; terminating all processes");
+			_exit(1);
+		}
+
+		/* wake up in time to turn away the oldest requests, if necessary */
+		int timeout = 1000;
+		for (auto && ready_queue : ready_queues_)
+		{
+			if (shed_queue_age_usec_ == 0 || ready_queue.empty())
+				continue;
+			int64_t expires = ready_queue.front()->last_activity + shed_queue_age_usec_ - BPSGIMonotonicTimeUsec();
+			timeout = (int) std::max((int64_t) 1, std::min((int64_t) timeout, expires / 1000 + 1));
+		}
+
+		int nevents = epoll_wait(epollfd_, events, (int) (sizeof(events) / sizeof(events[0])), timeout);
+		if (nevents == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			throw SyscallException("epoll_wait", errno);
+		}
+
+		for (int i = 0; i < nevents; i++)
+		{
+			uint64_t tag = events[i].data.u64 & ~(uint64_t) 0xFFFFFFFF;
+			uint32_t value = (uint32_t) events[i].data.u64;
+
+			if (tag == DISPATCHER_TAG_LISTEN)
+				AcceptConnections((int) value);
+			else if (tag == DISPATCHER_TAG_CHANNEL)
+				HandleWorkerMessage((WorkerNo) value);
+			else if (tag == DISPATCHER_TAG_CONNECTION)
+			{
+				/* might have been dispatched or closed by an earlier event */
+				auto iter = connections_.find((int) value);
+				if (iter != connections_.end() && !iter->second->queued)
+					ReadFromConnection(iter->second.get());
+			}
+			else
+				abort();
+		}
+
+		DispatchRequests();
+
+		int64_t now = BPSGIMonotonicTimeUsec();
+		if (shed_queue_age_usec_ > 0)
+			ShedExpiredRequests(now);
+		if (now - last_idle_check >= 1000000)
+		{
+			CloseIdleConnections(now);
+			last_idle_check = now;
+		}
+	}
+}
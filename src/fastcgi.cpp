@@ -0,0 +1,1497 @@
+#include "bladepsgi.hpp"
+
+#include <algorithm>
+
+#include <poll.h>
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * Definitions from the FastCGI specification.  We only implement the
+ * Responder role, and we never multiplex requests over a single connection.
+ */
+#define FCGI_VERSION_1				1
+#define FCGI_HEADER_LEN				8
+#define FCGI_MAX_CONTENT_LEN		65535
+
+#define FCGI_BEGIN_REQUEST			1
+#define FCGI_ABORT_REQUEST			2
+#define FCGI_END_REQUEST			3
+#define FCGI_PARAMS					4
+#define FCGI_STDIN					5
+#define FCGI_STDOUT					6
+#define FCGI_STDERR					7
+#define FCGI_DATA					8
+#define FCGI_GET_VALUES				9
+#define FCGI_GET_VALUES_RESULT		10
+#define FCGI_UNKNOWN_TYPE			11
+
+#define FCGI_KEEP_CONN				1
+
+#define FCGI_RESPONDER				1
+
+#define FCGI_REQUEST_COMPLETE		0
+#define FCGI_CANT_MPX_CONN			1
+#define FCGI_OVERLOADED				2
+#define FCGI_UNKNOWN_ROLE			3
+
+/* large enough to hold the longest possible record */
+static const size_t fastcgi_input_buffer_size = FCGI_HEADER_LEN + FCGI_MAX_CONTENT_LEN + 255;
+
+/*
+ * HTTP chunk headers are written with a fixed width, so that room for them can
+ * be left in the output buffer before the size of the chunk is known.
+ */
+#define HTTP_CHUNK_HEADER_LEN		10
+#define HTTP_MAX_CHUNK_LEN			((int64_t) 1 << 30)
+
+static void
+fastcgi_fill_header(char *hdr, uint8_t type, uint16_t request_id, size_t content_length)
+{
+	Assert(content_length <= FCGI_MAX_CONTENT_LEN);
+
+	hdr[0] = FCGI_VERSION_1;
+	hdr[1] = (char) type;
+	hdr[2] = (char) ((request_id >> 8) & 0xFF);
+	hdr[3] = (char) (request_id & 0xFF);
+	hdr[4] = (char) ((content_length >> 8) & 0xFF);
+	hdr[5] = (char) (content_length & 0xFF);
+	hdr[6] = 0;
+	hdr[7] = 0;
+}
+
+/*
+ * Decodes a single name-value pair length.  Returns false if the length
+ * doesn't fit into the remaining input.
+ */
+static bool
+fastcgi_decode_length(const char **p, const char *end, size_t *len)
+{
+	const unsigned char *q = (const unsigned char *) *p;
+
+	if ((const char *) q >= end)
+		return false;
+	if ((q[0] & 0x80) == 0)
+	{
+		*len = q[0];
+		*p += 1;
+		return true;
+	}
+	if ((const char *) q + 4 > end)
+		return false;
+	*len = ((size_t) (q[0] & 0x7F) << 24) | ((size_t) q[1] << 16) | ((size_t) q[2] << 8) | (size_t) q[3];
+	*p += 4;
+	return true;
+}
+
+static void
+fastcgi_encode_length(std::vector<char> &out, size_t len)
+{
+	if (len < 128)
+		out.push_back((char) len);
+	else
+	{
+		out.push_back((char) (((len >> 24) & 0x7F) | 0x80));
+		out.push_back((char) ((len >> 16) & 0xFF));
+		out.push_back((char) ((len >> 8) & 0xFF));
+		out.push_back((char) (len & 0xFF));
+	}
+}
+
+static void
+fastcgi_encode_pair(std::string &out, const char *name, const char *value)
+{
+	size_t namelen = strlen(name);
+	size_t valuelen = strlen(value);
+
+	/* only used for short management values */
+	Assert(namelen < 128 && valuelen < 128);
+	out.push_back((char) namelen);
+	out.push_back((char) valuelen);
+	out.append(name, namelen);
+	out.append(value, valuelen);
+}
+
+
+BPSGIRequest::BPSGIRequest(BPSGIConnection *conn, size_t input_spool_threshold, int stream_flush_interval_ms)
+	: conn_(conn),
+	  request_id_(0),
+	  keep_conn_(false),
+	  params_complete_(false),
+	  http_version_(11),
+	  http_head_(false),
+	  response_status_(0),
+	  response_content_length_(-1),
+	  input_(conn, this, input_spool_threshold),
+	  writer_(conn, this, stream_flush_interval_ms)
+{
+	header_buffer_.reserve(4096);
+}
+
+/*
+ * Returns the writer for a streaming response.  Streamed output has to reach
+ * the client as it's written, so it's never offloaded.
+ */
+BPSGIStreamWriter *
+BPSGIRequest::StartStreaming()
+{
+	conn_->DisallowOffload();
+	return &writer_;
+}
+
+void
+BPSGIRequest::Reset()
+{
+	request_id_ = 0;
+	keep_conn_ = false;
+	params_complete_ = false;
+	http_version_ = 11;
+	http_head_ = false;
+	response_status_ = 0;
+	response_content_length_ = -1;
+	params_data_.clear();
+	params_.clear();
+	input_.Reset();
+	writer_.Reset();
+}
+
+/*
+ * Decodes the FCGI_PARAMS stream into name-value pairs.  The pairs point
+ * directly into params_data_, so it must not be modified afterwards.
+ */
+void
+BPSGIRequest::DecodeParams()
+{
+	const char *p = params_data_.data();
+	const char *end = p + params_data_.size();
+
+	while (p < end)
+	{
+		BPSGIRequestParam param;
+
+		if (!fastcgi_decode_length(&p, end, &param.namelen) ||
+			!fastcgi_decode_length(&p, end, &param.valuelen))
+			throw RuntimeException("invalid name-value pair length in FastCGI parameters");
+		if (param.namelen > (size_t) (end - p) ||
+			param.valuelen > (size_t) (end - p) - param.namelen)
+			throw RuntimeException("FastCGI parameter extends past the end of the parameter stream");
+
+		param.name = p;
+		p += param.namelen;
+		param.value = p;
+		p += param.valuelen;
+		params_.push_back(param);
+	}
+}
+
+/*
+ * Appends a parameter to the parameter stream, for protocols other than
+ * FastCGI.  DecodeParams has to be called once they've all been added.
+ */
+void
+BPSGIRequest::AddParam(const char *name, size_t namelen, const char *value, size_t valuelen)
+{
+	fastcgi_encode_length(params_data_, namelen);
+	fastcgi_encode_length(params_data_, valuelen);
+	params_data_.insert(params_data_.end(), name, name + namelen);
+	params_data_.insert(params_data_.end(), value, value + valuelen);
+}
+
+const char *
+BPSGIRequest::FindParam(const char *name, size_t *valuelen) const
+{
+	size_t namelen = strlen(name);
+
+	for (auto && param : params_)
+	{
+		if (param.namelen == namelen && memcmp(param.name, name, namelen) == 0)
+		{
+			*valuelen = param.valuelen;
+			return param.value;
+		}
+	}
+	return NULL;
+}
+
+bool
+BPSGIRequest::Write(const char *data, size_t len)
+{
+	return conn_->WriteStdout(request_id_, data, len);
+}
+
+bool
+BPSGIRequest::Flush()
+{
+	return conn_->Flush();
+}
+
+int
+BPSGIRequest::SendFile(int fd, int64_t offset)
+{
+	return conn_->SendFile(request_id_, fd, offset);
+}
+
+/*
+ * The response header block is serialized into header_buffer_, which keeps
+ * its allocation from one request to the next.
+ */
+void
+BPSGIRequest::BeginResponseHeaders(int status)
+{
+	if (conn_->protocol() != PROTOCOL_FASTCGI)
+	{
+		BeginHTTPResponseHeaders(status);
+		return;
+	}
+
+	size_t len;
+	const char *line = BPSGIStatusLine(status, &len);
+
+	header_buffer_.clear();
+	if (line != NULL)
+		header_buffer_.append(line, len);
+	else
+	{
+		char buf[32];
+		int n = snprintf(buf, sizeof(buf), "Status: %d \r\n", status);
+		header_buffer_.append(buf, (size_t) n);
+	}
+}
+
+/*
+ * Checks that a response header can be passed on as it is: the name must be
+ * a token, and the value can't contain control characters other than tabs.
+ * A CR or LF would otherwise let the application's input add headers of its
+ * own, or end the headers early.
+ */
+static bool
+fastcgi_valid_response_header(const char *name, size_t namelen, const char *value, size_t valuelen)
+{
+	if (namelen == 0)
+		return false;
+	for (size_t i = 0; i < namelen; i++)
+	{
+		unsigned char c = (unsigned char) name[i];
+		if (!(c >= '0' && c <= '9') && !(c >= 'A' && c <= 'Z') && !(c >= 'a' && c <= 'z') &&
+			(c == '\0' || strchr("!#$%&'*+-.^_`|~", c) == NULL))
+			return false;
+	}
+	for (size_t i = 0; i < valuelen; i++)
+	{
+		unsigned char c = (unsigned char) value[i];
+		if ((c < 0x20 && c != '\t') || c == 0x7f)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Adds a response header.  Returns false, without adding anything, if the
+ * header isn't valid.
+ */
+bool
+BPSGIRequest::AddResponseHeader(const char *name, size_t namelen, const char *value, size_t valuelen)
+{
+	if (!fastcgi_valid_response_header(name, namelen, value, valuelen))
+		return false;
+
+	if (conn_->protocol() != PROTOCOL_FASTCGI)
+	{
+		AddHTTPResponseHeader(name, namelen, value, valuelen);
+		return true;
+	}
+
+	header_buffer_.append(name, namelen);
+	header_buffer_.append(": ", 2);
+	header_buffer_.append(value, valuelen);
+	header_buffer_.append("\r\n", 2);
+	return true;
+}
+
+bool
+BPSGIRequest::FinishResponseHeaders()
+{
+	if (conn_->protocol() != PROTOCOL_FASTCGI)
+		return FinishHTTPResponseHeaders();
+
+	header_buffer_.append("\r\n", 2);
+	return Write(header_buffer_.data(), header_buffer_.size());
+}
+
+
+BPSGIConnection::BPSGIConnection(BPSGIProtocol protocol, size_t output_buffer_size, bool offload,
+								 int64_t max_spool_size, int64_t max_spool_total, const BPSGISharedMemory *shmem)
+	: protocol_(protocol),
+	  sockfd_(-1),
+	  broken_(false),
+	  http_framing_(HTTP_FRAMING_RAW),
+	  http_response_started_(false),
+	  http_response_length_(-1),
+	  http_response_written_(0),
+	  http_body_chunked_(false),
+	  http_body_done_(true),
+	  http_body_remaining_(0),
+	  http_chunk_crlf_pending_(false),
+	  http_expect_continue_(false),
+	  http_addresses_known_(false),
+	  offload_(offload),
+	  offload_allowed_(offload),
+	  spool_fd_(-1),
+	  spool_size_(0),
+	  max_spool_size_(max_spool_size),
+	  max_spool_total_(max_spool_total),
+	  shmem_(shmem),
+	  inbuf_(fastcgi_input_buffer_size),
+	  inbuf_start_(0),
+	  inbuf_end_(0),
+	  preread_pos_(0),
+	  output_buffer_size_(output_buffer_size),
+	  outbuf_record_start_(std::string::npos),
+	  outbuf_record_request_id_(0)
+{
+	outbuf_.reserve(output_buffer_size_ + FCGI_HEADER_LEN * 4);
+	splice_pipe_[0] = -1;
+	splice_pipe_[1] = -1;
+}
+
+BPSGIConnection::~BPSGIConnection()
+{
+	Close();
+	CloseSplicePipe();
+}
+
+/*
+ * Waits until the socket is ready for the given poll events.  Only needed
+ * with offloading, which makes the socket non-blocking.
+ */
+void
+BPSGIConnection::WaitForSocket(short events)
+{
+	struct pollfd pfd;
+
+	pfd.fd = sockfd_;
+	pfd.events = events;
+	pfd.revents = 0;
+	for (;;)
+	{
+		int ret = poll(&pfd, 1, -1);
+		if (ret >= 0)
+			return;
+		else if (errno != EINTR)
+			throw SyscallException("poll", errno);
+	}
+}
+
+/*
+ * Called when the frontend isn't reading the response fast enough.  If the
+ * response may be offloaded, the rest of it goes into a memfd; otherwise, or
+ * if the senders are already holding as much as they may, we wait for the
+ * socket.
+ */
+void
+BPSGIConnection::HandleBlockedWrite()
+{
+	Assert(spool_fd_ == -1);
+
+	if (!offload_allowed_ || SpoolFull())
+	{
+		WaitForSocket(POLLOUT);
+		return;
+	}
+
+	spool_fd_ = memfd_create("bladepsgi-response", MFD_CLOEXEC);
+	if (spool_fd_ == -1)
+		throw SyscallException("memfd_create", errno);
+	spool_size_ = 0;
+}
+
+/*
+ * Returns whether the spool may not grow any further.  The other workers'
+ * spools aren't counted, so the total can be exceeded by up to one spool per
+ * worker, but not by slow frontends piling up responses in the senders.
+ */
+bool
+BPSGIConnection::SpoolFull() const
+{
+	if (spool_size_ >= max_spool_size_)
+		return true;
+	return spool_size_ + shmem_->OffloadedBytesInFlight() >= max_spool_total_;
+}
+
+/*
+ * Returns the file descriptor response output should be written to.  Spools
+ * which have grown too large are written out first, so a slow frontend can't
+ * make us use up all memory.
+ */
+int
+BPSGIConnection::OutputFd()
+{
+	if (spool_fd_ == -1)
+		return sockfd_;
+	else if (!SpoolFull())
+		return spool_fd_;
+
+	DrainSpool();
+	return sockfd_;
+}
+
+/*
+ * Writes out everything spooled so far to the socket, blocking as necessary.
+ */
+void
+BPSGIConnection::DrainSpool()
+{
+	if (spool_fd_ == -1)
+		return;
+
+	off_t off = 0;
+	while (off < (off_t) spool_size_ && !broken_)
+	{
+		ssize_t ret = sendfile(sockfd_, spool_fd_, &off, (size_t) (spool_size_ - off));
+		if (ret > 0)
+			continue;
+		else if (ret == 0 || errno == EPIPE || errno == ECONNRESET)
+			broken_ = true;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			WaitForSocket(POLLOUT);
+		else if (errno != EINTR)
+		{
+			broken_ = true;
+			throw SyscallException("sendfile", errno);
+		}
+	}
+	(void) close(spool_fd_);
+	spool_fd_ = -1;
+	spool_size_ = 0;
+}
+
+/*
+ * Makes sure the rest of the current response goes straight to the socket.
+ * Streaming responses can't wait until the application is done.
+ */
+void
+BPSGIConnection::DisallowOffload()
+{
+	offload_allowed_ = false;
+	DrainSpool();
+}
+
+/*
+ * If the response to the finished request is still (partly) waiting in the
+ * spool, hands the socket and the spool over to the caller, and forgets about
+ * the connection.  Returns false if everything has already been written.
+ */
+bool
+BPSGIConnection::TakeSpooledResponse(int *sockfd, int *spoolfd)
+{
+	if (spool_fd_ == -1 || sockfd_ == -1)
+		return false;
+
+	*sockfd = sockfd_;
+	*spoolfd = spool_fd_;
+	sockfd_ = -1;
+	spool_fd_ = -1;
+	spool_size_ = 0;
+	return true;
+}
+
+/*
+ * Accepts a new connection from the listen socket.  Returns false if the call
+ * was interrupted by a signal, in which case the caller should check whether
+ * it's been asked to exit before trying again.
+ */
+bool
+BPSGIConnection::Accept(int listen_sockfd, bool tcp)
+{
+	Assert(sockfd_ == -1);
+
+	int fd = accept4(listen_sockfd, NULL, NULL, offload_ ? SOCK_NONBLOCK : 0);
+	if (fd == -1)
+	{
+		if (errno == EINTR || errno == ECONNABORTED)
+			return false;
+		throw SyscallException("accept", errno);
+	}
+
+	/*
+	 * We do our own buffering, so whatever we write should go out right
+	 * away.  Failing to set this isn't worth dropping the connection over.
+	 */
+	if (tcp)
+	{
+		int on = 1;
+		(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+
+	sockfd_ = fd;
+	broken_ = false;
+	http_addresses_known_ = false;
+	inbuf_start_ = 0;
+	inbuf_end_ = 0;
+	preread_.clear();
+	preread_pos_ = 0;
+	outbuf_.clear();
+	outbuf_record_start_ = std::string::npos;
+	return true;
+}
+
+/*
+ * Takes over a connection the dispatcher accepted, along with whatever it has
+ * already read from it.  That data is consumed before anything more is read
+ * from the socket.
+ */
+void
+BPSGIConnection::Adopt(int sockfd, const char *preread, size_t preread_len)
+{
+	Assert(sockfd_ == -1);
+
+	if (offload_)
+	{
+		int flags = fcntl(sockfd, F_GETFL);
+		if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1)
+		{
+			(void) close(sockfd);
+			throw SyscallException("fcntl", errno);
+		}
+	}
+
+	sockfd_ = sockfd;
+	broken_ = false;
+	http_addresses_known_ = false;
+	inbuf_start_ = 0;
+	inbuf_end_ = 0;
+	preread_.assign(preread, preread_len);
+	preread_pos_ = 0;
+	outbuf_.clear();
+	outbuf_record_start_ = std::string::npos;
+}
+
+void
+BPSGIConnection::Close()
+{
+	if (spool_fd_ != -1)
+	{
+		(void) close(spool_fd_);
+		spool_fd_ = -1;
+		spool_size_ = 0;
+	}
+	if (sockfd_ == -1)
+		return;
+	(void) close(sockfd_);
+	sockfd_ = -1;
+}
+
+/*
+ * Makes sure there are at least "needed" bytes of unconsumed data in the input
+ * buffer.  Returns false if the peer closed the connection before that.
+ */
+bool
+BPSGIConnection::FillInputBuffer(size_t needed)
+{
+	Assert(needed <= inbuf_.size());
+
+	if (inbuf_end_ - inbuf_start_ >= needed)
+		return true;
+
+	if (inbuf_start_ + needed > inbuf_.size())
+	{
+		memmove(inbuf_.data(), inbuf_.data() + inbuf_start_, inbuf_end_ - inbuf_start_);
+		inbuf_end_ -= inbuf_start_;
+		inbuf_start_ = 0;
+	}
+
+	while (inbuf_end_ - inbuf_start_ < needed)
+	{
+		if (preread_pos_ < preread_.size())
+		{
+			size_t n = std::min(preread_.size() - preread_pos_, inbuf_.size() - inbuf_end_);
+			memcpy(inbuf_.data() + inbuf_end_, preread_.data() + preread_pos_, n);
+			inbuf_end_ += n;
+			preread_pos_ += n;
+			if (preread_pos_ == preread_.size())
+			{
+				preread_.clear();
+				preread_pos_ = 0;
+			}
+			continue;
+		}
+
+		ssize_t ret = read(sockfd_, inbuf_.data() + inbuf_end_, inbuf_.size() - inbuf_end_);
+		if (ret > 0)
+			inbuf_end_ += (size_t) ret;
+		else if (ret == 0)
+			return false;
+		else if (errno == EINTR)
+			continue;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			WaitForSocket(POLLIN);
+		else if (errno == ECONNRESET)
+			return false;
+		else
+			throw SyscallException("read", errno);
+	}
+	return true;
+}
+
+/*
+ * Scans the records in data[0..len) starting from state->offset, stopping at
+ * the first incomplete one.  Used by the dispatcher to decide when it has read
+ * enough of a request to hand the connection to a worker; anything the worker
+ * has to take care of right away counts as completing the request.
+ */
+void
+BPSGIFastCGIScan(const char *data, size_t len, BPSGIRequestScanState *state)
+{
+	while (!state->complete && len - state->offset >= FCGI_HEADER_LEN)
+	{
+		const unsigned char *hdr = (const unsigned char *) data + state->offset;
+		if (hdr[0] != FCGI_VERSION_1)
+		{
+			/* let the worker complain about it */
+			state->complete = true;
+			state->exceptional = true;
+			return;
+		}
+
+		uint8_t type = hdr[1];
+		uint16_t request_id = (uint16_t) ((hdr[2] << 8) | hdr[3]);
+		size_t content_length = (size_t) ((hdr[4] << 8) | hdr[5]);
+		size_t record_length = FCGI_HEADER_LEN + content_length + hdr[6];
+		if (len - state->offset < record_length)
+			return;
+		state->offset += record_length;
+
+		if (request_id == 0 || type == FCGI_ABORT_REQUEST)
+		{
+			state->complete = true;
+			state->exceptional = true;
+		}
+		else if (type == FCGI_BEGIN_REQUEST && content_length == 8)
+		{
+			uint16_t role = (uint16_t) ((hdr[FCGI_HEADER_LEN] << 8) | hdr[FCGI_HEADER_LEN + 1]);
+			if (role != FCGI_RESPONDER)
+			{
+				state->complete = true;
+				state->exceptional = true;
+			}
+			state->request_id = request_id;
+			state->keep_conn = (hdr[FCGI_HEADER_LEN + 2] & FCGI_KEEP_CONN) != 0;
+		}
+		else if (type == FCGI_PARAMS && content_length == 0)
+			state->params_complete = true;
+		else if (type == FCGI_STDIN && content_length == 0)
+			state->complete = true;
+	}
+}
+
+/*
+ * Builds a complete response to the given request: the CGI-style headers
+ * (each terminated by CRLF) and body as FCGI_STDOUT, followed by
+ * FCGI_END_REQUEST.  For small canned responses only.
+ */
+void
+BPSGIFastCGIBuildResponse(std::string &out, uint16_t request_id, const std::string &headers, const std::string &body)
+{
+	char hdr[FCGI_HEADER_LEN];
+	size_t content_length = headers.size() + 2 + body.size();
+
+	Assert(content_length <= FCGI_MAX_CONTENT_LEN);
+
+	fastcgi_fill_header(hdr, FCGI_STDOUT, request_id, content_length);
+	out.append(hdr, sizeof(hdr));
+	out.append(headers);
+	out.append("\r\n", 2);
+	out.append(body);
+
+	fastcgi_fill_header(hdr, FCGI_STDOUT, request_id, 0);
+	out.append(hdr, sizeof(hdr));
+
+	char end_body[8];
+	memset(end_body, 0, sizeof(end_body));
+	end_body[4] = FCGI_REQUEST_COMPLETE;
+	fastcgi_fill_header(hdr, FCGI_END_REQUEST, request_id, sizeof(end_body));
+	out.append(hdr, sizeof(hdr));
+	out.append(end_body, sizeof(end_body));
+}
+
+/*
+ * Reads the next record from the connection.  The returned content pointer is
+ * only valid until the next call.  Returns false on EOF.
+ */
+bool
+BPSGIConnection::ReadRecord(uint8_t *type, uint16_t *request_id, const char **content, size_t *content_length)
+{
+	if (!FillInputBuffer(FCGI_HEADER_LEN))
+	{
+		if (inbuf_end_ != inbuf_start_)
+			throw RuntimeException("unexpected EOF in the middle of a FastCGI record header");
+		return false;
+	}
+
+	const unsigned char *hdr = (const unsigned char *) inbuf_.data() + inbuf_start_;
+	if (hdr[0] != FCGI_VERSION_1)
+		throw RuntimeException("unsupported FastCGI protocol version %d", (int) hdr[0]);
+
+	*type = hdr[1];
+	*request_id = (uint16_t) ((hdr[2] << 8) | hdr[3]);
+	*content_length = (size_t) ((hdr[4] << 8) | hdr[5]);
+	size_t padding_length = hdr[6];
+
+	size_t record_length = FCGI_HEADER_LEN + *content_length + padding_length;
+	if (!FillInputBuffer(record_length))
+		throw RuntimeException("unexpected EOF in the middle of a FastCGI record");
+
+	*content = inbuf_.data() + inbuf_start_ + FCGI_HEADER_LEN;
+	inbuf_start_ += record_length;
+	return true;
+}
+
+void
+BPSGIConnection::HandleManagementRecord(uint8_t type, const char *content, size_t content_length)
+{
+	if (type == FCGI_GET_VALUES)
+	{
+		std::string result;
+		const char *p = content;
+		const char *end = content + content_length;
+
+		while (p < end)
+		{
+			size_t namelen, valuelen;
+
+			if (!fastcgi_decode_length(&p, end, &namelen) ||
+				!fastcgi_decode_length(&p, end, &valuelen) ||
+				namelen > (size_t) (end - p) ||
+				valuelen > (size_t) (end - p) - namelen)
+				throw RuntimeException("invalid name-value pair in FCGI_GET_VALUES record");
+
+			std::string name(p, namelen);
+			p += namelen + valuelen;
+
+			if (name == "FCGI_MAX_CONNS" || name == "FCGI_MAX_REQS")
+				fastcgi_encode_pair(result, name.c_str(), "1");
+			else if (name == "FCGI_MPXS_CONNS")
+				fastcgi_encode_pair(result, name.c_str(), "0");
+		}
+		(void) WriteRecord(FCGI_GET_VALUES_RESULT, 0, result.data(), result.size());
+	}
+	else
+	{
+		char body[8];
+
+		memset(body, 0, sizeof(body));
+		body[0] = (char) type;
+		(void) WriteRecord(FCGI_UNKNOWN_TYPE, 0, body, sizeof(body));
+	}
+}
+
+/*
+ * Reads records from the connection until the beginning of a request and all
+ * of its parameters have been received.  The request body is read later, on
+ * demand, through ReadStdin.  Returns false if the connection was closed
+ * before that, in which case the caller should close the connection.
+ */
+bool
+BPSGIConnection::ReadRequest(BPSGIRequest &request)
+{
+	bool active = false;
+
+	request.Reset();
+	offload_allowed_ = offload_;
+	if (protocol_ == PROTOCOL_HTTP)
+		return ReadHTTPRequest(request);
+	else if (protocol_ == PROTOCOL_UWSGI)
+		return ReadUWSGIRequest(request);
+
+	while (!active || !request.params_complete_)
+	{
+		uint8_t type;
+		uint16_t request_id;
+		const char *content;
+		size_t content_length;
+
+		if (!ReadRecord(&type, &request_id, &content, &content_length))
+		{
+			if (active)
+				throw RuntimeException("unexpected EOF in the middle of a FastCGI request");
+			return false;
+		}
+
+		if (request_id == 0)
+		{
+			HandleManagementRecord(type, content, content_length);
+			continue;
+		}
+
+		if (type == FCGI_BEGIN_REQUEST)
+		{
+			if (content_length != 8)
+				throw RuntimeException("unexpected FCGI_BEGIN_REQUEST content length %d", (int) content_length);
+
+			const unsigned char *body = (const unsigned char *) content;
+			uint16_t role = (uint16_t) ((body[0] << 8) | body[1]);
+			bool keep_conn = (body[2] & FCGI_KEEP_CONN) != 0;
+
+			char end_body[8];
+			memset(end_body, 0, sizeof(end_body));
+
+			if (active)
+			{
+				end_body[4] = FCGI_CANT_MPX_CONN;
+				(void) WriteRecord(FCGI_END_REQUEST, request_id, end_body, sizeof(end_body));
+				continue;
+			}
+			else if (role != FCGI_RESPONDER)
+			{
+				end_body[4] = FCGI_UNKNOWN_ROLE;
+				(void) WriteRecord(FCGI_END_REQUEST, request_id, end_body, sizeof(end_body));
+				if (!keep_conn)
+					return false;
+				continue;
+			}
+
+			active = true;
+			request.request_id_ = request_id;
+			request.keep_conn_ = keep_conn;
+			continue;
+		}
+
+		if (!active || request_id != request.request_id_)
+		{
+			/* not for us; ignore */
+			continue;
+		}
+
+		switch (type)
+		{
+			case FCGI_PARAMS:
+				if (request.params_complete_)
+					throw RuntimeException("FCGI_PARAMS record received after the end of the parameter stream");
+				if (content_length == 0)
+				{
+					request.params_complete_ = true;
+					request.DecodeParams();
+				}
+				else
+					request.params_data_.insert(request.params_data_.end(), content, content + content_length);
+				break;
+			case FCGI_STDIN:
+				throw RuntimeException("FCGI_STDIN record received before the end of the parameter stream");
+			case FCGI_ABORT_REQUEST:
+			{
+				/*
+				 * The client went away before we even got to run the request.
+				 * Acknowledge the abort and start over.
+				 */
+				bool keep_conn = request.keep_conn_;
+				char end_body[8];
+
+				memset(end_body, 0, sizeof(end_body));
+				end_body[4] = FCGI_REQUEST_COMPLETE;
+				(void) WriteRecord(FCGI_END_REQUEST, request_id, end_body, sizeof(end_body));
+				if (!keep_conn)
+					return false;
+				request.Reset();
+				active = false;
+				break;
+			}
+			default:
+				/* FCGI_DATA and others aren't interesting in the Responder role */
+				break;
+		}
+	}
+
+	int64_t content_length = -1;
+	size_t valuelen;
+	const char *value = request.FindParam("CONTENT_LENGTH", &valuelen);
+	if (value != NULL && valuelen > 0 && valuelen < 20)
+	{
+		char buf[20];
+		char *endptr;
+
+		memcpy(buf, value, valuelen);
+		buf[valuelen] = '\0';
+		content_length = (int64_t) strtoll(buf, &endptr, 10);
+		if (*endptr != '\0' || content_length < 0)
+			content_length = -1;
+	}
+	request.input_.Start(content_length);
+
+	return true;
+}
+
+/*
+ * Reads the next piece of the request body.  Returns 1 if *data and *len were
+ * set, 0 at the end of the request body, or -1 if the request was aborted or
+ * the connection closed before that.
+ */
+int
+BPSGIConnection::ReadStdin(uint16_t request_id, const char **data, size_t *len)
+{
+	if (protocol_ != PROTOCOL_FASTCGI)
+		return ReadHTTPBody(data, len);
+
+	for (;;)
+	{
+		uint8_t type;
+		uint16_t record_request_id;
+		const char *content;
+		size_t content_length;
+
+		if (!ReadRecord(&type, &record_request_id, &content, &content_length))
+		{
+			broken_ = true;
+			return -1;
+		}
+
+		if (record_request_id == 0)
+		{
+			HandleManagementRecord(type, content, content_length);
+			continue;
+		}
+		else if (type == FCGI_BEGIN_REQUEST)
+		{
+			char end_body[8];
+
+			memset(end_body, 0, sizeof(end_body));
+			end_body[4] = FCGI_CANT_MPX_CONN;
+			(void) WriteRecord(FCGI_END_REQUEST, record_request_id, end_body, sizeof(end_body));
+			continue;
+		}
+		else if (record_request_id != request_id)
+			continue;
+
+		if (type == FCGI_STDIN)
+		{
+			*data = content;
+			*len = content_length;
+			return content_length > 0 ? 1 : 0;
+		}
+		else if (type == FCGI_ABORT_REQUEST)
+			return -1;
+	}
+}
+
+/*
+ * Fills in the header which precedes len bytes of response output: an
+ * FCGI_STDOUT record header, or an HTTP chunk header.  Returns its length,
+ * which is 0 if the output isn't framed at all.
+ */
+size_t
+BPSGIConnection::FillFrameHeader(char *hdr, uint16_t request_id, size_t len) const
+{
+	if (protocol_ == PROTOCOL_FASTCGI)
+	{
+		fastcgi_fill_header(hdr, FCGI_STDOUT, request_id, len);
+		return FCGI_HEADER_LEN;
+	}
+	else if (http_framing_ == HTTP_FRAMING_CHUNKED)
+	{
+		static const char hexdigits[] = "0123456789abcdef";
+
+		Assert((int64_t) len <= HTTP_MAX_CHUNK_LEN);
+		for (int i = 7; i >= 0; i--)
+		{
+			hdr[i] = hexdigits[len & 0xF];
+			len >>= 4;
+		}
+		hdr[8] = '\r';
+		hdr[9] = '\n';
+		return HTTP_CHUNK_HEADER_LEN;
+	}
+	return 0;
+}
+
+size_t
+BPSGIConnection::FrameHeaderLength() const
+{
+	if (protocol_ == PROTOCOL_FASTCGI)
+		return FCGI_HEADER_LEN;
+	return http_framing_ == HTTP_FRAMING_CHUNKED ? HTTP_CHUNK_HEADER_LEN : 0;
+}
+
+/* HTTP chunks are followed by a CRLF */
+size_t
+BPSGIConnection::FrameTrailerLength() const
+{
+	return (protocol_ != PROTOCOL_FASTCGI && http_framing_ == HTTP_FRAMING_CHUNKED) ? 2 : 0;
+}
+
+int64_t
+BPSGIConnection::MaxFrameLength() const
+{
+	if (protocol_ == PROTOCOL_FASTCGI)
+		return FCGI_MAX_CONTENT_LEN;
+	return http_framing_ == HTTP_FRAMING_CHUNKED ? HTTP_MAX_CHUNK_LEN : INT64_MAX;
+}
+
+/*
+ * Writes out the provided iovecs in their entirety.  Returns false if the
+ * connection has been broken, in which case the connection should be closed
+ * and no further writes attempted.
+ */
+bool
+BPSGIConnection::WriteFully(struct iovec *iov, int iovcnt)
+{
+	if (broken_)
+		return false;
+
+	while (iovcnt > 0)
+	{
+		ssize_t ret = writev(OutputFd(), iov, iovcnt);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				HandleBlockedWrite();
+				continue;
+			}
+			else if (errno == EPIPE || errno == ECONNRESET)
+			{
+				broken_ = true;
+				return false;
+			}
+			throw SyscallException("writev", errno);
+		}
+
+		OutputWritten((size_t) ret);
+
+		size_t written = (size_t) ret;
+		while (iovcnt > 0 && written >= iov->iov_len)
+		{
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (char *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return true;
+}
+
+bool
+BPSGIConnection::WriteRecord(uint8_t type, uint16_t request_id, const char *data, size_t len)
+{
+	char hdr[FCGI_HEADER_LEN];
+	struct iovec iov[2];
+
+	if (!Flush())
+		return false;
+
+	fastcgi_fill_header(hdr, type, request_id, len);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = len;
+	return WriteFully(iov, len > 0 ? 2 : 1);
+}
+
+/*
+ * Finishes the FCGI_STDOUT record currently open in the output buffer, if
+ * any.
+ */
+void
+BPSGIConnection::CloseOutputRecord()
+{
+	if (outbuf_record_start_ == std::string::npos)
+		return;
+
+	size_t content_length = outbuf_.size() - outbuf_record_start_ - FrameHeaderLength();
+	if (content_length == 0)
+		outbuf_.resize(outbuf_record_start_);
+	else
+	{
+		(void) FillFrameHeader(&outbuf_[outbuf_record_start_], outbuf_record_request_id_, content_length);
+		if (FrameTrailerLength() > 0)
+			outbuf_.append("\r\n", 2);
+	}
+	outbuf_record_start_ = std::string::npos;
+}
+
+void
+BPSGIConnection::BufferStdout(uint16_t request_id, const char *data, size_t len)
+{
+	size_t header_len = FrameHeaderLength();
+
+	/* unframed output doesn't need records */
+	if (header_len == 0)
+	{
+		outbuf_.append(data, len);
+		return;
+	}
+
+	while (len > 0)
+	{
+		if (outbuf_record_start_ != std::string::npos &&
+			outbuf_record_request_id_ != request_id)
+			CloseOutputRecord();
+		if (outbuf_record_start_ == std::string::npos)
+		{
+			outbuf_record_start_ = outbuf_.size();
+			outbuf_record_request_id_ = request_id;
+			outbuf_.append(header_len, '\0');
+		}
+
+		size_t room = (size_t) std::min(MaxFrameLength(), (int64_t) FCGI_MAX_CONTENT_LEN) - (outbuf_.size() - outbuf_record_start_ - header_len);
+		if (room == 0)
+		{
+			CloseOutputRecord();
+			continue;
+		}
+
+		size_t chunk = std::min(len, room);
+		outbuf_.append(data, chunk);
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+/*
+ * Writes out the output buffer followed by data which was too large to be
+ * buffered, gathering everything into as few writev() calls as possible.
+ */
+bool
+BPSGIConnection::WriteStdoutDirect(uint16_t request_id, const char *data, size_t len)
+{
+	const int max_records = 64;
+	char hdrs[max_records][HTTP_CHUNK_HEADER_LEN];
+	struct iovec iov[1 + max_records * 3];
+	size_t trailer_len = FrameTrailerLength();
+
+	CloseOutputRecord();
+	while (len > 0)
+	{
+		int iovcnt = 0;
+
+		if (!outbuf_.empty())
+		{
+			iov[iovcnt].iov_base = &outbuf_[0];
+			iov[iovcnt].iov_len = outbuf_.size();
+			iovcnt++;
+		}
+		for (int i = 0; i < max_records && len > 0; i++)
+		{
+			size_t chunk = (size_t) std::min((int64_t) len, MaxFrameLength());
+			size_t header_len = FillFrameHeader(hdrs[i], request_id, chunk);
+
+			if (header_len > 0)
+			{
+				iov[iovcnt].iov_base = hdrs[i];
+				iov[iovcnt].iov_len = header_len;
+				iovcnt++;
+			}
+			iov[iovcnt].iov_base = (void *) data;
+			iov[iovcnt].iov_len = chunk;
+			iovcnt++;
+			if (trailer_len > 0)
+			{
+				iov[iovcnt].iov_base = (void *) "\r\n";
+				iov[iovcnt].iov_len = trailer_len;
+				iovcnt++;
+			}
+
+			data += chunk;
+			len -= chunk;
+		}
+
+		bool ok = WriteFully(iov, iovcnt);
+		outbuf_.clear();
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Queues data to be sent to the client as FCGI_STDOUT.  Small writes are
+ * collected into the output buffer, and consecutive writes share a single
+ * record.  Nothing is guaranteed to reach the client before Flush() or
+ * FinishRequest() is called.
+ */
+bool
+BPSGIConnection::WriteStdout(uint16_t request_id, const char *data, size_t len)
+{
+	if (broken_)
+		return false;
+	/* an empty FCGI_STDOUT record or HTTP chunk would terminate the stream */
+	if (len == 0)
+		return true;
+	if (protocol_ != PROTOCOL_FASTCGI)
+	{
+		if (http_framing_ == HTTP_FRAMING_NONE)
+			return true;
+		http_response_written_ += (int64_t) len;
+	}
+
+	if (outbuf_.size() + FrameHeaderLength() + len <= output_buffer_size_)
+	{
+		BufferStdout(request_id, data, len);
+		return true;
+	}
+	return WriteStdoutDirect(request_id, data, len);
+}
+
+bool
+BPSGIConnection::Flush()
+{
+	CloseOutputRecord();
+	if (outbuf_.empty())
+		return !broken_;
+
+	struct iovec iov;
+	iov.iov_base = &outbuf_[0];
+	iov.iov_len = outbuf_.size();
+	bool ok = WriteFully(&iov, 1);
+	outbuf_.clear();
+	return ok;
+}
+
+/*
+ * Like Flush(), but gives up instead of blocking if the frontend isn't
+ * reading.  Returns 1 if the output buffer was written out completely, 0 if
+ * some of it is still waiting and -1 if the connection has been lost.
+ */
+int
+BPSGIConnection::FlushNonBlocking()
+{
+	CloseOutputRecord();
+	if (broken_)
+		return -1;
+
+	while (!outbuf_.empty())
+	{
+		ssize_t ret = send(sockfd_, outbuf_.data(), outbuf_.size(), MSG_DONTWAIT);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			else if (errno == EPIPE || errno == ECONNRESET)
+			{
+				broken_ = true;
+				outbuf_.clear();
+				return -1;
+			}
+			throw SyscallException("send", errno);
+		}
+		outbuf_.erase(0, (size_t) ret);
+	}
+	return 1;
+}
+
+/*
+ * Sends the contents of a file descriptor as FCGI_STDOUT records without
+ * copying the data through userspace: regular files are sent from the given
+ * offset with sendfile(), pipes and sockets are drained with splice().
+ * Returns 1 on success, 0 if the connection has been lost and -1 if the file
+ * descriptor can't be sent this way, in which case nothing has been written.
+ */
+int
+BPSGIConnection::SendFile(uint16_t request_id, int fd, int64_t offset)
+{
+	struct stat st;
+
+	if (broken_)
+		return 0;
+	if (fstat(fd, &st) == -1)
+		return -1;
+	if (!S_ISREG(st.st_mode) && !S_ISFIFO(st.st_mode) && !S_ISSOCK(st.st_mode))
+		return -1;
+	if (protocol_ != PROTOCOL_FASTCGI && http_framing_ == HTTP_FRAMING_NONE)
+		return 1;
+	if (!Flush())
+		return 0;
+
+	if (S_ISREG(st.st_mode))
+		return SendRegularFile(request_id, fd, offset, (int64_t) st.st_size);
+	else
+		return SpliceStream(request_id, fd);
+}
+
+int
+BPSGIConnection::SendRegularFile(uint16_t request_id, int fd, int64_t offset, int64_t size)
+{
+	off_t off = (off_t) offset;
+
+	while (off < size)
+	{
+		size_t chunk = (size_t) std::min(MaxFrameLength(), size - (int64_t) off);
+		char hdr[HTTP_CHUNK_HEADER_LEN];
+		struct iovec iov;
+
+		iov.iov_base = hdr;
+		iov.iov_len = FillFrameHeader(hdr, request_id, chunk);
+		if (iov.iov_len > 0 && !WriteFully(&iov, 1))
+			return 0;
+		if (protocol_ != PROTOCOL_FASTCGI)
+			http_response_written_ += (int64_t) chunk;
+
+		while (chunk > 0)
+		{
+			ssize_t ret = sendfile(OutputFd(), fd, &off, chunk);
+			if (ret > 0)
+			{
+				OutputWritten((size_t) ret);
+				chunk -= (size_t) ret;
+			}
+			else if (ret == 0)
+			{
+				/*
+				 * The file was truncated under us.  We've already promised the
+				 * client more data than we have, so the only way out is to
+				 * drop the connection.
+				 */
+				broken_ = true;
+				return 0;
+			}
+			else if (errno == EINTR)
+				continue;
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				HandleBlockedWrite();
+			else if (errno == EPIPE || errno == ECONNRESET)
+			{
+				broken_ = true;
+				return 0;
+			}
+			else
+			{
+				broken_ = true;
+				throw SyscallException("sendfile", errno);
+			}
+		}
+
+		if (FrameTrailerLength() > 0)
+		{
+			iov.iov_base = (void *) "\r\n";
+			iov.iov_len = FrameTrailerLength();
+			if (!WriteFully(&iov, 1))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+void
+BPSGIConnection::CloseSplicePipe()
+{
+	if (splice_pipe_[0] == -1)
+		return;
+	(void) close(splice_pipe_[0]);
+	(void) close(splice_pipe_[1]);
+	splice_pipe_[0] = -1;
+	splice_pipe_[1] = -1;
+}
+
+/*
+ * Streams data from a pipe or a socket until EOF.  Since we need to know the
+ * length of every record before sending its header, the data is first moved
+ * into an intermediate pipe, and only then to the client.
+ */
+int
+BPSGIConnection::SpliceStream(uint16_t request_id, int fd)
+{
+	if (splice_pipe_[0] == -1)
+	{
+		if (pipe2(splice_pipe_, O_CLOEXEC) == -1)
+			throw SyscallException("pipe2", errno);
+	}
+
+	for (;;)
+	{
+		ssize_t nread = splice(fd, NULL, splice_pipe_[1], NULL, FCGI_MAX_CONTENT_LEN, SPLICE_F_MOVE);
+		if (nread == 0)
+			break;
+		else if (nread == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			/* the response is incomplete, so don't reuse the connection */
+			broken_ = true;
+			throw SyscallException("splice", errno);
+		}
+
+		char hdr[HTTP_CHUNK_HEADER_LEN];
+		struct iovec iov;
+
+		iov.iov_base = hdr;
+		iov.iov_len = FillFrameHeader(hdr, request_id, (size_t) nread);
+		if (iov.iov_len > 0 && !WriteFully(&iov, 1))
+		{
+			CloseSplicePipe();
+			return 0;
+		}
+		if (protocol_ != PROTOCOL_FASTCGI)
+			http_response_written_ += (int64_t) nread;
+
+		size_t remaining = (size_t) nread;
+		while (remaining > 0)
+		{
+			ssize_t ret = splice(splice_pipe_[0], NULL, OutputFd(), NULL, remaining, SPLICE_F_MOVE);
+			if (ret > 0)
+			{
+				OutputWritten((size_t) ret);
+				remaining -= (size_t) ret;
+			}
+			else if (ret == -1 && errno == EINTR)
+				continue;
+			else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				HandleBlockedWrite();
+			else
+			{
+				int save_errno = errno;
+
+				/* whatever is left in the pipe would corrupt the next response */
+				CloseSplicePipe();
+				broken_ = true;
+				if (ret == -1 && save_errno != EPIPE && save_errno != ECONNRESET)
+					throw SyscallException("splice", save_errno);
+				return 0;
+			}
+		}
+
+		if (FrameTrailerLength() > 0)
+		{
+			iov.iov_base = (void *) "\r\n";
+			iov.iov_len = FrameTrailerLength();
+			if (!WriteFully(&iov, 1))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Terminates the FCGI_STDOUT stream and tells the client the request has been
+ * completed.
+ */
+void
+BPSGIConnection::FinishRequest(BPSGIRequest &request)
+{
+	if (protocol_ != PROTOCOL_FASTCGI)
+	{
+		FinishHTTPResponse(request);
+		return;
+	}
+
+	char buf[FCGI_HEADER_LEN * 2 + 8];
+
+	fastcgi_fill_header(buf, FCGI_STDOUT, request.request_id(), 0);
+	fastcgi_fill_header(buf + FCGI_HEADER_LEN, FCGI_END_REQUEST, request.request_id(), 8);
+	memset(buf + FCGI_HEADER_LEN * 2, 0, 8);
+	buf[FCGI_HEADER_LEN * 2 + 4] = FCGI_REQUEST_COMPLETE;
+
+	/* sent together with whatever output is still buffered */
+	CloseOutputRecord();
+	outbuf_.append(buf, sizeof(buf));
+	(void) Flush();
+}
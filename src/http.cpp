@@ -0,0 +1,956 @@
+#include "bladepsgi.hpp"
+
+#include <algorithm>
+
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/* requests with more header lines than this are refused */
+#define HTTP_MAX_HEADERS			256
+/* nor do we accept request body chunks larger than this */
+#define HTTP_MAX_REQUEST_CHUNK_LEN	((int64_t) 1 << 40)
+
+static bool
+http_name_equals(const char *name, size_t namelen, const char *literal)
+{
+	size_t len = strlen(literal);
+	return namelen == len && strncasecmp(name, literal, len) == 0;
+}
+
+/*
+ * Checks whether a comma-separated header value such as that of Connection
+ * contains the given token.
+ */
+static bool
+http_has_token(const std::string &value, const char *token)
+{
+	size_t tokenlen = strlen(token);
+	size_t pos = 0;
+
+	while (pos < value.size())
+	{
+		size_t end = value.find(',', pos);
+		if (end == std::string::npos)
+			end = value.size();
+
+		size_t start = pos;
+		while (start < end && (value[start] == ' ' || value[start] == '\t'))
+			start++;
+		size_t stop = end;
+		while (stop > start && (value[stop - 1] == ' ' || value[stop - 1] == '\t'))
+			stop--;
+		if (stop - start == tokenlen && strncasecmp(value.data() + start, token, tokenlen) == 0)
+			return true;
+		pos = end + 1;
+	}
+	return false;
+}
+
+/*
+ * Parses a Content-Length value.  Returns -1 if it isn't a plain non-negative
+ * number.
+ */
+static int64_t
+http_parse_content_length(const char *value, size_t len)
+{
+	int64_t result = 0;
+
+	if (len == 0 || len > 18)
+		return -1;
+	for (size_t i = 0; i < len; i++)
+	{
+		if (value[i] < '0' || value[i] > '9')
+			return -1;
+		result = result * 10 + (value[i] - '0');
+	}
+	return result;
+}
+
+static int
+http_hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	else if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* PATH_INFO is percent-decoded; invalid escapes are left alone */
+static void
+http_percent_decode(const char *p, size_t len, std::string &out)
+{
+	out.clear();
+	out.reserve(len);
+	for (size_t i = 0; i < len; i++)
+	{
+		if (p[i] == '%' && i + 2 < len && http_hex_value(p[i + 1]) >= 0 && http_hex_value(p[i + 2]) >= 0)
+		{
+			out.push_back((char) (http_hex_value(p[i + 1]) * 16 + http_hex_value(p[i + 2])));
+			i += 2;
+		}
+		else
+			out.push_back(p[i]);
+	}
+}
+
+static const char *http_days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *http_months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/*
+ * Formats t as an HTTP date, "Sun, 06 Nov 1994 08:49:37 GMT", into buf, which
+ * must have room for HTTP_DATE_LEN + 1 bytes.  The names of days and months
+ * are spelled out here because strftime() would follow the locale.
+ */
+size_t
+BPSGIHTTPFormatDate(time_t t, char *buf)
+{
+	struct tm tm;
+
+	(void) gmtime_r(&t, &tm);
+	int n = snprintf(buf, HTTP_DATE_LEN + 1, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+					 http_days[tm.tm_wday], tm.tm_mday, http_months[tm.tm_mon], tm.tm_year + 1900,
+					 tm.tm_hour, tm.tm_min, tm.tm_sec);
+	return (size_t) n;
+}
+
+/*
+ * Parses an HTTP date in the preferred format; the obsolete RFC 850 and
+ * asctime() formats aren't accepted.  Returns false if value isn't one.
+ */
+bool
+BPSGIHTTPParseDate(const char *value, size_t len, time_t *result)
+{
+	char month[4];
+	struct tm tm;
+	int n = 0;
+
+	if (len != HTTP_DATE_LEN)
+		return false;
+	std::string str(value, len);
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(str.c_str(), "%*3s, %2d %3s %4d %2d:%2d:%2d GMT%n",
+			   &tm.tm_mday, month, &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) != 6 ||
+		n != (int) len)
+		return false;
+
+	tm.tm_mon = -1;
+	for (int i = 0; i < 12; i++)
+	{
+		if (strcmp(month, http_months[i]) == 0)
+			tm.tm_mon = i;
+	}
+	if (tm.tm_mon == -1)
+		return false;
+	tm.tm_year -= 1900;
+	*result = timegm(&tm);
+	return *result != (time_t) -1;
+}
+
+/*
+ * Appends a Date header for the current time.  It only changes once a
+ * second, so it's formatted only that often.
+ */
+void
+BPSGIHTTPAppendDateHeader(std::string &out)
+{
+	static time_t cached_time = -1;
+	static char cached[HTTP_DATE_LEN + 16];
+	static size_t cached_len = 0;
+
+	time_t now = time(NULL);
+	if (now != cached_time)
+	{
+		memcpy(cached, "Date: ", 6);
+		cached_len = 6 + BPSGIHTTPFormatDate(now, cached + 6);
+		memcpy(cached + cached_len, "\r\n", 2);
+		cached_len += 2;
+		cached_time = now;
+	}
+	out.append(cached, cached_len);
+}
+
+/*
+ * Builds a complete HTTP/1.1 response with a body of a known length.  headers
+ * are the header lines other than the status line, each terminated by CRLF.
+ * For small canned responses only.
+ */
+void
+BPSGIHTTPBuildResponse(std::string &out, int status, const std::string &headers, const std::string &body, bool keep_conn)
+{
+	char buf[64];
+	size_t len;
+	const char *line = BPSGIHTTPStatusLine(status, &len);
+
+	if (line != NULL)
+		out.append(line, len);
+	else
+	{
+		int n = snprintf(buf, sizeof(buf), "HTTP/1.1 %d \r\n", status);
+		out.append(buf, (size_t) n);
+	}
+	out.append(headers);
+	int n = snprintf(buf, sizeof(buf), "Content-Length: %d\r\n", (int) body.size());
+	out.append(buf, (size_t) n);
+	BPSGIHTTPAppendDateHeader(out);
+	if (!keep_conn)
+		out.append("Connection: close\r\n");
+	out.append("\r\n", 2);
+	out.append(body);
+}
+
+/*
+ * The HTTP counterpart of BPSGIFastCGIScan.  The request is complete once the
+ * headers and a body of Content-Length bytes have arrived.  Chunked bodies and
+ * requests expecting a "100 Continue" are handed to the worker as soon as the
+ * headers are complete, and so are requests which look broken; the worker
+ * reads or answers the rest.
+ */
+void
+BPSGIHTTPScan(const char *data, size_t len, BPSGIRequestScanState *state)
+{
+	if (!state->params_complete)
+	{
+		size_t head_end = 0;
+		for (size_t i = state->offset >= 2 ? state->offset - 2 : 0; i < len; i++)
+		{
+			if (data[i] != '\n')
+				continue;
+			if (i + 1 < len && data[i + 1] == '\n')
+				head_end = i + 2;
+			else if (i + 2 < len && data[i + 1] == '\r' && data[i + 2] == '\n')
+				head_end = i + 3;
+			if (head_end != 0)
+				break;
+		}
+		if (head_end == 0)
+		{
+			state->offset = len;
+			return;
+		}
+
+		/* not used by HTTP, but the dispatcher only sheds requests which have one */
+		state->request_id = 1;
+		state->params_complete = true;
+		state->offset = head_end;
+		state->body_end = head_end;
+
+		const char *p = data;
+		const char *end = data + head_end;
+		bool first = true;
+		bool http11 = false;
+		bool body_unknown = false;
+		std::string connection;
+		int64_t content_length = 0;
+
+		while (p < end)
+		{
+			const char *eol = (const char *) memchr(p, '\n', (size_t) (end - p));
+			size_t linelen = (size_t) (eol - p);
+			if (linelen > 0 && p[linelen - 1] == '\r')
+				linelen--;
+
+			if (first && linelen > 0)
+			{
+				/* the request line ends in the protocol version */
+				if (linelen < 9 || memcmp(p + linelen - 9, " HTTP/1.", 8) != 0)
+				{
+					state->complete = true;
+					state->exceptional = true;
+					return;
+				}
+				http11 = p[linelen - 1] != '0';
+				first = false;
+			}
+			else if (linelen > 0)
+			{
+				const char *colon = (const char *) memchr(p, ':', linelen);
+				if (colon != NULL)
+				{
+					size_t namelen = (size_t) (colon - p);
+					const char *value = colon + 1;
+					size_t valuelen = linelen - namelen - 1;
+					while (valuelen > 0 && (*value == ' ' || *value == '\t'))
+					{
+						value++;
+						valuelen--;
+					}
+					while (valuelen > 0 && (value[valuelen - 1] == ' ' || value[valuelen - 1] == '\t'))
+						valuelen--;
+
+					if (http_name_equals(p, namelen, "Content-Length"))
+					{
+						content_length = http_parse_content_length(value, valuelen);
+						if (content_length < 0)
+						{
+							state->complete = true;
+							state->exceptional = true;
+							return;
+						}
+					}
+					else if (http_name_equals(p, namelen, "Transfer-Encoding") ||
+							 http_name_equals(p, namelen, "Expect"))
+						body_unknown = true;
+					else if (http_name_equals(p, namelen, "Connection"))
+						connection.assign(value, valuelen);
+				}
+			}
+			p = eol + 1;
+		}
+
+		state->keep_conn = http11 ? !http_has_token(connection, "close") : http_has_token(connection, "keep-alive");
+		if (body_unknown)
+		{
+			/* we don't know where the body ends, so it can't be shed and kept */
+			state->keep_conn = false;
+			state->complete = true;
+			return;
+		}
+		state->body_end = head_end + (size_t) content_length;
+	}
+
+	if (!state->complete && len >= state->body_end)
+	{
+		state->complete = true;
+		state->offset = state->body_end;
+	}
+}
+
+
+/*
+ * Reads a line of the request head.  The line is returned without its line
+ * terminator, and only valid until the input buffer is read from again.
+ * Returns false on EOF before the beginning of a line.
+ */
+bool
+BPSGIConnection::ReadHTTPLine(const char **line, size_t *len)
+{
+	for (;;)
+	{
+		char *start = inbuf_.data() + inbuf_start_;
+		size_t avail = inbuf_end_ - inbuf_start_;
+		char *nl = (char *) memchr(start, '\n', avail);
+
+		if (nl != NULL)
+		{
+			*line = start;
+			*len = (size_t) (nl - start);
+			if (*len > 0 && start[*len - 1] == '\r')
+				(*len)--;
+			inbuf_start_ += (size_t) (nl - start) + 1;
+			return true;
+		}
+
+		if (avail == inbuf_.size())
+		{
+			FailHTTPRequest(431);
+			throw RuntimeException("HTTP request header line longer than %d bytes", (int) inbuf_.size());
+		}
+		if (!FillInputBuffer(avail + 1))
+		{
+			if (avail > 0)
+				throw RuntimeException("unexpected EOF in the middle of an HTTP request header");
+			return false;
+		}
+	}
+}
+
+/*
+ * Answers a request we couldn't make sense of.  The connection is closed
+ * afterwards.
+ */
+void
+BPSGIConnection::FailHTTPRequest(int status)
+{
+	std::string response;
+
+	BPSGIHTTPBuildResponse(response, status, "Content-Type: text/plain\r\n", std::string(BPSGIReasonPhrase(status)) + "\n", false);
+	outbuf_.clear();
+	outbuf_record_start_ = std::string::npos;
+	http_framing_ = HTTP_FRAMING_RAW;
+	http_response_started_ = true;
+	(void) WriteStdout(0, response.data(), response.size());
+	(void) Flush();
+	broken_ = true;
+}
+
+/*
+ * The PSGI environment wants to know the addresses of both ends of the
+ * connection; they're the same for every request on it.
+ */
+void
+BPSGIConnection::LookUpHTTPAddresses()
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char host[INET6_ADDRSTRLEN];
+
+	http_addresses_known_ = true;
+	http_server_name_ = "localhost";
+	http_server_port_ = "0";
+	http_remote_addr_.clear();
+	http_remote_port_.clear();
+
+	addrlen = sizeof(addr);
+	if (getsockname(sockfd_, (struct sockaddr *) &addr, &addrlen) == 0)
+	{
+		if (addr.ss_family == AF_INET)
+		{
+			auto sin = (struct sockaddr_in *) &addr;
+			if (inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host)) != NULL)
+				http_server_name_ = host;
+			http_server_port_ = std::to_string(ntohs(sin->sin_port));
+		}
+		else if (addr.ss_family == AF_INET6)
+		{
+			auto sin6 = (struct sockaddr_in6 *) &addr;
+			if (inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host)) != NULL)
+				http_server_name_ = host;
+			http_server_port_ = std::to_string(ntohs(sin6->sin6_port));
+		}
+	}
+
+	addrlen = sizeof(addr);
+	if (getpeername(sockfd_, (struct sockaddr *) &addr, &addrlen) == 0)
+	{
+		if (addr.ss_family == AF_INET)
+		{
+			auto sin = (struct sockaddr_in *) &addr;
+			if (inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host)) != NULL)
+				http_remote_addr_ = host;
+			http_remote_port_ = std::to_string(ntohs(sin->sin_port));
+		}
+		else if (addr.ss_family == AF_INET6)
+		{
+			auto sin6 = (struct sockaddr_in6 *) &addr;
+			if (inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host)) != NULL)
+				http_remote_addr_ = host;
+			http_remote_port_ = std::to_string(ntohs(sin6->sin6_port));
+		}
+	}
+}
+
+/*
+ * The HTTP counterpart of reading FCGI_BEGIN_REQUEST and FCGI_PARAMS: reads
+ * the request line and the headers, and turns them into CGI-style parameters
+ * so that the PSGI environment can be built the same way.  Returns false if
+ * the connection was closed between requests.
+ */
+bool
+BPSGIConnection::ReadHTTPRequest(BPSGIRequest &request)
+{
+	http_framing_ = HTTP_FRAMING_RAW;
+	http_response_started_ = false;
+	http_response_length_ = -1;
+	http_response_written_ = 0;
+	http_body_chunked_ = false;
+	http_body_done_ = true;
+	http_body_remaining_ = 0;
+	http_chunk_crlf_pending_ = false;
+	http_expect_continue_ = false;
+
+	if (!ParseHTTPRequestHead(request))
+		return false;
+
+	request.input_.Start(http_body_chunked_ ? -1 : http_body_remaining_);
+	return true;
+}
+
+bool
+BPSGIConnection::ParseHTTPRequestHead(BPSGIRequest &request)
+{
+	const char *line;
+	size_t len;
+
+	/* empty lines before the request line are to be ignored */
+	do {
+		if (!ReadHTTPLine(&line, &len))
+			return false;
+	} while (len == 0);
+
+	const char *sp1 = (const char *) memchr(line, ' ', len);
+	const char *sp2 = sp1 == NULL ? NULL : (const char *) memchr(sp1 + 1, ' ', (size_t) (line + len - sp1 - 1));
+	if (sp1 == NULL || sp2 == NULL || sp1 == line || sp2 == sp1 + 1)
+	{
+		FailHTTPRequest(400);
+		throw RuntimeException("malformed HTTP request line");
+	}
+	std::string method(line, (size_t) (sp1 - line));
+	std::string target(sp1 + 1, (size_t) (sp2 - sp1 - 1));
+	std::string protocol(sp2 + 1, (size_t) (line + len - sp2 - 1));
+
+	if (protocol == "HTTP/1.1")
+		request.http_version_ = 11;
+	else if (protocol == "HTTP/1.0")
+		request.http_version_ = 10;
+	else
+	{
+		FailHTTPRequest(protocol.compare(0, 5, "HTTP/") == 0 ? 505 : 400);
+		throw RuntimeException("unsupported HTTP protocol version");
+	}
+
+	size_t nheaders = 0;
+	for (;;)
+	{
+		if (!ReadHTTPLine(&line, &len))
+			throw RuntimeException("unexpected EOF in the middle of an HTTP request header");
+		if (len == 0)
+			break;
+
+		const char *colon = (const char *) memchr(line, ':', len);
+		if (colon == NULL || colon == line || line[0] == ' ' || line[0] == '\t' ||
+			colon[-1] == ' ' || colon[-1] == '\t')
+		{
+			FailHTTPRequest(400);
+			throw RuntimeException("malformed HTTP request header");
+		}
+		if (nheaders == HTTP_MAX_HEADERS)
+		{
+			FailHTTPRequest(431);
+			throw RuntimeException("more than %d HTTP request headers", HTTP_MAX_HEADERS);
+		}
+
+		const char *value = colon + 1;
+		const char *value_end = line + len;
+		while (value < value_end && (*value == ' ' || *value == '\t'))
+			value++;
+		while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+			value_end--;
+
+		/* reuse the strings of earlier requests */
+		if (nheaders == http_headers_.size())
+			http_headers_.emplace_back();
+		auto &header = http_headers_[nheaders++];
+		header.first.assign(line, (size_t) (colon - line));
+		header.second.assign(value, (size_t) (value_end - value));
+	}
+
+	std::string connection;
+	std::string host;
+	int64_t content_length = -1;
+	bool chunked = false;
+	bool expect_continue = false;
+
+	for (size_t i = 0; i < nheaders; i++)
+	{
+		auto &name = http_headers_[i].first;
+		auto &value = http_headers_[i].second;
+
+		if (http_name_equals(name.data(), name.size(), "Content-Length"))
+		{
+			int64_t cl = http_parse_content_length(value.data(), value.size());
+			if (cl < 0 || (content_length >= 0 && cl != content_length))
+			{
+				FailHTTPRequest(400);
+				throw RuntimeException("invalid Content-Length in HTTP request");
+			}
+			content_length = cl;
+		}
+		else if (http_name_equals(name.data(), name.size(), "Transfer-Encoding"))
+		{
+			if (strcasecmp(value.c_str(), "chunked") != 0 || chunked)
+			{
+				FailHTTPRequest(501);
+				throw RuntimeException("unsupported Transfer-Encoding \"%s\" in HTTP request", value.c_str());
+			}
+			chunked = true;
+		}
+		else if (http_name_equals(name.data(), name.size(), "Connection"))
+		{
+			if (!connection.empty())
+				connection += ",";
+			connection += value;
+		}
+		else if (http_name_equals(name.data(), name.size(), "Host"))
+			host = value;
+		else if (http_name_equals(name.data(), name.size(), "Expect"))
+			expect_continue = strcasecmp(value.c_str(), "100-continue") == 0;
+	}
+
+	/* a request with both could be read differently by a proxy in front of us */
+	if (chunked && content_length >= 0)
+	{
+		FailHTTPRequest(400);
+		throw RuntimeException("HTTP request with both Content-Length and Transfer-Encoding");
+	}
+
+	request.request_id_ = 1;
+	request.http_head_ = method == "HEAD";
+	if (request.http_version_ == 11)
+		request.keep_conn_ = !http_has_token(connection, "close");
+	else
+		request.keep_conn_ = http_has_token(connection, "keep-alive");
+
+	/* the target is normally a path, but may be an absolute URI */
+	size_t path_start = 0;
+	if (target[0] != '/' && target != "*")
+	{
+		size_t scheme_end = target.find("://");
+		if (scheme_end == std::string::npos)
+		{
+			FailHTTPRequest(400);
+			throw RuntimeException("malformed HTTP request target");
+		}
+		path_start = target.find('/', scheme_end + 3);
+		if (host.empty())
+			host = target.substr(scheme_end + 3, path_start == std::string::npos ? std::string::npos : path_start - scheme_end - 3);
+		if (path_start == std::string::npos)
+			path_start = target.size();
+	}
+	size_t query = target.find('?', path_start);
+	size_t path_end = query == std::string::npos ? target.size() : query;
+
+	if (!http_addresses_known_)
+		LookUpHTTPAddresses();
+
+	std::string server_name = http_server_name_;
+	std::string server_port = http_server_port_;
+	if (!host.empty())
+	{
+		size_t colon = host.rfind(':');
+		if (host[0] == '[')
+		{
+			size_t bracket = host.find(']');
+			if (bracket != std::string::npos && colon != std::string::npos && colon > bracket)
+			{
+				server_name = host.substr(0, colon);
+				server_port = host.substr(colon + 1);
+			}
+			else
+				server_name = host;
+		}
+		else if (colon != std::string::npos)
+		{
+			server_name = host.substr(0, colon);
+			server_port = host.substr(colon + 1);
+		}
+		else
+			server_name = host;
+	}
+
+	std::string path_info;
+	if (target != "*")
+		http_percent_decode(target.data() + path_start, path_end - path_start, path_info);
+
+#define ADD_PARAM(name, value) \
+	request.AddParam(name, sizeof(name) - 1, (value).data(), (value).size())
+
+	ADD_PARAM("REQUEST_METHOD", method);
+	ADD_PARAM("REQUEST_URI", target);
+	ADD_PARAM("SCRIPT_NAME", std::string());
+	ADD_PARAM("PATH_INFO", path_info);
+	ADD_PARAM("QUERY_STRING", query == std::string::npos ? std::string() : target.substr(query + 1));
+	ADD_PARAM("SERVER_PROTOCOL", protocol);
+	ADD_PARAM("SERVER_NAME", server_name);
+	ADD_PARAM("SERVER_PORT", server_port);
+	if (!http_remote_addr_.empty())
+	{
+		ADD_PARAM("REMOTE_ADDR", http_remote_addr_);
+		ADD_PARAM("REMOTE_PORT", http_remote_port_);
+	}
+#undef ADD_PARAM
+
+	/*
+	 * Headers become HTTP_* parameters as with CGI.  Repeated headers are
+	 * joined into one.  Names with underscores are dropped, like nginx does,
+	 * since they'd be indistinguishable from names with dashes.
+	 */
+	std::string param_name;
+	std::string param_value;
+	for (size_t i = 0; i < nheaders; i++)
+	{
+		auto &name = http_headers_[i].first;
+
+		if (name.find('_') != std::string::npos)
+			continue;
+		if (chunked && http_name_equals(name.data(), name.size(), "Content-Length"))
+			continue;
+
+		bool seen = false;
+		for (size_t j = 0; j < i && !seen; j++)
+			seen = strcasecmp(http_headers_[j].first.c_str(), name.c_str()) == 0;
+		if (seen)
+			continue;
+
+		if (http_name_equals(name.data(), name.size(), "Content-Length"))
+		{
+			/* repeats were checked to agree above */
+			param_name = "CONTENT_LENGTH";
+			param_value = http_headers_[i].second;
+		}
+		else
+		{
+			if (http_name_equals(name.data(), name.size(), "Content-Type"))
+				param_name = "CONTENT_TYPE";
+			else
+			{
+				param_name = "HTTP_";
+				for (char c : name)
+					param_name.push_back(c == '-' ? '_' : (char) toupper((unsigned char) c));
+			}
+
+			param_value = http_headers_[i].second;
+			const char *separator = http_name_equals(name.data(), name.size(), "Cookie") ? "; " : ", ";
+			for (size_t j = i + 1; j < nheaders; j++)
+			{
+				if (strcasecmp(http_headers_[j].first.c_str(), name.c_str()) == 0)
+				{
+					param_value += separator;
+					param_value += http_headers_[j].second;
+				}
+			}
+		}
+		request.AddParam(param_name.data(), param_name.size(), param_value.data(), param_value.size());
+	}
+
+	request.params_complete_ = true;
+	request.DecodeParams();
+
+	http_body_chunked_ = chunked;
+	http_body_remaining_ = chunked ? 0 : std::max(content_length, (int64_t) 0);
+	http_body_done_ = !chunked && http_body_remaining_ == 0;
+	http_expect_continue_ = expect_continue && request.http_version_ == 11 && !http_body_done_;
+	return true;
+}
+
+/*
+ * The HTTP counterpart of reading FCGI_STDIN records.  Returns 1 if *data and
+ * *len were set, 0 at the end of the request body, or -1 if the connection was
+ * lost or the body was malformed.
+ */
+int
+BPSGIConnection::ReadHTTPBody(const char **data, size_t *len)
+{
+	/* the client is waiting for our go-ahead before sending the body */
+	if (http_expect_continue_)
+	{
+		static const char continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+		http_expect_continue_ = false;
+		if (!http_response_started_)
+		{
+			struct iovec iov;
+
+			iov.iov_base = (void *) continue_response;
+			iov.iov_len = sizeof(continue_response) - 1;
+			if (!Flush() || !WriteFully(&iov, 1))
+				return -1;
+		}
+	}
+
+	for (;;)
+	{
+		if (http_body_done_)
+			return 0;
+
+		if (http_body_remaining_ > 0)
+		{
+			if (!FillInputBuffer(1))
+			{
+				broken_ = true;
+				return -1;
+			}
+
+			size_t n = (size_t) std::min((int64_t) (inbuf_end_ - inbuf_start_), http_body_remaining_);
+			*data = inbuf_.data() + inbuf_start_;
+			*len = n;
+			inbuf_start_ += n;
+			http_body_remaining_ -= (int64_t) n;
+			if (http_body_remaining_ == 0)
+			{
+				if (http_body_chunked_)
+					http_chunk_crlf_pending_ = true;
+				else
+					http_body_done_ = true;
+			}
+			return 1;
+		}
+
+		const char *line;
+		size_t linelen;
+
+		if (!http_body_chunked_)
+		{
+			http_body_done_ = true;
+			continue;
+		}
+		else if (http_chunk_crlf_pending_)
+		{
+			if (!ReadHTTPLine(&line, &linelen) || linelen != 0)
+			{
+				broken_ = true;
+				return -1;
+			}
+			http_chunk_crlf_pending_ = false;
+		}
+
+		/* the size of the next chunk, possibly followed by extensions */
+		if (!ReadHTTPLine(&line, &linelen))
+		{
+			broken_ = true;
+			return -1;
+		}
+		int64_t size = 0;
+		size_t i;
+		for (i = 0; i < linelen && http_hex_value(line[i]) >= 0; i++)
+		{
+			size = size * 16 + http_hex_value(line[i]);
+			if (size > HTTP_MAX_REQUEST_CHUNK_LEN)
+				break;
+		}
+		if (i == 0 || size > HTTP_MAX_REQUEST_CHUNK_LEN ||
+			(i < linelen && line[i] != ';' && line[i] != ' ' && line[i] != '\t'))
+		{
+			broken_ = true;
+			return -1;
+		}
+
+		if (size > 0)
+		{
+			http_body_remaining_ = size;
+			continue;
+		}
+
+		/* the last chunk; skip the trailer */
+		do {
+			if (!ReadHTTPLine(&line, &linelen))
+			{
+				broken_ = true;
+				return -1;
+			}
+		} while (linelen > 0);
+		http_body_done_ = true;
+	}
+}
+
+/*
+ * Writes the response head, and sets up how the body is to be framed.  The
+ * head itself is written unframed.
+ */
+bool
+BPSGIConnection::WriteHTTPResponseHeaders(const std::string &headers, HTTPFraming framing, int64_t content_length)
+{
+	http_framing_ = HTTP_FRAMING_RAW;
+	http_response_started_ = true;
+	bool ok = WriteStdout(0, headers.data(), headers.size());
+	http_framing_ = framing;
+	http_response_length_ = content_length;
+	http_response_written_ = 0;
+	return ok;
+}
+
+/*
+ * Terminates the response body.  The connection can only be kept alive if
+ * the client can tell where the response ends.
+ */
+void
+BPSGIConnection::FinishHTTPResponse(BPSGIRequest &request)
+{
+	if (!http_response_started_)
+	{
+		/* the application never started a response */
+		std::string response;
+
+		BPSGIHTTPBuildResponse(response, 500, "Content-Type: text/plain\r\n", "Internal Server Error\n", false);
+		http_framing_ = HTTP_FRAMING_RAW;
+		http_response_started_ = true;
+		(void) WriteStdout(0, response.data(), response.size());
+		request.keep_conn_ = false;
+	}
+	else if (http_framing_ == HTTP_FRAMING_CHUNKED)
+	{
+		CloseOutputRecord();
+		outbuf_.append("0\r\n\r\n", 5);
+	}
+	else if (http_framing_ == HTTP_FRAMING_RAW && http_response_written_ != http_response_length_)
+		request.keep_conn_ = false;
+
+	(void) Flush();
+}
+
+
+void
+BPSGIRequest::BeginHTTPResponseHeaders(int status)
+{
+	size_t len;
+	const char *line = BPSGIHTTPStatusLine(status, &len);
+
+	header_buffer_.clear();
+	if (line != NULL)
+		header_buffer_.append(line, len);
+	else
+	{
+		char buf[32];
+		int n = snprintf(buf, sizeof(buf), "HTTP/1.1 %d \r\n", status);
+		header_buffer_.append(buf, (size_t) n);
+	}
+	response_status_ = status;
+	response_content_length_ = -1;
+}
+
+/*
+ * The headers which describe the connection or the framing of the body are
+ * ours to set, so the application's are dropped.
+ */
+void
+BPSGIRequest::AddHTTPResponseHeader(const char *name, size_t namelen, const char *value, size_t valuelen)
+{
+	if (http_name_equals(name, namelen, "Connection") ||
+		http_name_equals(name, namelen, "Keep-Alive") ||
+		http_name_equals(name, namelen, "Transfer-Encoding"))
+		return;
+	if (http_name_equals(name, namelen, "Content-Length"))
+	{
+		response_content_length_ = http_parse_content_length(value, valuelen);
+		if (response_content_length_ < 0)
+			return;
+	}
+
+	header_buffer_.append(name, namelen);
+	header_buffer_.append(": ", 2);
+	header_buffer_.append(value, valuelen);
+	header_buffer_.append("\r\n", 2);
+}
+
+bool
+BPSGIRequest::FinishHTTPResponseHeaders()
+{
+	BPSGIConnection::HTTPFraming framing;
+
+	/* uwsgi responses end when the connection is closed */
+	if (conn_->protocol() == PROTOCOL_UWSGI)
+	{
+		header_buffer_.append("\r\n", 2);
+		return conn_->WriteHTTPResponseHeaders(header_buffer_, BPSGIConnection::HTTP_FRAMING_RAW, response_content_length_);
+	}
+
+	if (http_head_ || response_status_ < 200 || response_status_ == 204 || response_status_ == 304)
+		framing = BPSGIConnection::HTTP_FRAMING_NONE;
+	else if (response_content_length_ >= 0)
+		framing = BPSGIConnection::HTTP_FRAMING_RAW;
+	else if (http_version_ >= 11)
+	{
+		framing = BPSGIConnection::HTTP_FRAMING_CHUNKED;
+		header_buffer_.append("Transfer-Encoding: chunked\r\n");
+	}
+	else
+	{
+		/* an HTTP/1.0 client only sees the end of the body when we close */
+		framing = BPSGIConnection::HTTP_FRAMING_RAW;
+		keep_conn_ = false;
+	}
+
+	if (!keep_conn_)
+		header_buffer_.append("Connection: close\r\n");
+	else if (http_version_ < 11)
+		header_buffer_.append("Connection: keep-alive\r\n");
+	BPSGIHTTPAppendDateHeader(header_buffer_);
+	header_buffer_.append("\r\n", 2);
+
+	return conn_->WriteHTTPResponseHeaders(header_buffer_, framing, response_content_length_);
+}
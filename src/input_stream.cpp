@@ -0,0 +1,223 @@
+#include "bladepsgi.hpp"
+
+#include <algorithm>
+
+static void
+pwrite_fully(int fd, const char *data, size_t len, int64_t offset)
+{
+	while (len > 0)
+	{
+		ssize_t ret = pwrite(fd, data, len, (off_t) offset);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			throw SyscallException("pwrite", errno);
+		}
+		data += ret;
+		len -= (size_t) ret;
+		offset += ret;
+	}
+}
+
+BPSGIInputStream::BPSGIInputStream(BPSGIConnection *conn, BPSGIRequest *request, size_t spool_threshold)
+	: conn_(conn),
+	  request_(request),
+	  spool_threshold_(spool_threshold),
+	  complete_(false),
+	  failed_(false),
+	  spooled_(0),
+	  pos_(0),
+	  memfd_(-1),
+	  in_memfd_(false)
+{
+}
+
+BPSGIInputStream::~BPSGIInputStream()
+{
+	if (memfd_ != -1)
+		(void) close(memfd_);
+}
+
+/*
+ * Prepares the stream for a new request.  Bodies which are known to be too
+ * large to be kept in memory go straight into the memfd.
+ */
+void
+BPSGIInputStream::Start(int64_t content_length)
+{
+	Assert(spooled_ == 0 && !in_memfd_);
+
+	if (content_length == 0)
+		complete_ = true;
+	else if (content_length > (int64_t) spool_threshold_)
+		SpillToMemfd();
+}
+
+void
+BPSGIInputStream::Reset()
+{
+	if (in_memfd_)
+	{
+		/* give the memory back, but keep the memfd for the next request */
+		if (ftruncate(memfd_, 0) == -1)
+			throw SyscallException("ftruncate", errno);
+		in_memfd_ = false;
+	}
+	data_.clear();
+	complete_ = false;
+	failed_ = false;
+	spooled_ = 0;
+	pos_ = 0;
+}
+
+/*
+ * Moves everything received so far into the memfd, and makes sure everything
+ * received from now on goes there as well.
+ */
+void
+BPSGIInputStream::SpillToMemfd()
+{
+	Assert(!in_memfd_);
+
+	if (memfd_ == -1)
+	{
+		memfd_ = memfd_create("bladepsgi-input", MFD_CLOEXEC);
+		if (memfd_ == -1)
+			throw SyscallException("memfd_create", errno);
+	}
+
+	pwrite_fully(memfd_, data_.data(), data_.size(), 0);
+	data_.clear();
+	in_memfd_ = true;
+}
+
+void
+BPSGIInputStream::Spool(const char *data, size_t len)
+{
+	if (!in_memfd_ && (size_t) spooled_ + len > spool_threshold_)
+		SpillToMemfd();
+
+	if (in_memfd_)
+		pwrite_fully(memfd_, data, len, spooled_);
+	else
+		data_.insert(data_.end(), data, data + len);
+	spooled_ += (int64_t) len;
+}
+
+/*
+ * Reads from the connection until at least "upto" bytes of the request body
+ * have been received, or the entire body has been received.  Returns false if
+ * the request was aborted or the connection lost.
+ */
+bool
+BPSGIInputStream::Fill(int64_t upto)
+{
+	while (spooled_ < upto && !complete_)
+	{
+		if (failed_)
+			return false;
+
+		const char *data;
+		size_t len;
+		int ret = conn_->ReadStdin(request_->request_id(), &data, &len);
+		if (ret == 1)
+			Spool(data, len);
+		else if (ret == 0)
+			complete_ = true;
+		else
+		{
+			failed_ = true;
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Returns the number of bytes read, 0 at the end of the request body, or -1
+ * if the request body could not be read.
+ */
+ssize_t
+BPSGIInputStream::Read(char *buf, size_t len)
+{
+	if (len == 0)
+		return 0;
+	if (!Fill(pos_ + 1))
+		return -1;
+	if (pos_ >= spooled_)
+		return 0;
+
+	size_t n = (size_t) std::min((int64_t) len, spooled_ - pos_);
+	if (!in_memfd_)
+	{
+		memcpy(buf, data_.data() + pos_, n);
+		pos_ += (int64_t) n;
+		return (ssize_t) n;
+	}
+
+	for (;;)
+	{
+		ssize_t ret = pread(memfd_, buf, n, (off_t) pos_);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			throw SyscallException("pread", errno);
+		}
+		pos_ += (int64_t) ret;
+		return ret;
+	}
+}
+
+bool
+BPSGIInputStream::Seek(int64_t offset, int whence)
+{
+	int64_t newpos;
+
+	if (whence == SEEK_SET)
+		newpos = offset;
+	else if (whence == SEEK_CUR)
+		newpos = pos_ + offset;
+	else if (whence == SEEK_END)
+	{
+		/* need to know where the end is */
+		if (!Fill(INT64_MAX))
+			return false;
+		newpos = spooled_ + offset;
+	}
+	else
+		return false;
+
+	if (newpos < 0)
+		return false;
+	pos_ = newpos;
+	return true;
+}
+
+/*
+ * Reads and discards whatever the application didn't read of the request
+ * body, so that the connection can be used for the next request.  Returns
+ * false if that wasn't possible.
+ */
+bool
+BPSGIInputStream::Drain()
+{
+	while (!complete_)
+	{
+		if (failed_)
+			return false;
+
+		const char *data;
+		size_t len;
+		int ret = conn_->ReadStdin(request_->request_id(), &data, &len);
+		if (ret == 0)
+			complete_ = true;
+		else if (ret == -1)
+		{
+			failed_ = true;
+			return false;
+		}
+	}
+	return true;
+}
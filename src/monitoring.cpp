@@ -4,9 +4,25 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/unix_diag.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
 #include <sstream>
 
+/*
+ * How often the accept queues are sampled for the backlog peaks, whether or
+ * not anyone is reading the statistics.
+ */
+#define BACKLOG_SAMPLE_INTERVAL_USEC	100000
+
 
 static std::string
 int64_to_string(int64_t value)
@@ -25,11 +41,181 @@ monitoring_sigquit_handler(int _unused)
 }
 
 
+/*
+ * Asks sock_diag for the accept queue of a listening UNIX domain socket.  For
+ * listening sockets, the "receive queue" is the number of connections waiting
+ * to be accepted and the "write queue" is the backlog limit.  /proc/net/unix
+ * doesn't carry this information, so there's no fallback; if sock_diag isn't
+ * available, false is returned.
+ */
+static bool
+unix_socket_backlog(int sockfd, int64_t *queued, int64_t *limit)
+{
+	struct stat st;
+	if (fstat(sockfd, &st) == -1)
+		return false;
+
+	int nlfd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (nlfd == -1)
+		return false;
+
+	struct {
+		struct nlmsghdr nlh;
+		struct unix_diag_req req;
+	} msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.nlh.nlmsg_len = sizeof(msg);
+	msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	msg.nlh.nlmsg_flags = NLM_F_REQUEST;
+	msg.req.sdiag_family = AF_UNIX;
+	msg.req.udiag_states = 1 << 10;		/* TCP_LISTEN */
+	msg.req.udiag_ino = (__u32) st.st_ino;
+	msg.req.udiag_show = UDIAG_SHOW_RQLEN;
+	/* look the socket up by inode only */
+	msg.req.udiag_cookie[0] = ~0U;
+	msg.req.udiag_cookie[1] = ~0U;
+
+	if (send(nlfd, &msg, sizeof(msg), 0) != (ssize_t) sizeof(msg))
+	{
+		close(nlfd);
+		return false;
+	}
+
+	long buf[1024];
+	ssize_t len = recv(nlfd, buf, sizeof(buf), 0);
+	close(nlfd);
+	if (len <= 0)
+		return false;
+
+	struct nlmsghdr *nlh = (struct nlmsghdr *) buf;
+	if (!NLMSG_OK(nlh, (size_t) len) || nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY)
+		return false;
+
+	struct unix_diag_msg *diag = (struct unix_diag_msg *) NLMSG_DATA(nlh);
+	int attrlen = (int) (nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*diag)));
+	for (struct rtattr *attr = (struct rtattr *) (diag + 1);
+		 RTA_OK(attr, attrlen);
+		 attr = RTA_NEXT(attr, attrlen))
+	{
+		if (attr->rta_type == UNIX_DIAG_RQLEN)
+		{
+			struct unix_diag_rqlen *rqlen = (struct unix_diag_rqlen *) RTA_DATA(attr);
+			*queued = rqlen->udiag_rqueue;
+			*limit = rqlen->udiag_wqueue;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * For listening TCP sockets, TCP_INFO reports the accept queue in the
+ * otherwise unused tcpi_unacked and tcpi_sacked fields.
+ */
+static bool
+tcp_socket_backlog(int sockfd, int64_t *queued, int64_t *limit)
+{
+	struct tcp_info info;
+	socklen_t infolen = sizeof(info);
+
+	if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &infolen) == -1)
+		return false;
+	*queued = info.tcpi_unacked;
+	*limit = info.tcpi_sacked;
+	return true;
+}
+
+/*
+ * Reads the TcpExt ListenOverflows and ListenDrops counters.  These are kept
+ * per network namespace, not per socket.
+ */
+static bool
+read_tcp_listen_drops(int64_t *overflows, int64_t *drops)
+{
+	std::ifstream netstat("/proc/net/netstat");
+	std::string names, values;
+
+	while (std::getline(netstat, names) && std::getline(netstat, values))
+	{
+		if (names.compare(0, 7, "TcpExt:") != 0)
+			continue;
+
+		std::istringstream namestream(names), valuestream(values);
+		std::string name, value;
+		bool found_overflows = false, found_drops = false;
+		while (namestream >> name && valuestream >> value)
+		{
+			if (name == "ListenOverflows")
+			{
+				*overflows = strtoll(value.c_str(), NULL, 10);
+				found_overflows = true;
+			}
+			else if (name == "ListenDrops")
+			{
+				*drops = strtoll(value.c_str(), NULL, 10);
+				found_drops = true;
+			}
+		}
+		return found_overflows && found_drops;
+	}
+	return false;
+}
+
+
 BPSGIMonitoring::BPSGIMonitoring(BPSGIMainApplication *mainapp)
-	: mainapp_(mainapp)
+	: mainapp_(mainapp),
+	  backlog_available_(false),
+	  backlog_(0),
+	  backlog_limit_(0),
+	  backlog_peak_(0),
+	  lane_backlog_(mainapp->lanes().size(), 0),
+	  lane_backlog_peak_(mainapp->lanes().size(), 0)
 {
 }
 
+/*
+ * Samples the accept queue of the FastCGI listen socket(s) of every lane.
+ * With --reuseport, the queues of all workers' sockets are added up.
+ */
+void
+BPSGIMonitoring::SampleBacklog()
+{
+	auto &lanes = mainapp_->lanes();
+	int64_t total = 0;
+	int64_t total_limit = 0;
+
+	for (size_t i = 0; i < lanes.size(); i++)
+	{
+		int64_t lane_total = 0;
+
+		for (int sockfd : lanes[i].sockfds)
+		{
+			int64_t queued, limit;
+			bool ok;
+
+			if (lanes[i].is_tcp)
+				ok = tcp_socket_backlog(sockfd, &queued, &limit);
+			else
+				ok = unix_socket_backlog(sockfd, &queued, &limit);
+			if (!ok)
+			{
+				backlog_available_ = false;
+				return;
+			}
+			lane_total += queued;
+			total_limit += limit;
+		}
+		lane_backlog_[i] = lane_total;
+		lane_backlog_peak_[i] = std::max(lane_backlog_peak_[i], lane_total);
+		total += lane_total;
+	}
+
+	backlog_available_ = true;
+	backlog_ = total;
+	backlog_limit_ = total_limit;
+	backlog_peak_ = std::max(backlog_peak_, total);
+}
+
 void
 BPSGIMonitoring::HandleClient(int listensockfd, int64_t bladepsgi_start_time, std::vector<char> worker_status_array)
 {
@@ -59,6 +245,212 @@ BPSGIMonitoring::HandleClient(int listensockfd, int64_t bladepsgi_start_time, st
 	for (auto && atm : shmem->atomics_)
 		statdata += "atomic " + atm->name() + ": " + int64_to_string(atm->Read()) + "\n";
 
+	int64_t total_connections = 0;
+	int64_t total_keepalive_requests = 0;
+	int64_t total_keepalive_drops = 0;
+	int64_t total_dispatch_wait_usec = 0;
+	int64_t queue_wait_histogram[QUEUE_WAIT_HISTOGRAM_BUCKETS] = { 0 };
+	int64_t total_queue_wait_usec = 0;
+	int64_t total_queue_wait_missing = 0;
+	int64_t total_queue_deadline_drops = 0;
+	int64_t total_static_responses = 0;
+	int64_t total_recycles = 0;
+	int64_t total_rss_bytes = 0;
+	int64_t total_memory_recycles = 0;
+	bool memory_limits = mainapp_->options().max_rss > 0 || mainapp_->options().max_private_dirty > 0;
+	/* running workers of each generation; more than one while reloading */
+	std::map<int64_t, int64_t> generation_workers;
+	std::string workerdata;
+	for (WorkerNo workerno = 0; workerno < mainapp_->nworkers(); workerno++)
+	{
+		auto stats = shmem->WorkerStats(workerno);
+		auto prefix = "worker " + int64_to_string(workerno) + " ";
+		int64_t connections = std::atomic_load(&stats->connections);
+		int64_t keepalive_requests = std::atomic_load(&stats->keepalive_requests);
+		int64_t keepalive_drops = std::atomic_load(&stats->keepalive_drops);
+
+		total_connections += connections;
+		total_keepalive_requests += keepalive_requests;
+		total_keepalive_drops += keepalive_drops;
+
+		int64_t generation = std::atomic_load(&stats->generation);
+		if (worker_status_array[(size_t) workerno] != WORKER_STATUS_NO_PROCESS)
+			generation_workers[generation]++;
+
+		workerdata += prefix + "requests: " + int64_to_string(std::atomic_load(&stats->requests)) + "\n";
+		workerdata += prefix + "connections: " + int64_to_string(connections) + "\n";
+		workerdata += prefix + "keepalive_requests: " + int64_to_string(keepalive_requests) + "\n";
+		workerdata += prefix + "connection_requests: " + int64_to_string(std::atomic_load(&stats->connection_requests)) + "\n";
+		workerdata += prefix + "keepalive_drops: " + int64_to_string(keepalive_drops) + "\n";
+		workerdata += prefix + "generation: " + int64_to_string(generation) + "\n";
+		if (mainapp_->options().offload_senders > 0)
+			workerdata += prefix + "offloaded_responses: " + int64_to_string(std::atomic_load(&stats->offloaded_responses)) + "\n";
+		if (mainapp_->options().dispatcher)
+		{
+			int64_t dispatch_wait_usec = std::atomic_load(&stats->dispatch_wait_usec);
+			total_dispatch_wait_usec += dispatch_wait_usec;
+			workerdata += prefix + "dispatch_wait_usec: " + int64_to_string(dispatch_wait_usec) + "\n";
+		}
+		if (!mainapp_->options().queue_time_param.empty())
+		{
+			int64_t queue_deadline_drops = std::atomic_load(&stats->queue_deadline_drops);
+
+			for (int i = 0; i < QUEUE_WAIT_HISTOGRAM_BUCKETS; i++)
+				queue_wait_histogram[i] += std::atomic_load(&stats->queue_wait_histogram[i]);
+			total_queue_wait_usec += std::atomic_load(&stats->queue_wait_usec);
+			total_queue_wait_missing += std::atomic_load(&stats->queue_wait_missing);
+			total_queue_deadline_drops += queue_deadline_drops;
+			workerdata += prefix + "queue_deadline_drops: " + int64_to_string(queue_deadline_drops) + "\n";
+		}
+		if (!mainapp_->options().static_mappings.empty())
+		{
+			int64_t static_responses = std::atomic_load(&stats->static_responses);
+			total_static_responses += static_responses;
+			workerdata += prefix + "static_responses: " + int64_to_string(static_responses) + "\n";
+		}
+		if (mainapp_->options().max_requests > 0)
+		{
+			int64_t recycles = std::atomic_load(&stats->recycles);
+			total_recycles += recycles;
+			workerdata += prefix + "recycles: " + int64_to_string(recycles) + "\n";
+		}
+		if (memory_limits)
+		{
+			int64_t rss_bytes = std::atomic_load(&stats->rss_bytes);
+			int64_t memory_recycles = std::atomic_load(&stats->memory_recycles);
+			total_rss_bytes += rss_bytes;
+			total_memory_recycles += memory_recycles;
+			workerdata += prefix + "rss_bytes: " + int64_to_string(rss_bytes) + "\n";
+			workerdata += prefix + "rss_peak_bytes: " + int64_to_string(std::atomic_load(&stats->rss_peak_bytes)) + "\n";
+			if (mainapp_->options().max_private_dirty > 0)
+				workerdata += prefix + "private_dirty_bytes: " + int64_to_string(std::atomic_load(&stats->private_dirty_bytes)) + "\n";
+			workerdata += prefix + "memory_recycles: " + int64_to_string(memory_recycles) + "\n";
+		}
+	}
+	statdata += "counter fastcgi_connections: " + int64_to_string(total_connections) + "\n";
+	statdata += "counter fastcgi_keepalive_requests: " + int64_to_string(total_keepalive_requests) + "\n";
+	statdata += "counter fastcgi_keepalive_drops: " + int64_to_string(total_keepalive_drops) + "\n";
+
+	/*
+	 * The histogram is cumulative, like Prometheus' histograms: each bucket
+	 * counts the requests which waited for at most its bound.
+	 */
+	if (!mainapp_->options().queue_time_param.empty())
+	{
+		int64_t cumulative = 0;
+		for (int i = 0; i < QUEUE_WAIT_HISTOGRAM_BUCKETS; i++)
+		{
+			cumulative += queue_wait_histogram[i];
+			if (i < QUEUE_WAIT_HISTOGRAM_BUCKETS - 1)
+				statdata += "counter queue_wait_ms_le_" + int64_to_string(queue_wait_histogram_bounds_ms[i]) + ": " + int64_to_string(cumulative) + "\n";
+			else
+				statdata += "counter queue_wait_ms_le_inf: " + int64_to_string(cumulative) + "\n";
+		}
+		statdata += "counter queue_wait_usec: " + int64_to_string(total_queue_wait_usec) + "\n";
+		statdata += "counter queue_wait_missing: " + int64_to_string(total_queue_wait_missing) + "\n";
+		statdata += "counter queue_deadline_drops: " + int64_to_string(total_queue_deadline_drops) + "\n";
+	}
+
+	if (!mainapp_->options().static_mappings.empty())
+		statdata += "counter static_responses: " + int64_to_string(total_static_responses) + "\n";
+	if (mainapp_->options().max_requests > 0)
+		statdata += "counter worker_recycles: " + int64_to_string(total_recycles) + "\n";
+	if (memory_limits)
+	{
+		statdata += "gauge worker_rss_bytes: " + int64_to_string(total_rss_bytes) + "\n";
+		statdata += "counter worker_memory_recycles: " + int64_to_string(total_memory_recycles) + "\n";
+	}
+
+	SampleBacklog();
+	if (backlog_available_)
+	{
+		statdata += "gauge fastcgi_backlog: " + int64_to_string(backlog_) + "\n";
+		statdata += "gauge fastcgi_backlog_limit: " + int64_to_string(backlog_limit_) + "\n";
+		statdata += "gauge fastcgi_backlog_peak: " + int64_to_string(backlog_peak_) + "\n";
+	}
+	bool any_tcp = false;
+	for (auto && lane : mainapp_->lanes())
+		any_tcp = any_tcp || lane.is_tcp;
+	int64_t overflows, drops;
+	if (any_tcp && read_tcp_listen_drops(&overflows, &drops))
+	{
+		statdata += "counter tcp_listen_overflows: " + int64_to_string(overflows) + "\n";
+		statdata += "counter tcp_listen_drops: " + int64_to_string(drops) + "\n";
+	}
+	if (mainapp_->options().dispatcher)
+	{
+		auto dstats = shmem->DispatcherStats();
+		statdata += "counter dispatcher_connections: " + int64_to_string(std::atomic_load(&dstats->connections)) + "\n";
+		statdata += "counter dispatcher_requests: " + int64_to_string(std::atomic_load(&dstats->requests)) + "\n";
+		statdata += "counter dispatcher_wait_usec: " + int64_to_string(total_dispatch_wait_usec) + "\n";
+		statdata += "gauge dispatcher_open_connections: " + int64_to_string(std::atomic_load(&dstats->open_connections)) + "\n";
+		statdata += "gauge dispatcher_queued_requests: " + int64_to_string(std::atomic_load(&dstats->queued_requests)) + "\n";
+		statdata += "counter dispatcher_shed_queue_depth: " + int64_to_string(std::atomic_load(&dstats->shed_queue_depth)) + "\n";
+		statdata += "counter dispatcher_shed_queue_age: " + int64_to_string(std::atomic_load(&dstats->shed_queue_age)) + "\n";
+		statdata += "counter dispatcher_shed_busy_ratio: " + int64_to_string(std::atomic_load(&dstats->shed_busy_ratio)) + "\n";
+	}
+	statdata += "counter worker_crashes: " + int64_to_string(std::atomic_load(&shmem->PoolStats()->crashes)) + "\n";
+	statdata += "gauge generation: " + int64_to_string(std::atomic_load(&shmem->PoolStats()->generation)) + "\n";
+	for (auto && entry : generation_workers)
+		statdata += "gauge generation_" + int64_to_string(entry.first) + "_workers: " + int64_to_string(entry.second) + "\n";
+	if (mainapp_->autoscaling())
+	{
+		auto pstats = shmem->PoolStats();
+		statdata += "gauge pool_workers: " + int64_to_string(std::atomic_load(&pstats->workers)) + "\n";
+		statdata += "gauge pool_min_workers: " + int64_to_string(std::atomic_load(&pstats->min_workers)) + "\n";
+		statdata += "gauge pool_max_workers: " + int64_to_string(std::atomic_load(&pstats->max_workers)) + "\n";
+		statdata += "gauge pool_spare_workers: " + int64_to_string(std::atomic_load(&pstats->spare_workers)) + "\n";
+		statdata += "counter pool_spawns: " + int64_to_string(std::atomic_load(&pstats->spawns)) + "\n";
+		statdata += "counter pool_retirements: " + int64_to_string(std::atomic_load(&pstats->retirements)) + "\n";
+	}
+
+	/*
+	 * Only worth a section of its own if there's more than one lane; with a
+	 * single lane, everything above already describes it.
+	 */
+	auto &lanes = mainapp_->lanes();
+	for (size_t i = 0; lanes.size() > 1 && i < lanes.size(); i++)
+	{
+		auto &lane = lanes[i];
+		auto prefix = "lane " + lane.name + " ";
+		int64_t requests = 0;
+		int64_t connections = 0;
+
+		for (WorkerNo workerno = lane.first_worker; workerno < lane.first_worker + lane.nworkers; workerno++)
+		{
+			auto stats = shmem->WorkerStats(workerno);
+			requests += std::atomic_load(&stats->requests);
+			connections += std::atomic_load(&stats->connections);
+		}
+		statdata += prefix + "workers: " + int64_to_string(lane.first_worker) + "-" + int64_to_string(lane.first_worker + lane.nworkers - 1) + "\n";
+		statdata += prefix + "status: " + std::string(worker_status_array.data() + lane.first_worker, (size_t) lane.nworkers) + "\n";
+		statdata += prefix + "requests: " + int64_to_string(requests) + "\n";
+		statdata += prefix + "connections: " + int64_to_string(connections) + "\n";
+		if (mainapp_->autoscaling())
+		{
+			auto begin = worker_status_array.begin() + lane.first_worker;
+			auto running = lane.nworkers - std::count(begin, begin + lane.nworkers, WORKER_STATUS_NO_PROCESS);
+			statdata += prefix + "running_workers: " + int64_to_string(running) + "\n";
+		}
+		if (backlog_available_)
+		{
+			statdata += prefix + "backlog: " + int64_to_string(lane_backlog_[i]) + "\n";
+			statdata += prefix + "backlog_peak: " + int64_to_string(lane_backlog_peak_[i]) + "\n";
+		}
+	}
+	statdata += workerdata;
+	for (int senderno = 0; senderno < mainapp_->options().offload_senders; senderno++)
+	{
+		auto stats = shmem->SenderStats(senderno);
+		auto prefix = "sender " + int64_to_string(senderno) + " ";
+
+		statdata += prefix + "responses: " + int64_to_string(std::atomic_load(&stats->responses)) + "\n";
+		statdata += prefix + "failed_responses: " + int64_to_string(std::atomic_load(&stats->failed_responses)) + "\n";
+		statdata += prefix + "bytes_sent: " + int64_to_string(std::atomic_load(&stats->bytes_sent)) + "\n";
+		statdata += prefix + "queued_responses: " + int64_to_string(std::atomic_load(&stats->queued_responses)) + "\n";
+		statdata += prefix + "bytes_in_flight: " + int64_to_string(std::atomic_load(&stats->bytes_in_flight)) + "\n";
+	}
+
 	auto written = write(clientfd, statdata.c_str(), statdata.size());
 	(void) written;
 	shutdown(clientfd, SHUT_RDWR);
@@ -81,6 +473,7 @@ BPSGIMonitoring::Run()
 	auto shmem = mainapp_->shmem();
 
 	time_t bladepsgi_start_time = time(NULL);
+	int64_t next_sample_at = BPSGIMonotonicTimeUsec();
 
 	for (;;)
 	{
@@ -94,9 +487,17 @@ BPSGIMonitoring::Run()
 			_exit(1);
 		}
 
+		/* statistics requests don't push the next sample back */
+		int64_t now = BPSGIMonotonicTimeUsec();
+		if (now >= next_sample_at)
+		{
+			SampleBacklog();
+			next_sample_at = now + BACKLOG_SAMPLE_INTERVAL_USEC;
+		}
+
 		memset(&tv, 0, sizeof(tv));
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
+		tv.tv_sec = (time_t) ((next_sample_at - now) / 1000000);
+		tv.tv_usec = (suseconds_t) ((next_sample_at - now) % 1000000);
 
 		FD_ZERO(&fds);
 		FD_SET(listen_sockfd, &fds);
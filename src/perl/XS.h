@@ -1,6 +1,7 @@
 #ifndef __BLADEPSGI_INPUT_STREAM_HEADER__
 #define __BLADEPSGI_INPUT_STREAM_HEADER__
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct
@@ -16,6 +17,11 @@ typedef struct
 
 typedef int64_t BPSGI_AtomicInt64;
 
+/* opaque handles to BPSGIRequest, BPSGIInputStream and BPSGIStreamWriter */
+typedef struct BPSGI_Request BPSGI_Request;
+typedef struct BPSGI_Input BPSGI_Input;
+typedef struct BPSGI_Writer BPSGI_Writer;
+
 /* glue functions defined in perl_interpreter_sea_bridge.cpp */
 extern void
 bladepsgi_perl_interpreter_cb_set_worker_status(BPSGI_Context *ctx, const char *status);
@@ -43,6 +49,46 @@ extern int64_t
 bladepsgi_perl_interpreter_cb_atomic_int64_load(BPSGI_AtomicInt64 *atm);
 extern void
 bladepsgi_perl_interpreter_cb_atomic_int64_store(BPSGI_AtomicInt64 *atm, int64_t value);
+extern int
+bladepsgi_perl_interpreter_cb_request_num_params(BPSGI_Request *req);
+extern void
+bladepsgi_perl_interpreter_cb_request_param(BPSGI_Request *req, int i, const char **name, size_t *namelen, const char **value, size_t *valuelen);
+extern const char *
+bladepsgi_perl_interpreter_cb_request_find_param(BPSGI_Request *req, const char *name, size_t *valuelen);
+extern BPSGI_Input *
+bladepsgi_perl_interpreter_cb_request_input(BPSGI_Request *req);
+extern int
+bladepsgi_perl_interpreter_cb_request_write(BPSGI_Request *req, const char *data, size_t len);
+extern int
+bladepsgi_perl_interpreter_cb_request_flush(BPSGI_Request *req);
+extern void
+bladepsgi_perl_interpreter_cb_request_begin_headers(BPSGI_Request *req, int status);
+extern int
+bladepsgi_perl_interpreter_cb_request_add_header(BPSGI_Request *req, const char *name, size_t namelen, const char *value, size_t valuelen);
+extern int
+bladepsgi_perl_interpreter_cb_request_finish_headers(BPSGI_Request *req);
+extern int
+bladepsgi_perl_interpreter_cb_request_sendfile(BPSGI_Request *req, int fd, int64_t offset);
+extern BPSGI_Writer *
+bladepsgi_perl_interpreter_cb_request_writer(BPSGI_Request *req);
+extern int64_t
+bladepsgi_perl_interpreter_cb_input_read(BPSGI_Input *input, char *buf, size_t len);
+extern int
+bladepsgi_perl_interpreter_cb_input_seek(BPSGI_Input *input, int64_t offset, int whence);
+extern int64_t
+bladepsgi_perl_interpreter_cb_input_tell(BPSGI_Input *input);
+extern int
+bladepsgi_perl_interpreter_cb_writer_write(BPSGI_Writer *writer, const char *data, size_t len);
+extern int
+bladepsgi_perl_interpreter_cb_writer_close(BPSGI_Writer *writer);
+extern int
+bladepsgi_perl_interpreter_cb_writer_wait_writable(BPSGI_Writer *writer);
+extern int64_t
+bladepsgi_perl_interpreter_cb_writer_written(BPSGI_Writer *writer);
+extern int
+bladepsgi_perl_interpreter_cb_writer_polling(BPSGI_Writer *writer);
+extern void
+bladepsgi_perl_interpreter_cb_writer_set_polling(BPSGI_Writer *writer, int polling);
 
 
 #endif
@@ -3,6 +3,7 @@
 #include "XSUB.h"
 
 #include "XS.h"
+#include "bladepsgi_perl.h"
 
 MODULE = BPSGI PACKAGE=BPSGI::Context PREFIX = bladepsgi_context_
 PROTOTYPES: DISABLE
@@ -59,6 +60,14 @@ bladepsgi_context_request_auxiliary_process(CTX,NAME,CBACK)
             croak("could not create a new semaphore %s: %s\n", NAME, error);
         SvREFCNT_inc(CBACK);
 
+void
+bladepsgi_context_set_psgi_env_template(CTX,ENV)
+    BPSGI_Context *CTX
+    HV *ENV
+    CODE:
+        (void) CTX;
+        bladepsgi_perl_set_psgi_env_template(ENV);
+
 SV *
 bladepsgi_context_new_semaphore(CTX,NAME,VALUE)
     BPSGI_Context *CTX
@@ -144,3 +153,212 @@ bladepsgi_atomic_int64_store(ATM,VAL)
     int VAL
     CODE:
         bladepsgi_perl_interpreter_cb_atomic_int64_store(ATM,VAL);
+
+MODULE = BPSGI PACKAGE=BPSGI::Request PREFIX = bladepsgi_request_
+PROTOTYPES: DISABLE
+
+SV *
+bladepsgi_request_write(REQ,DATA)
+    BPSGI_Request *REQ
+    SV *DATA
+    CODE:
+        STRLEN len;
+        const char *data = SvPV(DATA, len);
+        RETVAL = boolSV(bladepsgi_perl_interpreter_cb_request_write(REQ, data, len));
+    OUTPUT:
+        RETVAL
+
+SV *
+bladepsgi_request_flush(REQ)
+    BPSGI_Request *REQ
+    CODE:
+        RETVAL = boolSV(bladepsgi_perl_interpreter_cb_request_flush(REQ));
+    OUTPUT:
+        RETVAL
+
+SV *
+bladepsgi_request_write_response_headers(REQ,STATUS,HEADERS)
+    BPSGI_Request *REQ
+    int STATUS
+    SV *HEADERS
+    CODE:
+        AV *headers;
+        SSize_t i, n;
+
+        if (!SvROK(HEADERS) || SvTYPE(SvRV(HEADERS)) != SVt_PVAV)
+            croak("response headers must be an ARRAY reference\n");
+        headers = (AV *) SvRV(HEADERS);
+        n = av_len(headers) + 1;
+        if (n % 2 != 0)
+            croak("odd number of elements in response headers\n");
+
+        bladepsgi_perl_interpreter_cb_request_begin_headers(REQ, STATUS);
+        for (i = 0; i < n; i += 2)
+        {
+            SV **name = av_fetch(headers, i, 0);
+            SV **value = av_fetch(headers, i + 1, 0);
+            const char *namep = "", *valuep = "";
+            STRLEN namelen = 0, valuelen = 0;
+
+            if (name != NULL)
+                namep = SvPV(*name, namelen);
+            if (value != NULL)
+                valuep = SvPV(*value, valuelen);
+            if (!bladepsgi_perl_interpreter_cb_request_add_header(REQ, namep, namelen, valuep, valuelen))
+                croak("invalid response header %ld: names must be tokens, and values can't contain control characters\n", (long) (i / 2));
+        }
+        RETVAL = boolSV(bladepsgi_perl_interpreter_cb_request_finish_headers(REQ));
+    OUTPUT:
+        RETVAL
+
+SV *
+bladepsgi_request_sendfile(REQ,FD,OFFSET)
+    BPSGI_Request *REQ
+    int FD
+    IV OFFSET
+    CODE:
+        RETVAL = newSViv(bladepsgi_perl_interpreter_cb_request_sendfile(REQ, FD, OFFSET));
+    OUTPUT:
+        RETVAL
+
+SV *
+bladepsgi_request_writer(REQ)
+    BPSGI_Request *REQ
+    CODE:
+        RETVAL = newSViv(0);
+        RETVAL = sv_setref_pv(RETVAL, "BPSGI::Writer", bladepsgi_perl_interpreter_cb_request_writer(REQ));
+    OUTPUT:
+        RETVAL
+
+MODULE = BPSGI PACKAGE=BPSGI::Input PREFIX = bladepsgi_input_
+PROTOTYPES: DISABLE
+
+SV *
+bladepsgi_input_read(IN,BUF,LEN,...)
+    BPSGI_Input *IN
+    SV *BUF
+    IV LEN
+    CODE:
+        STRLEN curlen;
+        IV offset = 0;
+        char *p;
+        int64_t nread;
+
+        if (items > 3)
+            offset = SvIV(ST(3));
+        if (LEN < 0)
+            croak("negative length passed to read\n");
+        if (!SvOK(BUF))
+            sv_setpvs(BUF, "");
+        (void) SvPV_force(BUF, curlen);
+        if (offset < 0)
+        {
+            if ((STRLEN) -offset > curlen)
+                croak("offset outside string\n");
+            offset += curlen;
+        }
+        p = SvGROW(BUF, offset + LEN + 1);
+        if ((STRLEN) offset > curlen)
+            memset(p + curlen, 0, offset - curlen);
+        nread = bladepsgi_perl_interpreter_cb_input_read(IN, p + offset, LEN);
+        if (nread < 0)
+            XSRETURN_UNDEF;
+        SvCUR_set(BUF, offset + nread);
+        *SvEND(BUF) = '\0';
+        SvUTF8_off(BUF);
+        SvSETMAGIC(BUF);
+        RETVAL = newSViv(nread);
+    OUTPUT:
+        RETVAL
+
+SV *
+bladepsgi_input_seek(IN,POS,WHENCE)
+    BPSGI_Input *IN
+    IV POS
+    int WHENCE
+    CODE:
+        RETVAL = boolSV(bladepsgi_perl_interpreter_cb_input_seek(IN, POS, WHENCE));
+    OUTPUT:
+        RETVAL
+
+SV *
+bladepsgi_input_tell(IN)
+    BPSGI_Input *IN
+    CODE:
+        RETVAL = newSViv(bladepsgi_perl_interpreter_cb_input_tell(IN));
+    OUTPUT:
+        RETVAL
+
+SV *
+bladepsgi_input_close(IN)
+    BPSGI_Input *IN
+    CODE:
+        (void) IN;
+        RETVAL = &PL_sv_yes;
+    OUTPUT:
+        RETVAL
+
+MODULE = BPSGI PACKAGE=BPSGI::Writer PREFIX = bladepsgi_writer_
+PROTOTYPES: DISABLE
+
+SV *
+bladepsgi_writer_write(W,DATA)
+    BPSGI_Writer *W
+    SV *DATA
+    CODE:
+        STRLEN len;
+        const char *data = SvPV(DATA, len);
+        RETVAL = boolSV(bladepsgi_perl_interpreter_cb_writer_write(W, data, len) == 1);
+    OUTPUT:
+        RETVAL
+
+SV *
+bladepsgi_writer_close(W)
+    BPSGI_Writer *W
+    CODE:
+        RETVAL = boolSV(bladepsgi_perl_interpreter_cb_writer_close(W));
+    OUTPUT:
+        RETVAL
+
+void
+bladepsgi_writer_poll_cb(W,CB)
+    BPSGI_Writer *W
+    SV *CB
+    CODE:
+        SV *self = ST(0);
+
+        if (!SvOK(CB))
+        {
+            bladepsgi_perl_interpreter_cb_writer_set_polling(W, 0);
+            XSRETURN_EMPTY;
+        }
+
+        /*
+         * There's no event loop to come back to, so wait for the frontend
+         * right here and keep calling back for as long as the callback
+         * produces output, or until it closes the writer or unregisters
+         * itself.
+         */
+        bladepsgi_perl_interpreter_cb_writer_set_polling(W, 1);
+        while (bladepsgi_perl_interpreter_cb_writer_polling(W))
+        {
+            int64_t written;
+
+            if (!bladepsgi_perl_interpreter_cb_writer_wait_writable(W))
+                break;
+            written = bladepsgi_perl_interpreter_cb_writer_written(W);
+            {
+                dSP;
+                ENTER;
+                SAVETMPS;
+                PUSHMARK(SP);
+                XPUSHs(self);
+                PUTBACK;
+                call_sv(CB, G_VOID | G_DISCARD);
+                FREETMPS;
+                LEAVE;
+            }
+            if (bladepsgi_perl_interpreter_cb_writer_written(W) == written)
+                break;
+        }
+        bladepsgi_perl_interpreter_cb_writer_set_polling(W, 0);
@@ -24,6 +24,20 @@ bladepsgi_perl_per_process_init(void)
 	PERL_SYS_INIT3(&nargs, (char ***) &perl_args, &environ);
 }
 
+/*
+ * Returns 1 if more than one interpreter can exist in this process, which
+ * reloading the application needs, or 0 otherwise.
+ */
+int
+bladepsgi_perl_supports_multiple_interpreters(void)
+{
+#ifdef MULTIPLICITY
+	return 1;
+#else
+	return 0;
+#endif
+}
+
 static PerlInterpreter *my_perl = NULL;
 
 EXTERN_C void boot_DynaLoader(pTHX_ CV *cv);
@@ -268,3 +282,273 @@ bladepsgi_perl_callback_call_and_receive_callback(struct bladepsgi_perl_callback
 
 	return 0;
 }
+
+/*
+ * The entries of the PSGI environment which are the same for every request:
+ * the loader-supplied environment and the constant psgi.* keys.  They're
+ * collected into a template once, along with their precomputed hash values,
+ * so that every request's environment only needs a copy of each value
+ * instead of building and hashing its own.  The copies belong to the request
+ * and can be changed freely; the template's values themselves are read-only
+ * and never handed out.
+ */
+struct bladepsgi_env_template_entry_t {
+	const char *key;
+	I32 klen;
+	U32 hash;
+	SV *value;
+};
+
+static HV *psgi_env_template = NULL;
+static PerlInterpreter *psgi_env_template_interpreter = NULL;
+static struct bladepsgi_env_template_entry_t *psgi_env_template_entries = NULL;
+static int psgi_env_template_nentries = 0;
+
+static void
+bladepsgi_env_template_store(HV *template, const char *key, I32 klen, SV *value)
+{
+	SvREADONLY_on(value);
+	(void) hv_store(template, key, klen, value, 0);
+}
+
+void
+bladepsgi_perl_set_psgi_env_template(HV *loader_env)
+{
+	HV *template = newHV();
+	AV *version;
+	HE *he;
+	int i;
+
+	if (loader_env != NULL)
+	{
+		hv_iterinit(loader_env);
+		while ((he = hv_iternext(loader_env)) != NULL)
+		{
+			I32 klen = HeKUTF8(he) ? -HeKLEN(he) : HeKLEN(he);
+
+			/* copy the value so we don't make the loader's own hash read-only */
+			bladepsgi_env_template_store(template, HeKEY(he), klen, newSVsv(HeVAL(he)));
+		}
+	}
+
+	/* keys set by BladePSGI itself take precedence over the loader's environment */
+	version = newAV();
+	av_push(version, newSViv(1));
+	av_push(version, newSViv(1));
+	SvREADONLY_on((SV *) version);
+	bladepsgi_env_template_store(template, STR_WITH_LEN("psgi.version"), newRV_noinc((SV *) version));
+	/*
+	 * N.B: we intentionally don't send psgi.errors over the FastCGI
+	 * connection, as we want to have our own log stream instead of sending it
+	 * to whatever is waiting on the other side.
+	 */
+	bladepsgi_env_template_store(template, STR_WITH_LEN("psgi.errors"), newRV_inc((SV *) PL_stderrgv));
+
+	bladepsgi_env_template_store(template, STR_WITH_LEN("psgi.multithread"), newSVsv(&PL_sv_no));
+	bladepsgi_env_template_store(template, STR_WITH_LEN("psgi.multiprocess"), newSVsv(&PL_sv_yes));
+	bladepsgi_env_template_store(template, STR_WITH_LEN("psgi.run_once"), newSVsv(&PL_sv_no));
+	bladepsgi_env_template_store(template, STR_WITH_LEN("psgi.streaming"), newSVsv(&PL_sv_yes));
+	bladepsgi_env_template_store(template, STR_WITH_LEN("psgi.nonblocking"), newSVsv(&PL_sv_no));
+
+	/* the worker exits after the request if psgix.harakiri.commit is set */
+	bladepsgi_env_template_store(template, STR_WITH_LEN("psgix.harakiri"), newSVsv(&PL_sv_yes));
+	bladepsgi_env_template_store(template, STR_WITH_LEN("psgix.cleanup"), newSVsv(&PL_sv_yes));
+
+	/*
+	 * Remember the shared keys and their precomputed hash values, so that
+	 * storing them into a request's environment doesn't need to hash them
+	 * again.  The template hash itself is never modified after this.
+	 */
+	if (psgi_env_template != NULL)
+	{
+		free(psgi_env_template_entries);
+		/* a template left behind by a previous generation's interpreter can't be freed in this one */
+		if (psgi_env_template_interpreter == my_perl)
+			SvREFCNT_dec((SV *) psgi_env_template);
+	}
+	psgi_env_template = template;
+	psgi_env_template_interpreter = my_perl;
+	psgi_env_template_nentries = (int) HvUSEDKEYS(template);
+	psgi_env_template_entries = malloc(sizeof(struct bladepsgi_env_template_entry_t) * psgi_env_template_nentries);
+
+	i = 0;
+	hv_iterinit(template);
+	while ((he = hv_iternext(template)) != NULL)
+	{
+		struct bladepsgi_env_template_entry_t *entry = &psgi_env_template_entries[i++];
+
+		entry->key = HeKEY(he);
+		entry->klen = HeKUTF8(he) ? -HeKLEN(he) : HeKLEN(he);
+		entry->hash = HeHASH(he);
+		entry->value = HeVAL(he);
+	}
+}
+
+/*
+ * Builds the PSGI environment for a request: the FastCGI parameters, then the
+ * template on top of them, and finally the entries which differ per request.
+ */
+static HV *
+bladepsgi_build_psgi_env(BPSGI_Request *request)
+{
+	HV *env = newHV();
+	SV *input;
+	const char *https;
+	size_t httpslen;
+	int i, nparams;
+
+	if (psgi_env_template == NULL)
+		bladepsgi_perl_set_psgi_env_template(NULL);
+
+	nparams = bladepsgi_perl_interpreter_cb_request_num_params(request);
+	hv_ksplit(env, nparams + psgi_env_template_nentries + 2);
+	for (i = 0; i < nparams; i++)
+	{
+		const char *name, *value;
+		size_t namelen, valuelen;
+
+		bladepsgi_perl_interpreter_cb_request_param(request, i, &name, &namelen, &value, &valuelen);
+		(void) hv_store(env, name, namelen, newSVpvn(value, valuelen), 0);
+	}
+
+	for (i = 0; i < psgi_env_template_nentries; i++)
+	{
+		struct bladepsgi_env_template_entry_t *entry = &psgi_env_template_entries[i];
+
+		(void) hv_store(env, entry->key, entry->klen, newSVsv(entry->value), entry->hash);
+	}
+
+	https = bladepsgi_perl_interpreter_cb_request_find_param(request, "HTTPS", &httpslen);
+	if (https != NULL &&
+		((httpslen == 2 && strncasecmp(https, "on", 2) == 0) ||
+		 (httpslen == 1 && https[0] == '1')))
+		(void) hv_stores(env, "psgi.url_scheme", newSVpvs("https"));
+	else
+		(void) hv_stores(env, "psgi.url_scheme", newSVpvs("http"));
+
+	input = newSViv(0);
+	input = sv_setref_pv(input, "BPSGI::Input", bladepsgi_perl_interpreter_cb_request_input(request));
+	(void) hv_stores(env, "psgi.input", input);
+
+	/* run by the worker once the response has been sent */
+	(void) hv_stores(env, "psgix.cleanup.handlers", newRV_noinc((SV *) newAV()));
+
+	return env;
+}
+
+int
+bladepsgi_perl_callback_call_psgi_application(struct bladepsgi_perl_callback_t *cbs, BPSGI_Request *request, int *harakiri_out, char **error_out)
+{
+	SV *callback = (SV *) cbs->sv;
+	SV *reqsv;
+	SV **commit;
+	SV **handlers;
+	HV *env;
+	int ret = 0;
+
+	{
+		dSP;
+		ENTER;
+		SAVETMPS;
+		PUSHMARK(sp);
+		env = bladepsgi_build_psgi_env(request);
+		mXPUSHs(newRV_noinc((SV *) env));
+		reqsv = newSViv(0);
+		reqsv = sv_setref_pv(reqsv, "BPSGI::Request", (void *) request);
+		mXPUSHs(reqsv);
+		PUTBACK;
+		perl_call_sv(callback, G_SCALAR | G_EVAL | G_DISCARD);
+		SPAGAIN;
+
+		/* the environment is still alive until FREETMPS */
+		commit = hv_fetchs(env, "psgix.harakiri.commit", 0);
+		*harakiri_out = (commit != NULL && SvTRUE(*commit)) ? 1 : 0;
+
+		/* keep the environment around for the cleanup handlers, if any */
+		handlers = hv_fetchs(env, "psgix.cleanup.handlers", 0);
+		if (handlers != NULL && SvROK(*handlers) &&
+			SvTYPE(SvRV(*handlers)) == SVt_PVAV &&
+			av_len((AV *) SvRV(*handlers)) >= 0)
+			cbs->cleanup_env = (void *) newRV_inc((SV *) env);
+
+		if (SvTRUE(ERRSV))
+		{
+			*error_out = strdup(SvPV_nolen(ERRSV));
+			ret = -1;
+		}
+
+		PUTBACK;
+		FREETMPS;
+		LEAVE;
+	}
+	return ret;
+}
+
+int
+bladepsgi_perl_callback_has_cleanup_handlers(struct bladepsgi_perl_callback_t *cbs)
+{
+	return cbs->cleanup_env != NULL;
+}
+
+/*
+ * Runs the psgix.cleanup handlers of the last request.  Every handler is run
+ * even if some of them die; the first error is returned in error_out.
+ */
+int
+bladepsgi_perl_callback_run_cleanup_handlers(struct bladepsgi_perl_callback_t *cbs, int *harakiri_out, char **error_out)
+{
+	SV *envsv = (SV *) cbs->cleanup_env;
+	HV *env;
+	SV **handlers;
+	SV **commit;
+	I32 i;
+	int ret = 0;
+
+	*harakiri_out = 0;
+	if (envsv == NULL)
+		return 0;
+	cbs->cleanup_env = NULL;
+	env = (HV *) SvRV(envsv);
+
+	/* handlers may add more handlers, so check the length on every round */
+	for (i = 0; ; i++)
+	{
+		SV **handler;
+
+		handlers = hv_fetchs(env, "psgix.cleanup.handlers", 0);
+		if (handlers == NULL || !SvROK(*handlers) ||
+			SvTYPE(SvRV(*handlers)) != SVt_PVAV ||
+			i > av_len((AV *) SvRV(*handlers)))
+			break;
+		handler = av_fetch((AV *) SvRV(*handlers), i, 0);
+		if (handler == NULL)
+			continue;
+
+		{
+			dSP;
+			ENTER;
+			SAVETMPS;
+			PUSHMARK(sp);
+			XPUSHs(envsv);
+			PUTBACK;
+			perl_call_sv(*handler, G_VOID | G_EVAL | G_DISCARD);
+			SPAGAIN;
+
+			if (SvTRUE(ERRSV) && ret == 0)
+			{
+				*error_out = strdup(SvPV_nolen(ERRSV));
+				ret = -1;
+			}
+
+			PUTBACK;
+			FREETMPS;
+			LEAVE;
+		}
+	}
+
+	commit = hv_fetchs(env, "psgix.harakiri.commit", 0);
+	*harakiri_out = (commit != NULL && SvTRUE(*commit)) ? 1 : 0;
+
+	SvREFCNT_dec(envsv);
+	return ret;
+}
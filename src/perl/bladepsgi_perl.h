@@ -6,6 +6,8 @@
 struct bladepsgi_perl_callback_t {
 	void *bladepsgictx;
 	void *sv;
+	/* environment of the last request if it has psgix.cleanup handlers */
+	void *cleanup_env;
 };
 
 struct bladepsgi_psgi_application_t {
@@ -13,6 +15,7 @@ struct bladepsgi_psgi_application_t {
 };
 
 extern void bladepsgi_perl_per_process_init(void);
+extern int bladepsgi_perl_supports_multiple_interpreters(void);
 extern int bladepsgi_perl_interpreter_init(char **error_out);
 extern int bladepsgi_perl_interpreter_destroy(char **error_out);
 extern int bladepsgi_psgi_application_init(const char *path, char **error_out);
@@ -26,5 +29,14 @@ extern int bladepsgi_perl_callback_call(struct bladepsgi_perl_callback_t *cbs, c
 extern int bladepsgi_perl_callback_call_and_receive_callback(struct bladepsgi_perl_callback_t *cbs,
 															 char **error_out,
 															 struct bladepsgi_perl_callback_t **cbs_out);
+extern void bladepsgi_perl_set_psgi_env_template(struct hv *loader_env);
+extern int bladepsgi_perl_callback_call_psgi_application(struct bladepsgi_perl_callback_t *cbs,
+														 BPSGI_Request *request,
+														 int *harakiri_out,
+														 char **error_out);
+extern int bladepsgi_perl_callback_has_cleanup_handlers(struct bladepsgi_perl_callback_t *cbs);
+extern int bladepsgi_perl_callback_run_cleanup_handlers(struct bladepsgi_perl_callback_t *cbs,
+														int *harakiri_out,
+														char **error_out);
 
 #endif
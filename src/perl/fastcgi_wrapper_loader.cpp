@@ -4,9 +4,8 @@ package FastCGIWrapperLoader;
 use strict;
 use warnings;
 
-use FCGI;
 use Plack::Util;
-use HTTP::Status;
+use Scalar::Util;
 
 sub {
 	my $bladepsgi = shift;
@@ -51,83 +50,75 @@ sub {
 		$psgi_env = {};
 	}
 
-	my $sockfd = $bladepsgi->fastcgi_listen_sockfd();
+	# Every request's environment is built from a template of the loader's
+	# environment and the constant psgi.* keys, so they aren't copied over
+	# for each request.
+	$bladepsgi->set_psgi_env_template($psgi_env);
+
+	# Sends a body backed by a file descriptor straight from the kernel.
+	# Returns false if the body has to be sent through Perl instead.
+	my $send_file_body = sub {
+		my ($req, $body) = @_;
+
+		my ($fh, $offset);
+		if ((Scalar::Util::reftype($body) // '') eq 'GLOB' &&
+			(fileno($body) // -1) >= 0) {
+			($fh, $offset) = ($body, tell($body));
+			$offset = 0 if $offset < 0;
+		} elsif (Scalar::Util::blessed($body) && $body->can('path') &&
+				 defined(my $path = $body->path)) {
+			open($fh, '<:raw', $path) or return 0;
+			$offset = 0;
+		} else {
+			return 0;
+		}
 
-	my %env;
-	my ($stdin, $stdout, $stderr) = (IO::Handle->new, IO::Handle->new, IO::Handle->new);
-	my $req = FCGI::Request($stdin, $stdout, $stderr, \%env, $sockfd, FCGI::FAIL_ACCEPT_ON_INTR);
+		return 0 if $req->sendfile(fileno($fh), $offset) < 0;
+		$body->close;
+		return 1;
+	};
 
 	my $handle_response = sub {
-		my $res = shift;
-
-		$stdout->autoflush(1);
-		binmode($stdout);
-
-		my $hdrs;
-		my $message = HTTP::Status::status_message($res->[0]);
-		$hdrs = "Status: $res->[0] $message\r\n";
-
-		my $headers = $res->[1];
-		while (my ($k, $v) = splice @$headers, 0, 2) {
-			$hdrs .= "$k: $v\r\n";
+		my ($req, $res) = @_;
+
+		# Headers which can't be sent get a 500 instead, as if the
+		# application had died.
+		unless (eval { $req->write_response_headers($res->[0], $res->[1]); 1 }) {
+			warn $@;
+			$req->write_response_headers(500, ['Content-Type' => 'text/plain']);
+			$req->write("Internal Server Error\n");
+			return defined($res->[2]) ? undef : $req->writer;
 		}
-		$hdrs .= "\r\n";
 
-		my $write = sub { print { $stdout } $_[0] };
+		my $write = sub { $req->write($_[0]) };
 
-		$write->($hdrs);
 		my $body = $res->[2];
 		if (defined($body)) {
-			Plack::Util::foreach($body, $write);
+			if (ref($body) eq 'ARRAY' || !$send_file_body->($req, $body)) {
+				Plack::Util::foreach($body, $write);
+			}
 		} else {
-			return Plack::Util::inline_object(
-				write => $write,
-				close => sub { },
-			);
+			return $req->writer;
 		}
 	};
 
+	# The environment is built by BladePSGI from the FastCGI parameters, and
+	# the request is finished once we return.
 	return sub {
-		if ($req->Accept() < 0) {
-			return -1;
-		}
-
-		my $env = {
-			%env,
-			%$psgi_env,
-
-			'psgi.version'		=> [1,1],
-			'psgi.url_scheme'	=> ($env{HTTPS}||'off') =~ /^(?:on|1)$/i ? 'https' : 'http',
-			'psgi.input'		=> $stdin,
-			# N.B: we intentionally don't use $stderr here, as we want to have
-			# our own log stream instead of sending it to whatever is waiting on
-			# the other side of the FastCGI connection.  This could be
-			# configurable, but I doubt anyone would ever want to turn it off.
-			'psgi.errors'		=> \*STDERR,
-
-			'psgi.multithread'	=> Plack::Util::FALSE,
-			'psgi.multiprocess'	=> Plack::Util::TRUE,
-			'psgi.run_once'		=> Plack::Util::FALSE,
-			'psgi.streaming'	=> Plack::Util::TRUE,
-			'psgi.nonblocking'	=> Plack::Util::FALSE,
-
-			# harakiri not supported for now
-			'psgix.harakiri'	=> Plack::Util::FALSE,
-		};
+		my ($env, $req) = @_;
 
 		my $res = Plack::Util::run_app($psgi_app, $env);
 
 		if (ref($res) eq 'ARRAY') {
-			$handle_response->($res);
+			$handle_response->($req, $res);
 		} elsif (ref($res) eq 'CODE') {
 			$res->(sub {
-				$handle_response->($_[0]);
+				$handle_response->($req, $_[0]);
 			});
 		} else {
 			die "Bad response ".ref($res);
 		}
 
-		$req->Finish();
 		return 1;
 	};
 };
@@ -43,6 +43,12 @@ BPSGIPerlInterpreter::PerProcessInit()
 	bladepsgi_perl_per_process_init();
 }
 
+bool
+BPSGIPerlInterpreter::SupportsMultipleInterpreters()
+{
+	return bladepsgi_perl_supports_multiple_interpreters() != 0;
+}
+
 BPSGIPerlInterpreter::BPSGIPerlInterpreter(BPSGIMainApplication *mainapp)
 	: destroyed_(false),
 	  mainapp_(mainapp)
@@ -105,6 +111,43 @@ BPSGIPerlCallbackFunction::Call()
 		throw PerlInterpreterException("%s", error);
 }
 
+/*
+ * Returns true if the application asked for the worker to be retired after
+ * this request.
+ */
+bool
+BPSGIPerlCallbackFunction::CallPSGIApplication(BPSGIRequest *request)
+{
+	char *error;
+	int harakiri;
+	int ret = bladepsgi_perl_callback_call_psgi_application(p_, (BPSGI_Request *) request, &harakiri, &error);
+	if (ret == -1)
+		throw PerlInterpreterException("%s", error);
+	return harakiri != 0;
+}
+
+bool
+BPSGIPerlCallbackFunction::HasCleanupHandlers()
+{
+	return bladepsgi_perl_callback_has_cleanup_handlers(p_) != 0;
+}
+
+/*
+ * Runs the psgix.cleanup handlers registered by the last call to
+ * CallPSGIApplication.  *harakiri is set if a handler asked for the worker to
+ * be retired.
+ */
+void
+BPSGIPerlCallbackFunction::RunCleanupHandlers(bool *harakiri)
+{
+	char *error;
+	int harakiri_commit;
+	int ret = bladepsgi_perl_callback_run_cleanup_handlers(p_, &harakiri_commit, &error);
+	*harakiri = harakiri_commit != 0;
+	if (ret == -1)
+		throw PerlInterpreterException("%s", error);
+}
+
 unique_ptr<BPSGIPerlCallbackFunction>
 BPSGIPerlCallbackFunction::CallAndReceiveCallback()
 {
@@ -149,5 +149,233 @@ bladepsgi_perl_interpreter_cb_atomic_int64_store(BPSGI_AtomicInt64 *atm, int64_t
 	return std::atomic_store((std::atomic<int64_t> *) atm, value);
 }
 
+int
+bladepsgi_perl_interpreter_cb_request_num_params(BPSGI_Request *req)
+{
+	auto request = (BPSGIRequest *) req;
+	return request->num_params();
+}
+
+void
+bladepsgi_perl_interpreter_cb_request_param(BPSGI_Request *req, int i, const char **name, size_t *namelen, const char **value, size_t *valuelen)
+{
+	auto request = (BPSGIRequest *) req;
+	auto &param = request->param(i);
+
+	*name = param.name;
+	*namelen = param.namelen;
+	*value = param.value;
+	*valuelen = param.valuelen;
+}
+
+const char *
+bladepsgi_perl_interpreter_cb_request_find_param(BPSGI_Request *req, const char *name, size_t *valuelen)
+{
+	auto request = (BPSGIRequest *) req;
+	return request->FindParam(name, valuelen);
+}
+
+BPSGI_Input *
+bladepsgi_perl_interpreter_cb_request_input(BPSGI_Request *req)
+{
+	auto request = (BPSGIRequest *) req;
+	return (BPSGI_Input *) request->input();
+}
+
+/*
+ * Returns 1 on success, or 0 if the client connection has been lost.
+ */
+int
+bladepsgi_perl_interpreter_cb_request_write(BPSGI_Request *req, const char *data, size_t len)
+{
+	auto request = (BPSGIRequest *) req;
+
+	try {
+		return request->Write(data, len) ? 1 : 0;
+	} catch (const SyscallException &ex) {
+		/* can't throw through the Perl interpreter; treat as a lost client */
+		return 0;
+	}
+}
+
+/*
+ * Returns 1 on success, or 0 if the client connection has been lost.
+ */
+int
+bladepsgi_perl_interpreter_cb_request_flush(BPSGI_Request *req)
+{
+	auto request = (BPSGIRequest *) req;
+
+	try {
+		return request->Flush() ? 1 : 0;
+	} catch (const SyscallException &ex) {
+		return 0;
+	}
+}
+
+void
+bladepsgi_perl_interpreter_cb_request_begin_headers(BPSGI_Request *req, int status)
+{
+	auto request = (BPSGIRequest *) req;
+	request->BeginResponseHeaders(status);
+}
+
+/*
+ * Returns 1 on success, or 0 if the header is not valid.
+ */
+int
+bladepsgi_perl_interpreter_cb_request_add_header(BPSGI_Request *req, const char *name, size_t namelen, const char *value, size_t valuelen)
+{
+	auto request = (BPSGIRequest *) req;
+	return request->AddResponseHeader(name, namelen, value, valuelen) ? 1 : 0;
+}
+
+/*
+ * Returns 1 on success, or 0 if the client connection has been lost.
+ */
+int
+bladepsgi_perl_interpreter_cb_request_finish_headers(BPSGI_Request *req)
+{
+	auto request = (BPSGIRequest *) req;
+
+	try {
+		return request->FinishResponseHeaders() ? 1 : 0;
+	} catch (const SyscallException &ex) {
+		return 0;
+	}
+}
+
+/*
+ * Returns 1 on success, 0 if the client connection has been lost, or -1 if the
+ * file descriptor can't be sent without going through the Perl interpreter.
+ */
+int
+bladepsgi_perl_interpreter_cb_request_sendfile(BPSGI_Request *req, int fd, int64_t offset)
+{
+	auto request = (BPSGIRequest *) req;
+
+	try {
+		return request->SendFile(fd, offset);
+	} catch (const SyscallException &ex) {
+		return 0;
+	}
+}
+
+/*
+ * Returns the writer for a streamed response body.  If the response headers
+ * can't be sent, the writer is returned anyway, and writing to it will fail.
+ */
+BPSGI_Writer *
+bladepsgi_perl_interpreter_cb_request_writer(BPSGI_Request *req)
+{
+	auto request = (BPSGIRequest *) req;
+
+	try {
+		return (BPSGI_Writer *) request->StartStreaming();
+	} catch (const SyscallException &ex) {
+		/* the connection is broken now; writes will fail */
+		return (BPSGI_Writer *) request->writer();
+	}
+}
+
+/*
+ * Returns the number of bytes read, 0 on EOF or -1 on failure.
+ */
+int64_t
+bladepsgi_perl_interpreter_cb_input_read(BPSGI_Input *input, char *buf, size_t len)
+{
+	auto stream = (BPSGIInputStream *) input;
+
+	try {
+		return (int64_t) stream->Read(buf, len);
+	} catch (const SyscallException &ex) {
+		return -1;
+	} catch (const RuntimeException &ex) {
+		return -1;
+	}
+}
+
+int
+bladepsgi_perl_interpreter_cb_input_seek(BPSGI_Input *input, int64_t offset, int whence)
+{
+	auto stream = (BPSGIInputStream *) input;
+
+	try {
+		return stream->Seek(offset, whence) ? 1 : 0;
+	} catch (const SyscallException &ex) {
+		return 0;
+	} catch (const RuntimeException &ex) {
+		return 0;
+	}
+}
+
+int64_t
+bladepsgi_perl_interpreter_cb_input_tell(BPSGI_Input *input)
+{
+	auto stream = (BPSGIInputStream *) input;
+	return stream->Tell();
+}
+
+/*
+ * Returns 1 if more data can be written right away, 0 if the frontend isn't
+ * keeping up, or -1 if the writer is closed or the client connection lost.
+ */
+int
+bladepsgi_perl_interpreter_cb_writer_write(BPSGI_Writer *writer, const char *data, size_t len)
+{
+	auto w = (BPSGIStreamWriter *) writer;
+
+	try {
+		return w->Write(data, len);
+	} catch (const SyscallException &ex) {
+		return -1;
+	}
+}
+
+int
+bladepsgi_perl_interpreter_cb_writer_close(BPSGI_Writer *writer)
+{
+	auto w = (BPSGIStreamWriter *) writer;
+
+	try {
+		return w->Close() ? 1 : 0;
+	} catch (const SyscallException &ex) {
+		return 0;
+	}
+}
+
+int
+bladepsgi_perl_interpreter_cb_writer_wait_writable(BPSGI_Writer *writer)
+{
+	auto w = (BPSGIStreamWriter *) writer;
+
+	try {
+		return w->WaitWritable() ? 1 : 0;
+	} catch (const SyscallException &ex) {
+		return 0;
+	}
+}
+
+int64_t
+bladepsgi_perl_interpreter_cb_writer_written(BPSGI_Writer *writer)
+{
+	auto w = (BPSGIStreamWriter *) writer;
+	return w->written();
+}
+
+int
+bladepsgi_perl_interpreter_cb_writer_polling(BPSGI_Writer *writer)
+{
+	auto w = (BPSGIStreamWriter *) writer;
+	return w->polling() ? 1 : 0;
+}
+
+void
+bladepsgi_perl_interpreter_cb_writer_set_polling(BPSGI_Writer *writer, int polling)
+{
+	auto w = (BPSGIStreamWriter *) writer;
+	w->set_polling(polling != 0);
+}
+
 
 }
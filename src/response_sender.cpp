@@ -0,0 +1,268 @@
+#include "bladepsgi.hpp"
+
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+/* responses on which no progress has been made for this long are dropped */
+#define SENDER_STALL_TIMEOUT_USEC	((int64_t) 120 * 1000000)
+
+/* epoll data of the channel; everything else is a connection's socket */
+#define SENDER_CHANNEL_TAG			((uint64_t) 1 << 32)
+
+static sig_atomic_t _sender_terminated = 0;
+
+static void
+sender_sigterm_handler(int _unused)
+{
+	/*
+	 * The overseer only sends SIGTERM once all workers are gone, so nothing
+	 * new is going to arrive.  Finish what we have and exit.
+	 */
+	(void) _unused;
+	_sender_terminated = 1;
+}
+
+static void
+sender_sigquit_handler(int _unused)
+{
+	/* behave like worker_sigquit_handler */
+	(void) _unused;
+	_exit(2);
+}
+
+BPSGIResponseSender::BPSGIResponseSender(BPSGIMainApplication *mainapp, int senderno)
+	: mainapp_(mainapp),
+	  senderno_(senderno),
+	  stats_(mainapp->shmem()->SenderStats(senderno)),
+	  epollfd_(-1),
+	  message_buffer_(DISPATCH_INLINE_PREREAD_MAX)
+{
+}
+
+BPSGIResponseSender::~BPSGIResponseSender()
+{
+	for (auto && entry : responses_)
+	{
+		(void) close(entry.second->sockfd);
+		(void) close(entry.second->spoolfd);
+	}
+	if (epollfd_ != -1)
+		(void) close(epollfd_);
+}
+
+/*
+ * Takes over a response from a worker, and sends as much of it as possible
+ * right away.  Returns false if there was nothing to receive.
+ */
+bool
+BPSGIResponseSender::ReceiveResponse()
+{
+	BPSGIDispatchMessage msg;
+	int fds[2];
+	int nfds;
+
+	if (!BPSGIReceiveDispatchMessage(mainapp_->sender_channel(senderno_, false), &msg, message_buffer_, fds, &nfds))
+		return false;
+
+	if (msg.flags != (DISPATCH_CONNECTION | DISPATCH_RESPONSE_MEMFD) || nfds != 2)
+	{
+		for (int i = 0; i < nfds; i++)
+			(void) close(fds[i]);
+		throw RuntimeException("unexpected message from a worker");
+	}
+
+	struct stat st;
+	if (fstat(fds[1], &st) == -1)
+	{
+		(void) close(fds[0]);
+		(void) close(fds[1]);
+		throw SyscallException("fstat", errno);
+	}
+
+	auto response = make_unique<Response>();
+	response->sockfd = fds[0];
+	response->spoolfd = fds[1];
+	response->offset = 0;
+	response->size = st.st_size;
+	response->last_progress = BPSGIMonotonicTimeUsec();
+
+	std::atomic_fetch_add(&stats_->queued_responses, (int64_t) 1);
+	std::atomic_fetch_add(&stats_->bytes_in_flight, (int64_t) response->size);
+
+	if (SendResponse(response.get()))
+	{
+		FinishResponse(response.get(), true);
+		return true;
+	}
+	else if (response->sockfd == -1)
+		return true;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.u64 = (uint64_t) (uint32_t) response->sockfd;
+	if (epoll_ctl(epollfd_, EPOLL_CTL_ADD, response->sockfd, &ev) == -1)
+	{
+		FinishResponse(response.get(), false);
+		throw SyscallException("epoll_ctl", errno);
+	}
+	responses_[response->sockfd] = std::move(response);
+	return true;
+}
+
+/*
+ * Sends as much of the response as the socket takes without blocking.
+ * Returns true once the whole response has been sent.  If the connection was
+ * lost, the response is finished, and false is returned.
+ */
+bool
+BPSGIResponseSender::SendResponse(Response *response)
+{
+	while (response->offset < response->size)
+	{
+		off_t before = response->offset;
+		ssize_t ret = sendfile(response->sockfd, response->spoolfd, &response->offset, (size_t) (response->size - response->offset));
+		if (ret > 0)
+		{
+			int64_t sent = (int64_t) (response->offset - before);
+			std::atomic_fetch_add(&stats_->bytes_sent, sent);
+			std::atomic_fetch_sub(&stats_->bytes_in_flight, sent);
+			response->last_progress = BPSGIMonotonicTimeUsec();
+			continue;
+		}
+		else if (ret == -1 && errno == EINTR)
+			continue;
+		else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return false;
+		else if (ret == 0 || errno == EPIPE || errno == ECONNRESET)
+		{
+			FinishResponse(response, false);
+			return false;
+		}
+		throw SyscallException("sendfile", errno);
+	}
+	return true;
+}
+
+/*
+ * Closes the connection and forgets about the response.  The response object
+ * is destroyed if it's in responses_.
+ */
+void
+BPSGIResponseSender::FinishResponse(Response *response, bool ok)
+{
+	int sockfd = response->sockfd;
+
+	std::atomic_fetch_sub(&stats_->queued_responses, (int64_t) 1);
+	std::atomic_fetch_sub(&stats_->bytes_in_flight, (int64_t) (response->size - response->offset));
+	if (ok)
+		std::atomic_fetch_add(&stats_->responses, (int64_t) 1);
+	else
+		std::atomic_fetch_add(&stats_->failed_responses, (int64_t) 1);
+
+	(void) close(response->sockfd);
+	(void) close(response->spoolfd);
+	response->sockfd = -1;
+	response->spoolfd = -1;
+	responses_.erase(sockfd);
+}
+
+void
+BPSGIResponseSender::CloseStalledResponses(int64_t now)
+{
+	std::vector<Response *> stalled;
+
+	for (auto && entry : responses_)
+	{
+		if (now - entry.second->last_progress >= SENDER_STALL_TIMEOUT_USEC)
+			stalled.push_back(entry.second.get());
+	}
+	for (auto response : stalled)
+		FinishResponse(response, false);
+}
+
+int
+BPSGIResponseSender::Run()
+{
+	char process_title[64];
+
+	snprintf(process_title, sizeof(process_title), "sender %d", senderno_);
+	mainapp_->SubprocessInit(process_title, SUBP_NO_DEATHSIG);
+	mainapp_->SetSignalHandler(SIGINT, SIG_IGN);
+	mainapp_->SetSignalHandler(SIGTERM, sender_sigterm_handler);
+	mainapp_->SetSignalHandler(SIGQUIT, sender_sigquit_handler);
+	mainapp_->SetSignalHandler(SIGPIPE, SIG_IGN);
+	mainapp_->UnblockSignals();
+
+	int channel = mainapp_->sender_channel(senderno_, false);
+
+	epollfd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd_ == -1)
+		throw SyscallException("epoll_create1", errno);
+
+	/* only we read from the channel, so this doesn't affect anyone else */
+	int flags = fcntl(channel, F_GETFL);
+	if (flags == -1 || fcntl(channel, F_SETFL, flags | O_NONBLOCK) == -1)
+		throw SyscallException("fcntl", errno);
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = SENDER_CHANNEL_TAG;
+	if (epoll_ctl(epollfd_, EPOLL_CTL_ADD, channel, &ev) == -1)
+		throw SyscallException("epoll_ctl", errno);
+
+	int64_t last_stall_check = BPSGIMonotonicTimeUsec();
+	struct epoll_event events[64];
+
+	for (;;)
+	{
+		if (mainapp_->RunnerDied())
+		{
+			if (mainapp_->shmem()->SetShouldExitImmediately())
+				mainapp_->Log(LS_FATAL, "sender process noticed that the parent process has died; terminating all processes");
+			_exit(1);
+		}
+		else if (_sender_terminated == 1)
+		{
+			/* pick up anything the workers sent before exiting */
+			while (ReceiveResponse())
+				;
+			if (responses_.empty())
+				return 0;
+		}
+
+		int nevents = epoll_wait(epollfd_, events, (int) (sizeof(events) / sizeof(events[0])), 1000);
+		if (nevents == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			throw SyscallException("epoll_wait", errno);
+		}
+
+		for (int i = 0; i < nevents; i++)
+		{
+			if (events[i].data.u64 == SENDER_CHANNEL_TAG)
+			{
+				while (ReceiveResponse())
+					;
+				continue;
+			}
+
+			auto iter = responses_.find((int) events[i].data.u64);
+			if (iter == responses_.end())
+				continue;
+			Response *response = iter->second.get();
+			if (SendResponse(response))
+				FinishResponse(response, true);
+		}
+
+		int64_t now = BPSGIMonotonicTimeUsec();
+		if (now - last_stall_check >= 1000000)
+		{
+			CloseStalledResponses(now);
+			last_stall_check = now;
+		}
+	}
+}
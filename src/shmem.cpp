@@ -15,6 +15,10 @@ static_assert(sizeof(int_fast64_t) == sizeof(int64_t), "sizeof(int_fast64_t) mus
 static_assert((SHMEM_FIRST_USER_AVAILABLE_OFFSET % SHMEM_ALIGNOF) == 0, "SHMEM_FIRST_USER_AVAILABLE_OFFSET alignment");
 
 #define		SHMEM_WORKER_STATUS_ARRAY_OFF			2048
+#define		SHMEM_WORKER_STATS_ARRAY_OFF(NWORKERS)	SHMEMALIGN(SHMEM_WORKER_STATUS_ARRAY_OFF + (NWORKERS) * sizeof(std::atomic<int_fast8_t>))
+#define		SHMEM_DISPATCHER_STATS_OFF(NWORKERS)	SHMEMALIGN(SHMEM_WORKER_STATS_ARRAY_OFF(NWORKERS) + (NWORKERS) * sizeof(BPSGIWorkerStats))
+#define		SHMEM_SENDER_STATS_ARRAY_OFF(NWORKERS)	SHMEMALIGN(SHMEM_DISPATCHER_STATS_OFF(NWORKERS) + sizeof(BPSGIDispatcherStats))
+#define		SHMEM_POOL_STATS_OFF(NWORKERS)			SHMEMALIGN(SHMEM_SENDER_STATS_ARRAY_OFF(NWORKERS) + BPSGIResponseSender::max_senders * sizeof(BPSGISenderStats))
 
 BPSGISemaphore::BPSGISemaphore(sem_t *sem, std::string name)
 	: sem_(sem),
@@ -106,7 +110,14 @@ BPSGISharedMemory::NewSemaphore(std::string name, int64_t value)
 {
 	for (auto const &sem : semaphores_)
 	{
-		if (sem->name() == name)
+		/*
+		 * Allocations are locked once the application has been loaded, so
+		 * this can only be a new generation loading the application again;
+		 * it gets the semaphore the previous generation is still using.
+		 */
+		if (sem->name() == name && locked_)
+			return sem.get();
+		else if (sem->name() == name)
 			throw std::string("semaphore with name " + name + " already exists");
 	}
 
@@ -126,7 +137,10 @@ BPSGISharedMemory::NewAtomicInt64(std::string name, int64_t value)
 {
 	for (auto const &atm : atomics_)
 	{
-		if (atm->name() == name)
+		/* see NewSemaphore */
+		if (atm->name() == name && locked_)
+			return (int64_t *) atm->ptr();
+		else if (atm->name() == name)
 			throw std::string("atomic integer with name " + name + " already exists");
 	}
 
@@ -135,12 +149,24 @@ BPSGISharedMemory::NewAtomicInt64(std::string name, int64_t value)
 	return (int64_t *) ptr;
 }
 
-BPSGISharedMemory::BPSGISharedMemory(void *shared_memory_segment, size_t shmem_size)
+/*
+ * Returns the size of the shared memory segment required for the given number
+ * of workers.
+ */
+size_t
+BPSGISharedMemory::RequiredSize(int nworkers)
+{
+	return SHMEM_POOL_STATS_OFF(nworkers) + sizeof(BPSGIPoolStats);
+}
+
+BPSGISharedMemory::BPSGISharedMemory(void *shared_memory_segment, size_t shmem_size, int nworkers)
 	: shared_memory_segment_((char *) shared_memory_segment),
 	  shmem_size_(shmem_size),
+	  nworkers_(nworkers),
 	  locked_(false)
 {
 	Assert(shared_memory_segment_ != NULL);
+	Assert(shmem_size_ >= RequiredSize(nworkers_));
 
 	memset(shared_memory_segment, 0, shmem_size_);
 
@@ -171,6 +197,47 @@ BPSGISharedMemory::GetAllWorkerStatuses(int nworkers, char *out) const
 	}
 }
 
+BPSGIWorkerStats *
+BPSGISharedMemory::WorkerStats(WorkerNo workerno) const
+{
+	Assert(workerno >= 0 && workerno < nworkers_);
+
+	auto stats = (BPSGIWorkerStats *) (shared_memory_segment_ + SHMEM_WORKER_STATS_ARRAY_OFF(nworkers_));
+	return stats + (ptrdiff_t) workerno;
+}
+
+BPSGIDispatcherStats *
+BPSGISharedMemory::DispatcherStats() const
+{
+	return (BPSGIDispatcherStats *) (shared_memory_segment_ + SHMEM_DISPATCHER_STATS_OFF(nworkers_));
+}
+
+BPSGISenderStats *
+BPSGISharedMemory::SenderStats(int senderno) const
+{
+	Assert(senderno >= 0 && senderno < BPSGIResponseSender::max_senders);
+	return (BPSGISenderStats *) (shared_memory_segment_ + SHMEM_SENDER_STATS_ARRAY_OFF(nworkers_)) + senderno;
+}
+
+/*
+ * Returns how much of the offloaded responses the senders haven't sent yet.
+ * Senders which aren't running never count anything.
+ */
+int64_t
+BPSGISharedMemory::OffloadedBytesInFlight() const
+{
+	int64_t total = 0;
+	for (int senderno = 0; senderno < BPSGIResponseSender::max_senders; senderno++)
+		total += std::atomic_load(&SenderStats(senderno)->bytes_in_flight);
+	return total;
+}
+
+BPSGIPoolStats *
+BPSGISharedMemory::PoolStats() const
+{
+	return (BPSGIPoolStats *) (shared_memory_segment_ + SHMEM_POOL_STATS_OFF(nworkers_));
+}
+
 int_fast64_t
 BPSGISharedMemory::IncreaseRequestCounter()
 {
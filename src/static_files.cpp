@@ -0,0 +1,383 @@
+#include "bladepsgi.hpp"
+
+#include <algorithm>
+
+#include <sys/resource.h>
+#include <time.h>
+
+/* how long a cached open file or miss is trusted before checking it again */
+#define STATIC_FILES_REVALIDATE_USEC	1000000
+/*
+ * At most this many files are kept open, and no more than a quarter of
+ * RLIMIT_NOFILE; the application needs file descriptors, too.
+ */
+#define STATIC_FILES_MAX_OPEN			1024
+/* misses cost no file descriptor; they're forgotten all at once past this */
+#define STATIC_FILES_MAX_MISSES			1024
+
+static const struct {
+	const char *extension;
+	const char *content_type;
+} static_content_types[] = {
+	{ "avif", "image/avif" },
+	{ "css", "text/css" },
+	{ "csv", "text/csv" },
+	{ "eot", "application/vnd.ms-fontobject" },
+	{ "gif", "image/gif" },
+	{ "gz", "application/gzip" },
+	{ "htm", "text/html" },
+	{ "html", "text/html" },
+	{ "ico", "image/vnd.microsoft.icon" },
+	{ "jpeg", "image/jpeg" },
+	{ "jpg", "image/jpeg" },
+	{ "js", "application/javascript" },
+	{ "json", "application/json" },
+	{ "map", "application/json" },
+	{ "mjs", "application/javascript" },
+	{ "mp3", "audio/mpeg" },
+	{ "mp4", "video/mp4" },
+	{ "ogg", "audio/ogg" },
+	{ "otf", "font/otf" },
+	{ "pdf", "application/pdf" },
+	{ "png", "image/png" },
+	{ "svg", "image/svg+xml" },
+	{ "ttf", "font/ttf" },
+	{ "txt", "text/plain" },
+	{ "wasm", "application/wasm" },
+	{ "webm", "video/webm" },
+	{ "webp", "image/webp" },
+	{ "woff", "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ "xml", "application/xml" },
+	{ "zip", "application/zip" },
+};
+
+/*
+ * Picks the Content-Type by file name extension.  Like Plack::App::File, text
+ * types are declared UTF-8.
+ */
+static std::string
+static_content_type(const std::string &path)
+{
+	size_t slash = path.rfind('/');
+	size_t dot = path.rfind('.');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return "application/octet-stream";
+
+	std::string extension = path.substr(dot + 1);
+	for (auto && c : extension)
+		c = (char) tolower((unsigned char) c);
+	for (auto && entry : static_content_types)
+	{
+		if (extension == entry.extension)
+		{
+			std::string content_type(entry.content_type);
+			if (content_type.compare(0, 5, "text/") == 0)
+				content_type += "; charset=utf-8";
+			return content_type;
+		}
+	}
+	return "application/octet-stream";
+}
+
+static int
+static_hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	else if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Checks whether an Accept-Encoding value accepts gzip.  "gzip;q=0" refuses
+ * it; other quality values are ignored.
+ */
+static bool
+static_accepts_gzip(const char *value, size_t len)
+{
+	std::string accept(value, len);
+	size_t pos = 0;
+
+	while (pos < accept.size())
+	{
+		size_t end = accept.find(',', pos);
+		if (end == std::string::npos)
+			end = accept.size();
+		std::string coding = accept.substr(pos, end - pos);
+		pos = end + 1;
+
+		coding.erase(std::remove(coding.begin(), coding.end(), ' '), coding.end());
+		size_t semicolon = coding.find(';');
+		std::string name = coding.substr(0, semicolon);
+		if (strcasecmp(name.c_str(), "gzip") != 0 && name != "*")
+			continue;
+		if (semicolon != std::string::npos &&
+			(coding.compare(semicolon, std::string::npos, ";q=0") == 0 ||
+			 coding.compare(semicolon, std::string::npos, ";q=0.0") == 0 ||
+			 coding.compare(semicolon, std::string::npos, ";q=0.00") == 0 ||
+			 coding.compare(semicolon, std::string::npos, ";q=0.000") == 0))
+			return false;
+		return true;
+	}
+	return false;
+}
+
+/* checks whether If-None-Match lists etag, using the weak comparison */
+static bool
+static_etag_matches(const char *value, size_t len, const std::string &etag)
+{
+	std::string tags(value, len);
+	size_t pos = 0;
+
+	while (pos < tags.size())
+	{
+		size_t end = tags.find(',', pos);
+		if (end == std::string::npos)
+			end = tags.size();
+		size_t start = tags.find_first_not_of(" \t", pos);
+		size_t stop = tags.find_last_not_of(" \t", end - 1);
+		pos = end + 1;
+		if (start == std::string::npos || start > stop || stop >= end)
+			continue;
+
+		std::string tag = tags.substr(start, stop - start + 1);
+		if (tag == "*")
+			return true;
+		if (tag.compare(0, 2, "W/") == 0)
+			tag.erase(0, 2);
+		if (tag == etag)
+			return true;
+	}
+	return false;
+}
+
+BPSGIStaticFiles::BPSGIStaticFiles(const std::vector<BPSGIStaticMapping> &mappings)
+	: mappings_(mappings),
+	  max_open_files_(STATIC_FILES_MAX_OPEN)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY)
+		max_open_files_ = std::max(std::min(max_open_files_, (size_t) (rlim.rlim_cur / 4)), (size_t) 2);
+	no_file_.fd = -1;
+}
+
+BPSGIStaticFiles::~BPSGIStaticFiles()
+{
+	ClearCache();
+}
+
+void
+BPSGIStaticFiles::ClearCache()
+{
+	for (auto && entry : cache_)
+		(void) close(entry.second.fd);
+	cache_.clear();
+	lru_.clear();
+	misses_.clear();
+}
+
+/*
+ * Returns the cached open file for path, opening it or checking that it
+ * hasn't been replaced or modified if the cache entry is too old.  Once
+ * max_open_files_ files are open, the least recently used one is closed.
+ * That is never the one returned by the previous call, so Serve can hold on
+ * to both of the entries it looks up.
+ */
+const BPSGIStaticFiles::CachedFile &
+BPSGIStaticFiles::LookUp(const std::string &path)
+{
+	int64_t now = BPSGIMonotonicTimeUsec();
+
+	auto miss = misses_.find(path);
+	if (miss != misses_.end())
+	{
+		if (now - miss->second < STATIC_FILES_REVALIDATE_USEC)
+			return no_file_;
+		misses_.erase(miss);
+	}
+
+	auto it = cache_.find(path);
+	if (it != cache_.end())
+	{
+		CachedFile &file = it->second;
+		struct stat st;
+
+		if (now - file.checked_at < STATIC_FILES_REVALIDATE_USEC ||
+			(stat(path.c_str(), &st) == 0 &&
+			 st.st_dev == file.st.st_dev &&
+			 st.st_ino == file.st.st_ino &&
+			 st.st_size == file.st.st_size &&
+			 st.st_mtim.tv_sec == file.st.st_mtim.tv_sec &&
+			 st.st_mtim.tv_nsec == file.st.st_mtim.tv_nsec))
+		{
+			if (now - file.checked_at >= STATIC_FILES_REVALIDATE_USEC)
+				file.checked_at = now;
+			lru_.splice(lru_.begin(), lru_, file.lru);
+			return file;
+		}
+		(void) close(file.fd);
+		lru_.erase(file.lru);
+		cache_.erase(it);
+	}
+
+	CachedFile file;
+	file.fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (file.fd != -1 && (fstat(file.fd, &file.st) == -1 || !S_ISREG(file.st.st_mode)))
+	{
+		(void) close(file.fd);
+		file.fd = -1;
+	}
+	if (file.fd == -1)
+	{
+		/* e.g. random 404s mustn't push the open files out */
+		if (misses_.size() >= STATIC_FILES_MAX_MISSES)
+			misses_.clear();
+		misses_.emplace(path, now);
+		return no_file_;
+	}
+
+	if (cache_.size() >= max_open_files_)
+	{
+		auto &oldest = cache_.at(lru_.back());
+		(void) close(oldest.fd);
+		cache_.erase(lru_.back());
+		lru_.pop_back();
+	}
+	file.checked_at = now;
+	lru_.push_front(path);
+	file.lru = lru_.begin();
+	return cache_.emplace(path, file).first->second;
+}
+
+/*
+ * Sets path_ to the file system path of the file requested, if the request is
+ * a GET or a HEAD for a path under one of the prefixes.  Paths with "." or
+ * ".." segments are left to the application.
+ */
+bool
+BPSGIStaticFiles::MapPath(BPSGIRequest &request)
+{
+	size_t len;
+	const char *method = request.FindParam("REQUEST_METHOD", &len);
+	if (method == NULL ||
+		!((len == 3 && memcmp(method, "GET", 3) == 0) ||
+		  (len == 4 && memcmp(method, "HEAD", 4) == 0)))
+		return false;
+
+	const char *uri = request.FindParam("REQUEST_URI", &len);
+	if (uri == NULL)
+		return false;
+	const char *uri_end = (const char *) memchr(uri, '?', len);
+	if (uri_end == NULL)
+		uri_end = uri + len;
+
+	std::string path;
+	for (const char *p = uri; p < uri_end; p++)
+	{
+		if (*p == '%' && uri_end - p >= 3 && static_hex_value(p[1]) >= 0 && static_hex_value(p[2]) >= 0)
+		{
+			char c = (char) (static_hex_value(p[1]) * 16 + static_hex_value(p[2]));
+			if (c == '\0')
+				return false;
+			path.push_back(c);
+			p += 2;
+		}
+		else
+			path.push_back(*p);
+	}
+
+	for (auto && mapping : mappings_)
+	{
+		if (path.size() <= mapping.prefix.size() + 1 ||
+			path.compare(0, mapping.prefix.size(), mapping.prefix) != 0 ||
+			path[mapping.prefix.size()] != '/')
+			continue;
+
+		std::string rest = path.substr(mapping.prefix.size() + 1);
+		if (rest == "." || rest == ".." ||
+			rest.compare(0, 2, "./") == 0 || rest.compare(0, 3, "../") == 0 ||
+			rest.find("/./") != std::string::npos || rest.find("/../") != std::string::npos ||
+			(rest.size() >= 2 && rest.compare(rest.size() - 2, 2, "/.") == 0) ||
+			(rest.size() >= 3 && rest.compare(rest.size() - 3, 3, "/..") == 0))
+			return false;
+
+		path_ = mapping.directory + "/" + rest;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Answers the request if it's for a file in one of the --static directories.
+ * A gzipped sibling, e.g. app.js.gz for app.js, is sent instead if the client
+ * accepts gzip.  Returns false if the request should go to the application,
+ * which includes requests for files which don't exist.
+ */
+bool
+BPSGIStaticFiles::Serve(BPSGIRequest &request)
+{
+	if (mappings_.empty() || !MapPath(request))
+		return false;
+
+	const CachedFile *file = &LookUp(path_);
+	if (file->fd == -1)
+		return false;
+	gzip_path_ = path_ + ".gz";
+	const CachedFile *gzip_file = &LookUp(gzip_path_);
+	std::string content_type = static_content_type(path_);
+
+	size_t len;
+	const char *value;
+	bool gzipped = false;
+	if (gzip_file->fd != -1 &&
+		(value = request.FindParam("HTTP_ACCEPT_ENCODING", &len)) != NULL &&
+		static_accepts_gzip(value, len))
+	{
+		file = gzip_file;
+		gzipped = true;
+	}
+
+	char etag[64];
+	snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long) file->st.st_mtime, (unsigned long long) file->st.st_size);
+	std::string etag_str(etag);
+
+	char last_modified[HTTP_DATE_LEN + 1];
+	size_t last_modified_len = BPSGIHTTPFormatDate(file->st.st_mtime, last_modified);
+
+	bool not_modified = false;
+	if ((value = request.FindParam("HTTP_IF_NONE_MATCH", &len)) != NULL)
+		not_modified = static_etag_matches(value, len, etag_str);
+	else if ((value = request.FindParam("HTTP_IF_MODIFIED_SINCE", &len)) != NULL)
+	{
+		time_t since;
+		not_modified = BPSGIHTTPParseDate(value, len, &since) && file->st.st_mtime <= since;
+	}
+
+	std::string content_length = std::to_string((long long) file->st.st_size);
+
+	request.BeginResponseHeaders(not_modified ? 304 : 200);
+	if (!not_modified)
+	{
+		request.AddResponseHeader("Content-Type", 12, content_type.data(), content_type.size());
+		request.AddResponseHeader("Content-Length", 14, content_length.data(), content_length.size());
+		if (gzipped)
+			request.AddResponseHeader("Content-Encoding", 16, "gzip", 4);
+	}
+	request.AddResponseHeader("Last-Modified", 13, last_modified, last_modified_len);
+	request.AddResponseHeader("ETag", 4, etag_str.data(), etag_str.size());
+	if (gzip_file->fd != -1)
+		request.AddResponseHeader("Vary", 4, "Accept-Encoding", 15);
+	if (!request.FinishResponseHeaders())
+		return true;
+
+	value = request.FindParam("REQUEST_METHOD", &len);
+	if (not_modified || (len == 4 && memcmp(value, "HEAD", 4) == 0))
+		return true;
+	(void) request.SendFile(file->fd, 0);
+	return true;
+}
@@ -0,0 +1,94 @@
+#include "bladepsgi.hpp"
+
+#include <time.h>
+
+/*
+ * The coarse clock is plenty for millisecond intervals, and cheaper to read
+ * on every write.
+ */
+static int64_t
+monotonic_time_ms()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == -1)
+		throw SyscallException("clock_gettime", errno);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+BPSGIStreamWriter::BPSGIStreamWriter(BPSGIConnection *conn, BPSGIRequest *request, int flush_interval_ms)
+	: conn_(conn),
+	  request_(request),
+	  flush_interval_ms_(flush_interval_ms),
+	  closed_(false),
+	  polling_(false),
+	  written_(0),
+	  buffered_since_(-1)
+{
+}
+
+void
+BPSGIStreamWriter::Reset()
+{
+	closed_ = false;
+	polling_ = false;
+	written_ = 0;
+	buffered_since_ = -1;
+}
+
+/*
+ * Returns 1 if the writer can take more data right away, 0 if the frontend
+ * isn't keeping up and the data had to be left in the output buffer, or -1 if
+ * the writer has been closed or the connection lost.
+ */
+int
+BPSGIStreamWriter::Write(const char *data, size_t len)
+{
+	if (closed_ || !conn_->WriteStdout(request_->request_id(), data, len))
+		return -1;
+	written_ += (int64_t) len;
+
+	/* large writes go out directly and leave nothing behind */
+	if (!conn_->HasBufferedOutput())
+	{
+		buffered_since_ = -1;
+		return 1;
+	}
+
+	int64_t now = monotonic_time_ms();
+	if (buffered_since_ == -1)
+		buffered_since_ = now;
+	if (now - buffered_since_ < flush_interval_ms_)
+		return 1;
+
+	int ret = conn_->FlushNonBlocking();
+	if (ret == 1)
+		buffered_since_ = -1;
+	return ret;
+}
+
+/*
+ * Pushes out everything written so far.  The FastCGI request itself is only
+ * finished once the application returns.
+ */
+bool
+BPSGIStreamWriter::Close()
+{
+	closed_ = true;
+	polling_ = false;
+	buffered_since_ = -1;
+	return conn_->Flush();
+}
+
+/*
+ * Blocks until everything buffered has been written out.  Returns false if
+ * there's no point in writing any more.
+ */
+bool
+BPSGIStreamWriter::WaitWritable()
+{
+	if (closed_)
+		return false;
+	buffered_since_ = -1;
+	return conn_->Flush();
+}
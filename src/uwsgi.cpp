@@ -0,0 +1,179 @@
+#include "bladepsgi.hpp"
+
+/*
+ * A uwsgi request starts with a four-byte header: modifier1, the size of the
+ * variable block as a little-endian uint16, and modifier2.  The variable block
+ * is a sequence of names and values, each prefixed with its length as a
+ * little-endian uint16.  The request body follows, CONTENT_LENGTH bytes of it.
+ */
+#define UWSGI_HEADER_LEN			4
+
+/* modifier1 values nginx may be configured to send for a PSGI application */
+#define UWSGI_MODIFIER1_WSGI		0
+#define UWSGI_MODIFIER1_PSGI		5
+
+static inline uint16_t
+uwsgi_read_uint16(const char *p)
+{
+	return (uint16_t) ((unsigned char) p[0] | ((unsigned char) p[1] << 8));
+}
+
+/*
+ * Parses the value of CONTENT_LENGTH in a uwsgi variable block.  Returns -1 if
+ * it's malformed, and 0 if there's no CONTENT_LENGTH.
+ */
+static int64_t
+uwsgi_parse_content_length(const char *value, size_t len)
+{
+	int64_t result = 0;
+
+	if (len > 18)
+		return -1;
+	for (size_t i = 0; i < len; i++)
+	{
+		if (value[i] < '0' || value[i] > '9')
+			return -1;
+		result = result * 10 + (value[i] - '0');
+	}
+	return result;
+}
+
+/*
+ * Walks the variable block in data[0..len), calling callback for every
+ * variable.  Returns false if the block is malformed.
+ */
+template<typename Callback>
+static bool
+uwsgi_walk_vars(const char *data, size_t len, Callback callback)
+{
+	const char *p = data;
+	const char *end = data + len;
+
+	while (p < end)
+	{
+		if (end - p < 2)
+			return false;
+		size_t namelen = uwsgi_read_uint16(p);
+		p += 2;
+		if ((size_t) (end - p) < namelen + 2)
+			return false;
+		const char *name = p;
+		p += namelen;
+		size_t valuelen = uwsgi_read_uint16(p);
+		p += 2;
+		if ((size_t) (end - p) < valuelen)
+			return false;
+		callback(name, namelen, p, valuelen);
+		p += valuelen;
+	}
+	return true;
+}
+
+/*
+ * The uwsgi counterpart of BPSGIFastCGIScan.  uwsgi connections only ever
+ * carry one request, so they're never kept.
+ */
+void
+BPSGIUWSGIScan(const char *data, size_t len, BPSGIRequestScanState *state)
+{
+	if (!state->params_complete)
+	{
+		if (len < UWSGI_HEADER_LEN)
+			return;
+
+		size_t varslen = uwsgi_read_uint16(data + 1);
+		if (len < UWSGI_HEADER_LEN + varslen)
+			return;
+
+		state->request_id = 1;
+		state->keep_conn = false;
+		state->params_complete = true;
+		state->offset = UWSGI_HEADER_LEN + varslen;
+
+		int64_t content_length = 0;
+		bool valid = uwsgi_walk_vars(data + UWSGI_HEADER_LEN, varslen,
+			[&content_length](const char *name, size_t namelen, const char *value, size_t valuelen) {
+				if (namelen == 14 && memcmp(name, "CONTENT_LENGTH", 14) == 0)
+					content_length = uwsgi_parse_content_length(value, valuelen);
+			});
+		if (!valid || content_length < 0 ||
+			((unsigned char) data[0] != UWSGI_MODIFIER1_WSGI && (unsigned char) data[0] != UWSGI_MODIFIER1_PSGI))
+		{
+			/* let the worker complain */
+			state->complete = true;
+			state->exceptional = true;
+			return;
+		}
+		state->body_end = state->offset + (size_t) content_length;
+	}
+
+	if (!state->complete && len >= state->body_end)
+	{
+		state->complete = true;
+		state->offset = state->body_end;
+	}
+}
+
+/*
+ * Reads the header and the variable block of a uwsgi request.  The variables
+ * are the request parameters as they are, so the block is copied into the
+ * request and the parameters point into it; no re-encoding is needed as with
+ * HTTP.  The body is read like an HTTP body with a Content-Length.
+ */
+bool
+BPSGIConnection::ReadUWSGIRequest(BPSGIRequest &request)
+{
+	http_framing_ = HTTP_FRAMING_RAW;
+	http_response_started_ = false;
+	http_response_length_ = -1;
+	http_response_written_ = 0;
+	http_body_chunked_ = false;
+	http_chunk_crlf_pending_ = false;
+	http_expect_continue_ = false;
+
+	if (!FillInputBuffer(UWSGI_HEADER_LEN))
+	{
+		if (inbuf_end_ != inbuf_start_)
+			throw RuntimeException("unexpected EOF in the middle of a uwsgi request header");
+		return false;
+	}
+
+	const char *hdr = inbuf_.data() + inbuf_start_;
+	unsigned char modifier1 = (unsigned char) hdr[0];
+	size_t varslen = uwsgi_read_uint16(hdr + 1);
+	if (modifier1 != UWSGI_MODIFIER1_WSGI && modifier1 != UWSGI_MODIFIER1_PSGI)
+		throw RuntimeException("unsupported uwsgi modifier1 %d", (int) modifier1);
+
+	if (!FillInputBuffer(UWSGI_HEADER_LEN + varslen))
+		throw RuntimeException("unexpected EOF in the middle of a uwsgi request header");
+	const char *vars = inbuf_.data() + inbuf_start_ + UWSGI_HEADER_LEN;
+	request.params_data_.assign(vars, vars + varslen);
+	inbuf_start_ += UWSGI_HEADER_LEN + varslen;
+
+	int64_t content_length = 0;
+	bool valid = uwsgi_walk_vars(request.params_data_.data(), varslen,
+		[&request, &content_length](const char *name, size_t namelen, const char *value, size_t valuelen) {
+			BPSGIRequestParam param;
+
+			param.name = name;
+			param.namelen = namelen;
+			param.value = value;
+			param.valuelen = valuelen;
+			request.params_.push_back(param);
+			if (namelen == 14 && memcmp(name, "CONTENT_LENGTH", 14) == 0)
+				content_length = uwsgi_parse_content_length(value, valuelen);
+		});
+	if (!valid)
+		throw RuntimeException("malformed uwsgi variable block");
+	if (content_length < 0)
+		throw RuntimeException("invalid CONTENT_LENGTH in uwsgi request");
+
+	request.request_id_ = 1;
+	request.keep_conn_ = false;
+	request.params_complete_ = true;
+
+	http_body_remaining_ = content_length;
+	http_body_done_ = content_length == 0;
+	request.input_.Start(content_length);
+	return true;
+}
@@ -1,8 +1,18 @@
 #include "bladepsgi.hpp"
 
+#include <random>
+
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 
+/* worker status while running a request, unless the application sets its own */
+#define WORKER_STATUS_RUNNING	'R'
+/* worker status while running psgix.cleanup handlers */
+#define WORKER_STATUS_CLEANUP	'c'
+
 static sig_atomic_t _worker_terminated = 0;
+static sig_atomic_t _worker_retiring = 0;
 
 static void
 worker_sigterm_handler(int _unused)
@@ -15,6 +25,18 @@ worker_sigterm_handler(int _unused)
 	_worker_terminated = 1;
 }
 
+static void
+worker_sigusr1_handler(int _unused)
+{
+	/*
+	 * SIGUSR1 means the overseer is shrinking the worker pool.  Like SIGTERM,
+	 * but with --dispatcher we first have to make sure the dispatcher won't
+	 * hand us any more connections.
+	 */
+	(void) _unused;
+	_worker_retiring = 1;
+}
+
 static void
 worker_sigquit_handler(int _unused)
 {
@@ -29,7 +51,27 @@ worker_sigquit_handler(int _unused)
 
 BPSGIWorker::BPSGIWorker(BPSGIMainApplication *mainapp, WorkerNo workerno)
 	: mainapp_(mainapp),
-	  workerno_(workerno)
+	  workerno_(workerno),
+	  stats_(mainapp->shmem()->WorkerStats(workerno)),
+	  conn_(mainapp->worker_lane(workerno).protocol,
+			(size_t) mainapp->options().output_buffer_size,
+			mainapp->options().offload_senders > 0,
+			(int64_t) mainapp->options().offload_spool_limit * 1024 * 1024,
+			(int64_t) mainapp->options().offload_memory_limit * 1024 * 1024,
+			mainapp->shmem()),
+	  request_(&conn_,
+			   (size_t) mainapp->options().input_spool_threshold,
+			   mainapp->options().stream_flush_interval),
+	  static_files_(mainapp->options().static_mappings),
+	  ready_sent_(false),
+	  retiring_sent_(false),
+	  dispatch_buffer_(DISPATCH_INLINE_PREREAD_MAX),
+	  requests_served_(0),
+	  max_requests_(0),
+	  statm_fd_(-1),
+	  smaps_fd_(-1),
+	  page_size_(0),
+	  over_limit_at_start_(false)
 {
 }
 
@@ -39,6 +81,385 @@ BPSGIWorker::SetWorkerStatus(char status)
 	mainapp_->SetWorkerStatus(workerno_, status);
 }
 
+/*
+ * Waits for the frontend to send the next request on a kept-alive connection.
+ * Returns false if there isn't one yet, in which case the connection might
+ * have been closed.
+ *
+ * While we wait, we can't accept new connections, so if one is left waiting
+ * on the listen socket, the idle connection is closed to go and accept it
+ * instead.  Otherwise a frontend which opens more connections than there are
+ * workers could have a new connection wait for the whole keep-alive timeout.
+ */
+bool
+BPSGIWorker::WaitForNextRequest()
+{
+	if (conn_.HasBufferedInput())
+		return true;
+
+	auto &lane = mainapp_->worker_lane(workerno_);
+	struct pollfd pfds[2];
+	pfds[0].fd = conn_.sockfd();
+	pfds[0].events = POLLIN;
+	pfds[1].fd = mainapp_->worker_fastcgi_sockfd(workerno_);
+	pfds[1].events = POLLIN;
+
+	int64_t deadline = BPSGIMonotonicTimeUsec() + (int64_t) mainapp_->options().keepalive_timeout * 1000000;
+	for (;;)
+	{
+		int64_t remaining = deadline - BPSGIMonotonicTimeUsec();
+		if (remaining <= 0)
+			break;
+
+		pfds[0].revents = 0;
+		pfds[1].revents = 0;
+		int ret = poll(pfds, 2, (int) ((remaining + 999) / 1000));
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				return false;
+			throw SyscallException("poll", errno);
+		}
+		else if (ret == 0)
+			break;
+		else if (pfds[0].revents != 0)
+			return true;
+
+		/*
+		 * Every worker waiting on this listen socket sees the new connection,
+		 * and one blocked in accept() normally takes it right away.  Give
+		 * those a moment, and each of us a different one, so that only one
+		 * worker gives up its connection for it.  A --reuseport socket is
+		 * only ours.
+		 */
+		if (lane.sockfds.size() == 1)
+		{
+			pfds[0].revents = 0;
+			ret = poll(pfds, 1, 1 + (int) (workerno_ - lane.first_worker));
+			if (ret == 1)
+				return true;
+			else if (ret == -1 && errno == EINTR)
+				return false;
+			else if (ret == -1)
+				throw SyscallException("poll", errno);
+
+			pfds[1].revents = 0;
+			if (poll(&pfds[1], 1, 0) == 0)
+				continue;
+		}
+
+		std::atomic_fetch_add(&stats_->keepalive_drops, (int64_t) 1);
+		break;
+	}
+
+	/* idle timeout, or someone else needs the worker */
+	conn_.Close();
+	std::atomic_store(&stats_->connection_requests, (int64_t) 0);
+	return false;
+}
+
+/*
+ * Tells the dispatcher we're idle, unless we already have, and waits for it to
+ * hand us a connection.  Returns false if interrupted by a signal.
+ */
+bool
+BPSGIWorker::ReceiveConnection()
+{
+	int channel = mainapp_->dispatcher_channel(workerno_, true);
+
+	if (_worker_retiring == 1 && !retiring_sent_)
+	{
+		BPSGIDispatchMessage retiring;
+
+		/*
+		 * The dispatcher might have handed us a connection already; we serve
+		 * everything it sends before it confirms.
+		 */
+		memset(&retiring, 0, sizeof(retiring));
+		retiring.flags = DISPATCH_WORKER_RETIRING;
+		BPSGISendDispatchMessage(channel, retiring, NULL, 0, NULL, 0);
+		retiring_sent_ = true;
+	}
+	else if (!ready_sent_ && !retiring_sent_)
+	{
+		BPSGIDispatchMessage ready;
+
+		memset(&ready, 0, sizeof(ready));
+		ready.flags = DISPATCH_WORKER_READY;
+		BPSGISendDispatchMessage(channel, ready, NULL, 0, NULL, 0);
+		ready_sent_ = true;
+	}
+
+	BPSGIDispatchMessage msg;
+	int fds[2];
+	int nfds;
+	if (!BPSGIReceiveDispatchMessage(channel, &msg, dispatch_buffer_, fds, &nfds))
+		return false;
+	ready_sent_ = false;
+
+	if (msg.flags == DISPATCH_WORKER_RETIRING && nfds == 0)
+		_exit(0);
+
+	int expected_nfds = (msg.flags & DISPATCH_PREREAD_MEMFD) ? 2 : 1;
+	if (!(msg.flags & DISPATCH_CONNECTION) || nfds != expected_nfds)
+	{
+		for (int i = 0; i < nfds; i++)
+			(void) close(fds[i]);
+		throw RuntimeException("unexpected message from the dispatcher");
+	}
+
+	if (msg.flags & DISPATCH_PREREAD_MEMFD)
+	{
+		void *preread = mmap(NULL, msg.preread_len, PROT_READ, MAP_PRIVATE, fds[1], 0);
+		(void) close(fds[1]);
+		if (preread == MAP_FAILED)
+		{
+			(void) close(fds[0]);
+			throw SyscallException("mmap", errno);
+		}
+		conn_.Adopt(fds[0], (const char *) preread, msg.preread_len);
+		(void) munmap(preread, msg.preread_len);
+	}
+	else
+		conn_.Adopt(fds[0], dispatch_buffer_.data(), msg.preread_len);
+
+	if (msg.connection_requests == 0)
+		std::atomic_fetch_add(&stats_->connections, (int64_t) 1);
+	std::atomic_store(&stats_->connection_requests, msg.connection_requests);
+	std::atomic_fetch_add(&stats_->dispatch_wait_usec, BPSGIMonotonicTimeUsec() - msg.ready_at);
+	return true;
+}
+
+/*
+ * Hands a kept-alive connection back to the dispatcher, which waits for the
+ * next request on it so that we don't have to.
+ */
+void
+BPSGIWorker::ReturnConnection()
+{
+	BPSGIDispatchMessage msg;
+	int sockfd = conn_.sockfd();
+
+	memset(&msg, 0, sizeof(msg));
+	msg.flags = DISPATCH_CONNECTION;
+	msg.connection_requests = std::atomic_load(&stats_->connection_requests);
+	try {
+		BPSGISendDispatchMessage(mainapp_->dispatcher_channel(workerno_, true), msg, NULL, 0, &sockfd, 1);
+	} catch (const SyscallException &ex) {
+		mainapp_->Log(LS_WARNING, "could not return a connection to the dispatcher: system call %s failed: %s", ex.syscall(), ex.strerror());
+	}
+	conn_.Close();
+	std::atomic_store(&stats_->connection_requests, (int64_t) 0);
+}
+
+/*
+ * Parses the time a frontend received a request at, as sent in a header such
+ * as X-Request-Start.  The value may be prefixed with "t=", and is either
+ * seconds with a fraction (nginx's $msec) or an integer number of seconds,
+ * milliseconds or microseconds since the epoch, told apart by magnitude.
+ * Returns the time in microseconds, or -1 if the value can't be parsed.
+ */
+static int64_t
+parse_request_start_time(const char *value, size_t len)
+{
+	const char *p = value;
+	const char *end = value + len;
+	int64_t whole = 0;
+	int64_t fraction = 0;
+	int64_t scale = 1000000;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if (end - p >= 2 && p[0] == 't' && p[1] == '=')
+		p += 2;
+	if (p == end || *p < '0' || *p > '9')
+		return -1;
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+	{
+		whole = whole * 10 + (*p - '0');
+		if (whole > INT64_MAX / 100)
+			return -1;
+	}
+	if (p < end && *p == '.')
+	{
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+		{
+			if (scale > 1)
+			{
+				scale /= 10;
+				fraction += (*p - '0') * scale;
+			}
+		}
+		if (whole > INT64_MAX / 1000000 - 1)
+			return -1;
+		return whole * 1000000 + fraction;
+	}
+	if (p != end)
+		return -1;
+
+	if (whole >= (int64_t) 1000000000000000)
+		return whole;
+	else if (whole >= (int64_t) 1000000000000)
+		return whole * 1000;
+	return whole * 1000000;
+}
+
+/*
+ * With --queue-time-header, records how long the request took to get from
+ * the frontend to us, and answers it with a 503 if that exceeds
+ * --queue-deadline: its client has likely given up on it already, and running
+ * it would only delay the requests queued behind it.  Returns true if the
+ * request has been answered.
+ */
+bool
+BPSGIWorker::CheckQueueDeadline()
+{
+	auto &options = mainapp_->options();
+	if (options.queue_time_param.empty())
+		return false;
+
+	size_t len;
+	const char *value = request_.FindParam(options.queue_time_param.c_str(), &len);
+	int64_t start_usec = value == NULL ? -1 : parse_request_start_time(value, len);
+	if (start_usec < 0)
+	{
+		std::atomic_fetch_add(&stats_->queue_wait_missing, (int64_t) 1);
+		return false;
+	}
+
+	struct timespec now;
+	if (clock_gettime(CLOCK_REALTIME, &now) == -1)
+		throw SyscallException("clock_gettime", errno);
+	int64_t wait_usec = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000 - start_usec;
+	/* the frontend's clock may be ahead of ours */
+	if (wait_usec < 0)
+		wait_usec = 0;
+
+	int bucket = 0;
+	while (bucket < QUEUE_WAIT_HISTOGRAM_BUCKETS - 1 &&
+		   wait_usec > queue_wait_histogram_bounds_ms[bucket] * 1000)
+		bucket++;
+	std::atomic_fetch_add(&stats_->queue_wait_histogram[bucket], (int64_t) 1);
+	std::atomic_fetch_add(&stats_->queue_wait_usec, wait_usec);
+
+	if (options.queue_deadline == 0 || wait_usec <= (int64_t) options.queue_deadline * 1000)
+		return false;
+
+	static const char body[] = "Service Unavailable\n";
+	std::string retry_after = std::to_string(options.shed_retry_after);
+	std::string content_length = std::to_string(sizeof(body) - 1);
+
+	std::atomic_fetch_add(&stats_->queue_deadline_drops, (int64_t) 1);
+	request_.BeginResponseHeaders(503);
+	request_.AddResponseHeader("Content-Type", 12, "text/plain", 10);
+	request_.AddResponseHeader("Content-Length", 14, content_length.data(), content_length.size());
+	request_.AddResponseHeader("Retry-After", 11, retry_after.data(), retry_after.size());
+	if (request_.FinishResponseHeaders())
+		(void) request_.Write(body, sizeof(body) - 1);
+	return true;
+}
+
+/*
+ * If the frontend wasn't reading the response fast enough and the rest of it
+ * was spooled, passes the connection on to a sender process.  The connection
+ * is closed once the sender is done with it.
+ */
+void
+BPSGIWorker::OffloadResponse()
+{
+	BPSGIDispatchMessage msg;
+	int fds[2];
+
+	if (!conn_.TakeSpooledResponse(&fds[0], &fds[1]))
+		return;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.flags = DISPATCH_CONNECTION | DISPATCH_RESPONSE_MEMFD;
+	int senderno = (int) workerno_ % mainapp_->options().offload_senders;
+	try {
+		BPSGISendDispatchMessage(mainapp_->sender_channel(senderno, true), msg, NULL, 0, fds, 2);
+		std::atomic_fetch_add(&stats_->offloaded_responses, (int64_t) 1);
+	} catch (const SyscallException &ex) {
+		mainapp_->Log(LS_WARNING, "could not hand a response to sender %d: system call %s failed: %s", senderno, ex.syscall(), ex.strerror());
+	}
+	(void) close(fds[0]);
+	(void) close(fds[1]);
+}
+
+/*
+ * Opens the /proc files MemoryLimitExceeded reads.  They're kept open, since
+ * reading them again from offset 0 is all it takes to get a fresh copy.
+ */
+void
+BPSGIWorker::OpenMemoryFiles()
+{
+	const BPSGIOptions &options = mainapp_->options();
+
+	if (options.max_rss == 0 && options.max_private_dirty == 0)
+		return;
+
+	page_size_ = (int64_t) sysconf(_SC_PAGESIZE);
+	statm_fd_ = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+	if (statm_fd_ == -1)
+		throw SyscallException("open", "could not open /proc/self/statm: %s", strerror(errno));
+	if (options.max_private_dirty > 0)
+	{
+		smaps_fd_ = open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC);
+		if (smaps_fd_ == -1)
+			throw SyscallException("open", "could not open /proc/self/smaps_rollup: %s", strerror(errno));
+	}
+}
+
+/*
+ * Publishes how much memory we're using, and checks it against --max-rss
+ * and, if check_smaps is set, --max-private-dirty.  RSS is cheap to get from
+ * statm, but includes the pages we still share with the zygote; the private
+ * dirty memory in smaps_rollup is what we actually cost, but the kernel has
+ * to walk all of our page tables to count it.
+ */
+bool
+BPSGIWorker::MemoryLimitExceeded(bool check_smaps)
+{
+	const BPSGIOptions &options = mainapp_->options();
+	char buf[4096];
+	bool exceeded = false;
+
+	if (statm_fd_ == -1)
+		return false;
+
+	ssize_t len = pread(statm_fd_, buf, sizeof(buf) - 1, 0);
+	if (len == -1)
+		throw SyscallException("pread", errno);
+	buf[len] = '\0';
+
+	long long resident;
+	if (sscanf(buf, "%*s %lld", &resident) != 1)
+		throw RuntimeException("unexpected contents in /proc/self/statm");
+	int64_t rss = (int64_t) resident * page_size_;
+	std::atomic_store(&stats_->rss_bytes, rss);
+	if (rss > std::atomic_load(&stats_->rss_peak_bytes))
+		std::atomic_store(&stats_->rss_peak_bytes, rss);
+	if (options.max_rss > 0 && rss > (int64_t) options.max_rss * 1024 * 1024)
+		exceeded = true;
+
+	if (check_smaps && smaps_fd_ != -1)
+	{
+		len = pread(smaps_fd_, buf, sizeof(buf) - 1, 0);
+		if (len == -1)
+			throw SyscallException("pread", errno);
+		buf[len] = '\0';
+
+		const char *p = strstr(buf, "\nPrivate_Dirty:");
+		if (p == NULL)
+			throw RuntimeException("Private_Dirty not found in /proc/self/smaps_rollup");
+		int64_t private_dirty = (int64_t) strtoll(p + 15, NULL, 10) * 1024;
+		std::atomic_store(&stats_->private_dirty_bytes, private_dirty);
+		if (private_dirty > (int64_t) options.max_private_dirty * 1024 * 1024)
+			exceeded = true;
+	}
+	return exceeded;
+}
+
 void
 BPSGIWorker::MainLoopIteration(BPSGIPerlCallbackFunction &main_callback)
 {
@@ -46,12 +467,166 @@ BPSGIWorker::MainLoopIteration(BPSGIPerlCallbackFunction &main_callback)
 		_exit(1);
 	else if (_worker_terminated == 1)
 		_exit(0);
+	else if (_worker_retiring == 1 && !mainapp_->options().dispatcher)
+		_exit(0);
 
 	SetWorkerStatus('_');
 
-	main_callback.Call();
+	bool read_ok = false;
+	try {
+		if (!conn_.IsOpen() && mainapp_->options().dispatcher)
+		{
+			if (!ReceiveConnection())
+				return;
+		}
+		else if (!conn_.IsOpen())
+		{
+			if (!conn_.Accept(mainapp_->worker_fastcgi_sockfd(workerno_), mainapp_->worker_lane(workerno_).is_tcp))
+				return;
+			std::atomic_fetch_add(&stats_->connections, (int64_t) 1);
+			std::atomic_store(&stats_->connection_requests, (int64_t) 0);
+		}
+		else if (!WaitForNextRequest())
+			return;
+		read_ok = conn_.ReadRequest(request_);
+	} catch (const SyscallException &ex) {
+		mainapp_->Log(LS_WARNING, "could not read request: system call %s failed: %s", ex.syscall(), ex.strerror());
+	} catch (const RuntimeException &ex) {
+		mainapp_->Log(LS_WARNING, "could not read request: %s", ex.error());
+	}
+	if (!read_ok)
+	{
+		conn_.Close();
+		std::atomic_store(&stats_->connection_requests, (int64_t) 0);
+		return;
+	}
+
+	/*
+	 * With --max-requests, this might be our last request.  The dispatcher
+	 * can keep the connection for whichever worker comes next, but otherwise
+	 * it goes with us.
+	 */
+	requests_served_++;
+	bool recycle = max_requests_ > 0 && requests_served_ >= max_requests_;
+
+	/* an HTTP client is told up front that the connection won't be kept */
+	if (mainapp_->options().keepalive_timeout == 0 || _worker_terminated == 1 ||
+		((_worker_retiring == 1 || recycle) && !mainapp_->options().dispatcher))
+		request_.DisallowKeepConn();
+
+	SetWorkerStatus(WORKER_STATUS_RUNNING);
+
+	if (std::atomic_fetch_add(&stats_->connection_requests, (int64_t) 1) > 0)
+		std::atomic_fetch_add(&stats_->keepalive_requests, (int64_t) 1);
+	std::atomic_fetch_add(&stats_->requests, (int64_t) 1);
+
+	bool answered = false;
+	try {
+		answered = CheckQueueDeadline();
+		if (!answered && static_files_.Serve(request_))
+		{
+			std::atomic_fetch_add(&stats_->static_responses, (int64_t) 1);
+			answered = true;
+		}
+	} catch (const SyscallException &ex) {
+		mainapp_->Log(LS_WARNING, "could not answer request: system call %s failed: %s", ex.syscall(), ex.strerror());
+		conn_.Close();
+		answered = true;
+	} catch (const RuntimeException &ex) {
+		mainapp_->Log(LS_WARNING, "could not answer request: %s", ex.error());
+		conn_.Close();
+		answered = true;
+	}
+	bool harakiri = false;
+	if (!answered)
+		harakiri = main_callback.CallPSGIApplication(&request_);
+
+	/*
+	 * Whatever the application didn't read of the request body has to be
+	 * consumed before the connection can be reused.
+	 */
+	bool drained = false;
+	try {
+		if (conn_.IsOpen())
+		{
+			drained = request_.input()->Drain();
+			conn_.FinishRequest(request_);
+			OffloadResponse();
+		}
+	} catch (const SyscallException &ex) {
+		mainapp_->Log(LS_WARNING, "could not finish request: system call %s failed: %s", ex.syscall(), ex.strerror());
+		conn_.Close();
+	} catch (const RuntimeException &ex) {
+		mainapp_->Log(LS_WARNING, "could not finish request: %s", ex.error());
+		conn_.Close();
+	}
+
+	/*
+	 * Keep the connection around for the next request only if the frontend
+	 * asked us to.
+	 */
+	if (harakiri ||
+		(recycle && !mainapp_->options().dispatcher) ||
+		!request_.keep_conn() ||
+		!drained ||
+		!conn_.IsOpen() ||
+		conn_.IsBroken() ||
+		mainapp_->options().keepalive_timeout == 0)
+	{
+		conn_.Close();
+		std::atomic_store(&stats_->connection_requests, (int64_t) 0);
+	}
+	else if (mainapp_->options().dispatcher && !conn_.HasBufferedInput())
+		ReturnConnection();
+
+	/*
+	 * The frontend has the full response by now, so the psgix.cleanup handlers
+	 * don't add to its latency.  Their time is kept apart from request time in
+	 * the worker status array.
+	 */
+	if (main_callback.HasCleanupHandlers())
+	{
+		SetWorkerStatus(WORKER_STATUS_CLEANUP);
+
+		bool cleanup_harakiri = false;
+		try {
+			main_callback.RunCleanupHandlers(&cleanup_harakiri);
+		} catch (const PerlInterpreterException &ex) {
+			mainapp_->Log(LS_WARNING, "psgix.cleanup handler failed: %s", ex.strerror());
+		}
+		if (cleanup_harakiri)
+			harakiri = true;
+	}
 
 	mainapp_->shmem()->IncreaseRequestCounter();
+
+	/*
+	 * The application asked us to go away after this request.  The overseer
+	 * forks a replacement once it sees us exit with this code.
+	 */
+	if (harakiri)
+		_exit(harakiri_exit_code);
+
+	/* the overseer treats this just like psgix.harakiri */
+	if (recycle)
+	{
+		std::atomic_fetch_add(&stats_->recycles, (int64_t) 1);
+		_exit(harakiri_exit_code);
+	}
+
+	int smaps_interval = mainapp_->options().smaps_interval;
+	if (MemoryLimitExceeded(requests_served_ % smaps_interval == 0))
+	{
+		std::atomic_fetch_add(&stats_->memory_recycles, (int64_t) 1);
+
+		/*
+		 * A replacement would most likely be over the limit right away, too,
+		 * so have the overseer back off instead of forking one immediately.
+		 */
+		if (over_limit_at_start_)
+			_exit(memory_limit_exit_code);
+		_exit(harakiri_exit_code);
+	}
 }
 
 int
@@ -59,12 +634,41 @@ BPSGIWorker::Run(BPSGIPerlCallbackFunction &main_callback)
 {
 	char process_title[64];
 
-	snprintf(process_title, sizeof(process_title), "worker %d", (int) workerno_);
+	if (mainapp_->lanes().size() > 1)
+		snprintf(process_title, sizeof(process_title), "worker %d (%s)", (int) workerno_, mainapp_->worker_lane(workerno_).name.c_str());
+	else
+		snprintf(process_title, sizeof(process_title), "worker %d", (int) workerno_);
 	mainapp_->SubprocessInit(process_title, SUBP_DEFAULT_FLAGS);
+
+	/*
+	 * Every worker picks its own limit, so that workers started together
+	 * aren't all replaced at the same moment later on.
+	 */
+	if (mainapp_->options().max_requests > 0)
+	{
+		std::minstd_rand rng((unsigned) getpid() ^ (unsigned) BPSGIMonotonicTimeUsec());
+		std::uniform_int_distribution<int> jitter(0, mainapp_->options().max_requests_jitter);
+		max_requests_ = mainapp_->options().max_requests + jitter(rng);
+	}
+
+	/* the previous worker in this slot might have been much larger */
+	OpenMemoryFiles();
+	std::atomic_store(&stats_->rss_peak_bytes, (int64_t) 0);
+	if (MemoryLimitExceeded(true))
+	{
+		mainapp_->Log(LS_WARNING, "worker %d is over its memory limit before serving any requests", (int) workerno_);
+		over_limit_at_start_ = true;
+	}
+
 	mainapp_->SetSignalHandler(SIGCHLD, SIG_DFL);
 	mainapp_->SetSignalHandler(SIGINT, SIG_IGN);
 	mainapp_->SetSignalHandler(SIGTERM, worker_sigterm_handler);
 	mainapp_->SetSignalHandler(SIGQUIT, worker_sigquit_handler);
+	mainapp_->SetSignalHandler(SIGUSR1, worker_sigusr1_handler);
+	mainapp_->SetSignalHandler(SIGHUP, SIG_IGN);
+	mainapp_->SetSignalHandler(SIGUSR2, SIG_IGN);
+	/* a client going away shows up as EPIPE instead */
+	mainapp_->SetSignalHandler(SIGPIPE, SIG_IGN);
 	mainapp_->UnblockSignals();
 
 	try {